@@ -2,11 +2,39 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <alsa/asoundlib.h>
 
+#include "scarlett2-cache.h"
+#include "scarlett2-caps.h"
+#include "scarlett2-config.h"
+#include "scarlett2-delta.h"
+#include "scarlett2-engine.h"
 #include "scarlett2-firmware.h"
+#include "scarlett2-io.h"
 #include "scarlett2-ioctls.h"
+#include "scarlett2-kmsg.h"
+#include "scarlett2-policy.h"
+#include "scarlett2-profile.h"
+#include "scarlett2-queue.h"
+#include "scarlett2-session.h"
+#include "scarlett2-stats.h"
+#include "scarlett2-status.h"
+#include "scarlett2-timeline.h"
+#include "scarlett2-trace.h"
+#include "scarlett2-update.h"
+#include "scarlett2-watchdog.h"
 #include "scarlett2.h"
 
 #define REQUIRED_HWDEP_VERSION_MAJOR 1
@@ -25,6 +53,44 @@
 // Relative-to-executable firmware directory
 #define FIRMWARE_DIR "firmware"
 
+// Where triage looks for devices
+#define SYSFS_USB_DEVICES "/sys/bus/usb/devices"
+
+// Default fleet policy file for the apply command
+#define SYSTEM_POLICY_FILE "/etc/scarlett2/policy"
+
+// Default device profile file written by the characterize command
+#define SYSTEM_PROFILE_FILE "/var/lib/scarlett2/profiles"
+
+// How long list and list-all may use cached enumeration results
+#define CACHE_TTL 60
+
+// The firmware catalogue alone, for hotplug; it only changes when the
+// firmware directories do
+#define CATALOGUE_CACHE_FILE "/run/scarlett2/catalogue"
+#define CATALOGUE_CACHE_TTL 3600
+
+// After hotplug starts an update, further hotplug events for the
+// device are ignored for this long (including its re-enumeration
+// after the reboot, and retries if the update failed)
+#define HOTPLUG_DEBOUNCE_SEC 600
+#define HOTPLUG_DEBOUNCE_PREFIX "/run/scarlett2/hotplug."
+
+// socket of the resident job queue service (serve)
+#define QUEUE_SOCKET SCARLETT2_STATUS_DIR "/queue"
+
+// How long a device may take to disconnect after being told to
+// reboot, and then to come back ready for use
+#define REBOOT_DISCONNECT_TIMEOUT_MS 5000
+#define REBOOT_READY_TIMEOUT_MS 60000
+
+// with --window, profile-based estimates are scaled up by this much
+// to allow for unit-to-unit variation
+#define WINDOW_ESTIMATE_MARGIN 1.25
+
+// writes slower than this are shown on the timeline
+#define TIMELINE_SLOW_WRITE_MS 50
+
 // Supported devices
 struct scarlett2_device {
   int         pid;
@@ -57,12 +123,29 @@ struct scarlett2_device scarlett2_supported[] = {
 
 // found cards
 struct sound_card {
-  int         card_num;
-  char        card_name[32];
-  char        alsa_name[32];
-  int         pid;
-  const char *product_name;
-  int         firmware_version;
+  int          card_num;
+  char         card_name[32];
+  char         alsa_name[32];
+  int          pid;
+  const char  *product_name;
+  int          firmware_version;
+  char         serial[64];
+  char         usb_path[32];
+
+  // the open card, ioctl protocol version, and what the driver
+  // supports
+  snd_hwdep_t          *hwdep;
+  int                   protocol_version;
+  struct scarlett2_caps caps;
+
+  // size of the last flash segment erased
+  int          erase_num_blocks;
+
+  // when the current update phase started, for the timeline
+  double       phase_start_us;
+
+  // live status page, if it could be created
+  struct scarlett2_status_page *status;
 };
 
 // list of found cards
@@ -84,14 +167,69 @@ const char *program_name;
 
 // command-line parameters
 const char *command = NULL;
-int selected_card_num = -1;
+int *selected_card_nums = NULL;
+int selected_card_nums_count = 0;
 struct sound_card *selected_card = NULL;
+struct sound_card **selected_cards = NULL;
+int selected_cards_count = 0;
 int selected_firmware_version = 0;
-struct scarlett2_firmware_file *selected_firmware = NULL;
+const char *policy_fn = SYSTEM_POLICY_FILE;
+int probe_count = 50;
+double latency_budget_ms = 0;
+const char *profile_fn = SYSTEM_PROFILE_FILE;
+int update_cycles = 0;
+int max_drift_pct = 0;
+int replay_speed = 1;
+int sample_every = 100;
+int max_rss_growth_kb = 1024;
+int max_fd_growth = 0;
+int assume_yes = 0;
+int use_cache = 1;
+double window_sec = 0;
+int window_slots = 0;
+int max_wave = 0;
+const char *record_fn = NULL;
+const char *replay_fn = NULL;
+int show_timeline = 0;
+int cache_neutral = 0;
+int keep_config = 0;
+int op_deadline_ms = SCARLETT2_WATCHDOG_DEFAULT_MS;
+int show_op_stats = 0;
+int queue_priority = -1;
+
+// the phases of a soak cycle
+enum soak_phase {
+  SOAK_ENUMERATE,
+  SOAK_SELECT,
+  SOAK_RESET_CONFIG,
+  SOAK_ERASE_FIRMWARE,
+  SOAK_WRITE,
+  SOAK_REBOOT,
+  SOAK_REBOOT_WAIT,
+  SOAK_PHASE_COUNT
+};
+
+// while soaking, the time taken by each phase, by soak_phase
+struct scarlett2_stats *soak_phase_us = NULL;
+
+// subcommand and arguments of delta and config
+const char *command_args[3];
+int command_args_count = 0;
+
+// with --keep-config, the keep-config rules from the policy file
+struct scarlett2_policy *keep_config_policy = NULL;
+
+// device profiles, if any, for estimating update durations
+struct scarlett2_profiles *profiles = NULL;
 
-// the open card & ioctl protocol version
-snd_hwdep_t *hwdep = NULL;
-int protocol_version = 0;
+// set when operating on more than one card at once; progress
+// messages are then prefixed with the card name and the in-place
+// percentage updates are suppressed
+int multi_card = 0;
+
+// how long each enumeration took, for the --timeline overlap
+double enum_cards_us = 0;
+double enum_firmwares_us = 0;
 
 // validate the VID and return the PID
 static int check_usb_id(const char *card_name) {
@@ -132,6 +270,62 @@ static int check_usb_id(const char *card_name) {
   return pid;
 }
 
+// read a single-line sysfs attribute, stripping the newline
+static void read_sysfs_attr(
+  const char *dir,
+  const char *attr,
+  char       *buf,
+  size_t      buf_size
+) {
+  char path[PATH_MAX];
+
+  buf[0] = 0;
+
+  if (snprintf(path, sizeof(path), "%s/%s", dir, attr) >= sizeof(path))
+    return;
+
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return;
+
+  if (!fgets(buf, buf_size, f))
+    buf[0] = 0;
+  fclose(f);
+
+  buf[strcspn(buf, "\n")] = 0;
+}
+
+// find the USB serial number and USB path (e.g. "1-2.3") of a card
+// from sysfs; /sys/class/sound/<card>/device is the USB interface,
+// and its parent directory is the USB device
+static void get_usb_info(struct sound_card *sc) {
+  char link[PATH_MAX];
+  char dev_path[PATH_MAX];
+
+  sc->serial[0] = 0;
+  sc->usb_path[0] = 0;
+
+  snprintf(link, sizeof(link), "/sys/class/sound/%s/device", sc->card_name);
+  if (!realpath(link, dev_path))
+    return;
+
+  char *last_slash = strrchr(dev_path, '/');
+  if (!last_slash)
+    return;
+  *last_slash = '\0';
+
+  last_slash = strrchr(dev_path, '/');
+  if (!last_slash)
+    return;
+
+  snprintf(sc->usb_path, sizeof(sc->usb_path), "%s", last_slash + 1);
+  read_sysfs_attr(dev_path, "serial", sc->serial, sizeof(sc->serial));
+
+  // with --timeline, kernel messages about the device are shown too
+  if (show_timeline)
+    scarlett2_kmsg_watch(sc->usb_path);
+}
+
 static struct scarlett2_device *get_device_for_pid(int pid) {
   for (int i = 0; scarlett2_supported[i].name; i++)
     if (scarlett2_supported[i].pid == pid)
@@ -140,14 +334,14 @@ static struct scarlett2_device *get_device_for_pid(int pid) {
   return NULL;
 }
 
+// read the Firmware Version control; returns the version or a
+// negative error code
 static int get_firmware_version(const char *alsa_name) {
   int err;
   snd_ctl_t* ctl_handle;
-  snd_ctl_elem_id_t* id;
-  snd_ctl_elem_value_t* control;
 
   // Open the control interface for the specified sound card
-  if ((err = snd_ctl_open(&ctl_handle, alsa_name, 0)) < 0) {
+  if ((err = scarlett2_ctl_open(alsa_name, &ctl_handle)) < 0) {
     fprintf(
       stderr,
       "Unable to open control interface for card %s: %s\n",
@@ -158,17 +352,8 @@ static int get_firmware_version(const char *alsa_name) {
     return -1;
   }
 
-  snd_ctl_elem_id_alloca(&id);
-  snd_ctl_elem_value_alloca(&control);
-
-  // Set the control we're interested in
-  snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_CARD);
-  snd_ctl_elem_id_set_name(id, "Firmware Version");
-
-  snd_ctl_elem_value_set_id(control, id);
-
-  // Read the control value
-  if (snd_ctl_elem_read(ctl_handle, control) < 0) {
+  int version = scarlett2_ctl_get_firmware_version(ctl_handle);
+  if (version < 0) {
     fprintf(
       stderr,
       "Found supported Scarlett2 device at %s, but cannot read the\n"
@@ -177,22 +362,93 @@ static int get_firmware_version(const char *alsa_name) {
       alsa_name
     );
 
-    snd_ctl_close(ctl_handle);
+    scarlett2_ctl_close(ctl_handle);
     return -1;
   }
 
-  int version = snd_ctl_elem_value_get_integer(control, 0);
-
-  snd_ctl_close(ctl_handle);
+  scarlett2_ctl_close(ctl_handle);
 
   return version;
 }
 
+static void set_card_num(struct sound_card *sc, int card_num) {
+  sc->card_num = card_num;
+  snprintf(sc->card_name, sizeof(sc->card_name), "card%d", card_num);
+  snprintf(sc->alsa_name, sizeof(sc->alsa_name), "hw:%d", card_num);
+}
+
+static struct sound_card *add_card(int card_num, int pid) {
+  struct scarlett2_device *dev = get_device_for_pid(pid);
+  if (!dev)
+    return NULL;
+
+  found_cards_count++;
+  found_cards = realloc(
+    found_cards,
+    sizeof(*found_cards) * found_cards_count
+  );
+  if (!found_cards) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+
+  struct sound_card *sc = &found_cards[found_cards_count - 1];
+  memset(sc, 0, sizeof(*sc));
+  set_card_num(sc, card_num);
+  sc->pid = pid;
+  sc->product_name = dev->name;
+
+  return sc;
+}
+
+// the cards as found when the session was recorded
+static void enum_session_cards(void) {
+  int count;
+  struct scarlett2_session_card *cards = scarlett2_session_get_cards(&count);
+
+  for (int i = 0; i < count; i++) {
+    struct sound_card *sc = add_card(cards[i].card_num, cards[i].pid);
+    if (!sc)
+      continue;
+
+    sc->firmware_version = cards[i].firmware_version;
+    strcpy(sc->serial, cards[i].serial);
+    strcpy(sc->usb_path, cards[i].usb_path);
+  }
+}
+
+// save the cards found to the session being recorded
+static void record_session_cards(void) {
+  for (int i = 0; i < found_cards_count; i++) {
+    struct sound_card *sc = &found_cards[i];
+    struct scarlett2_session_card card = {
+      .card_num         = sc->card_num,
+      .pid              = sc->pid,
+      .firmware_version = sc->firmware_version
+    };
+
+    strcpy(card.serial, sc->serial);
+    strcpy(card.usb_path, sc->usb_path);
+    scarlett2_session_add_card(&card);
+  }
+}
+
 static void enum_cards(void) {
   int card_num = -1;
 
-  if (snd_card_next(&card_num) < 0 || card_num < 0)
+  if (scarlett2_session_replaying()) {
+    enum_session_cards();
     return;
+  }
+
+  TRACE0(enum_begin);
+  double start_us = scarlett2_now_us();
+
+  // enumeration is recorded as its result
+  scarlett2_session_suppress(1);
+
+  if (snd_card_next(&card_num) < 0 || card_num < 0)
+    goto done;
 
   while (card_num >= 0) {
     char card_name[32];
@@ -202,40 +458,66 @@ static void enum_cards(void) {
     if (!pid)
       goto next;
 
-    struct scarlett2_device *dev = get_device_for_pid(pid);
-    if (!dev)
+    struct sound_card *sc = add_card(card_num, pid);
+    if (!sc)
       goto next;
 
-    found_cards_count++;
-    found_cards = realloc(
-      found_cards,
-      sizeof(*found_cards) * found_cards_count
-    );
-    if (!found_cards) {
-      perror("realloc");
-      exit(EXIT_FAILURE);
-    }
-
-    struct sound_card *sc = &found_cards[found_cards_count - 1];
-    sc->card_num = card_num;
-    strcpy(sc->card_name, card_name);
-    snprintf(sc->alsa_name, sizeof(sc->alsa_name), "hw:%d", card_num);
-    sc->pid = pid;
-    sc->product_name = dev->name;
     sc->firmware_version = get_firmware_version(sc->alsa_name);
+    get_usb_info(sc);
 
 next:
     if (snd_card_next(&card_num) < 0)
       break;
   }
+
+done:
+  scarlett2_session_suppress(0);
+  record_session_cards();
+
+  TRACE1(enum_end, found_cards_count);
+  enum_cards_us = scarlett2_now_us() - start_us;
+  scarlett2_timeline_add(
+    NULL, "enumerate cards", start_us, start_us + enum_cards_us
+  );
+}
+
+static struct sound_card *get_card(int card_num) {
+  for (int i = 0; i < found_cards_count; i++)
+    if (found_cards[i].card_num == card_num)
+      return &found_cards[i];
+
+  return NULL;
+}
+
+// for commands which are harmless to run on every card, select all
+// cards if none were specified with -c
+static void select_all_cards(void) {
+  if (selected_card_nums_count)
+    return;
+
+  selected_card_nums = calloc(found_cards_count, sizeof(*selected_card_nums));
+  if (found_cards_count && !selected_card_nums) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < found_cards_count; i++)
+    selected_card_nums[i] = found_cards[i].card_num;
+  selected_card_nums_count = found_cards_count;
 }
 
-static void check_card_selection(void) {
+// fill in selected_cards from the -c options; only commands which
+// can operate on a batch of cards allow more than one
+static void check_card_selection(int allow_multiple) {
   if (!found_cards_count) {
     fprintf(stderr, "No supported devices found\n");
     exit(EXIT_FAILURE);
   }
-  if (selected_card_num == -1) {
+  if (selected_card_nums_count > 1 && !allow_multiple) {
+    fprintf(stderr, "Error: multiple cards specified\n");
+    exit(EXIT_FAILURE);
+  }
+  if (!selected_card_nums_count) {
     if (found_cards_count > 1) {
       fprintf(stderr, "Error: more than one supported device found\n");
       fprintf(
@@ -246,23 +528,43 @@ static void check_card_selection(void) {
       );
       exit(EXIT_FAILURE);
     }
-    selected_card_num = found_cards[0].card_num;
+    selected_card_nums = malloc(sizeof(*selected_card_nums));
+    if (!selected_card_nums) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    selected_card_nums[0] = found_cards[0].card_num;
+    selected_card_nums_count = 1;
   }
 
-  for (int i = 0; i < found_cards_count; i++)
-    if (found_cards[i].card_num == selected_card_num) {
-      selected_card = &found_cards[i];
-      printf("Selected device %s\n", selected_card->product_name);
-      return;
+  selected_cards = calloc(selected_card_nums_count, sizeof(*selected_cards));
+  if (!selected_cards) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < selected_card_nums_count; i++) {
+    struct sound_card *sc = get_card(selected_card_nums[i]);
+
+    if (!sc) {
+      fprintf(
+        stderr,
+        "Error: selected card %d not found\n",
+        selected_card_nums[i]
+      );
+      fprintf(
+        stderr,
+        "Use '%s list' to list supported devices\n",
+        program_name
+      );
+      exit(EXIT_FAILURE);
     }
 
-  fprintf(stderr, "Error: selected card %d not found\n", selected_card_num);
-  fprintf(
-    stderr,
-    "Use '%s list' to list supported devices\n",
-    program_name
-  );
-  exit(EXIT_FAILURE);
+    printf("Selected device %s\n", sc->product_name);
+    selected_cards[selected_cards_count++] = sc;
+  }
+
+  selected_card = selected_cards[0];
 }
 
 static void add_found_firmware(
@@ -311,8 +613,9 @@ static void enum_firmware_dir(const char *dirname) {
 
   while ((entry = readdir(dir)) != NULL) {
 
-    // Check if the file is a .bin file
-    if (!strstr(entry->d_name, ".bin"))
+    // Check if the file is a .bin file or a delta
+    if (!strstr(entry->d_name, ".bin") &&
+        !strstr(entry->d_name, DELTA_SUFFIX))
       continue;
 
     // Construct full path
@@ -413,6 +716,7 @@ static int found_firmware_cmp(const void *p1, const void *p2) {
 }
 
 static void enum_firmwares(void) {
+  double start_us = scarlett2_now_us();
 
   /* look for firmware files in the exec-relative firmware directory */
   char *firmware_dir = get_firmware_exec_dir();
@@ -430,6 +734,287 @@ static void enum_firmwares(void) {
     sizeof(*found_firmwares),
     found_firmware_cmp
   );
+
+  enum_firmwares_us = scarlett2_now_us() - start_us;
+  scarlett2_timeline_add(
+    NULL, "enumerate firmware", start_us, start_us + enum_firmwares_us
+  );
+}
+
+// card enumeration (ALSA and /proc) and firmware enumeration (the
+// firmware directories) don't share anything, so the firmware is
+// enumerated in a thread while the caller enumerates and selects
+// cards
+static pthread_t enum_firmwares_thread_id;
+static int enum_firmwares_started;
+static double enum_start_us;
+
+static void *enum_firmwares_thread(void *arg) {
+  enum_firmwares();
+  return NULL;
+}
+
+static void start_enum_firmwares(void) {
+  enum_start_us = scarlett2_now_us();
+
+  int err = pthread_create(
+    &enum_firmwares_thread_id, NULL, enum_firmwares_thread, NULL
+  );
+  if (err) {
+    enum_firmwares();
+    return;
+  }
+
+  enum_firmwares_started = 1;
+}
+
+static void finish_enum_firmwares(void) {
+  if (enum_firmwares_started) {
+    pthread_join(enum_firmwares_thread_id, NULL);
+    enum_firmwares_started = 0;
+  }
+
+  // how much of the shorter enumeration was hidden behind the longer
+  double end_us = scarlett2_now_us();
+  double overlap_us = enum_cards_us + enum_firmwares_us -
+                      (end_us - enum_start_us);
+  char what[80];
+
+  snprintf(
+    what, sizeof(what),
+    "enumerate cards and firmware (%.3f ms overlapped)",
+    overlap_us > 0 ? overlap_us / 1000 : 0
+  );
+  scarlett2_timeline_add(NULL, what, enum_start_us, end_us);
+}
+
+static void enum_cards_and_firmwares(void) {
+  start_enum_firmwares();
+  enum_cards();
+  finish_enum_firmwares();
+}
+
+// release the found cards and firmware
+static void free_found(void) {
+  for (int i = 0; i < found_firmwares_count; i++) {
+    free(found_firmwares[i].fn);
+    free(found_firmwares[i].firmware);
+  }
+  free(found_firmwares);
+  found_firmwares = NULL;
+  found_firmwares_count = 0;
+  free(found_cards);
+  found_cards = NULL;
+  found_cards_count = 0;
+}
+
+// enumeration cache contents: a cache_data, then the cards, then the
+// firmwares, then the firmware filenames
+struct cache_data {
+  uint32_t card_count;
+  uint32_t firmware_count;
+  uint32_t strings_len;
+};
+
+struct cached_card {
+  int32_t card_num;
+  int32_t pid;
+  int32_t firmware_version;
+  char    serial[64];
+  char    usb_path[32];
+};
+
+struct cached_firmware {
+  struct scarlett2_firmware_header header;
+  uint32_t                         fn_offset;
+};
+
+static void get_cache_key(struct scarlett2_cache_key *key) {
+  char *firmware_dir = get_firmware_exec_dir();
+  const char *dirs[] = { firmware_dir, SYSTEM_FIRMWARE_DIR };
+
+  scarlett2_cache_get_key(key, dirs, 2);
+  free(firmware_dir);
+}
+
+// fill in found_cards and found_firmwares from a cache file; returns
+// 0 on a cache hit
+static int load_enum_cache(
+  const char                 *fn,
+  struct scarlett2_cache_key *key,
+  int                         ttl
+) {
+  size_t len;
+  const struct cache_data *data = scarlett2_cache_load(fn, key, ttl, &len);
+
+  if (!data)
+    return -1;
+
+  if (len < sizeof(*data) ||
+      data->card_count > 256 ||
+      data->firmware_count > 65536)
+    goto miss;
+
+  const struct cached_card *cards = (const void *)(data + 1);
+  const struct cached_firmware *firmwares =
+    (const void *)(cards + data->card_count);
+  const char *strings = (const void *)(firmwares + data->firmware_count);
+
+  if (len != sizeof(*data) +
+             sizeof(*cards) * data->card_count +
+             sizeof(*firmwares) * data->firmware_count +
+             data->strings_len ||
+      (data->strings_len && strings[data->strings_len - 1]))
+    goto miss;
+
+  if (data->card_count)
+    found_cards = calloc(data->card_count, sizeof(*found_cards));
+  if (data->firmware_count)
+    found_firmwares = calloc(
+      data->firmware_count, sizeof(*found_firmwares)
+    );
+  if ((data->card_count && !found_cards) ||
+      (data->firmware_count && !found_firmwares))
+    goto miss;
+
+  for (int i = 0; i < data->card_count; i++) {
+    const struct cached_card *cc = &cards[i];
+    struct sound_card *sc = &found_cards[i];
+    struct scarlett2_device *dev = get_device_for_pid(cc->pid);
+
+    if (!dev)
+      goto miss;
+
+    sc->card_num = cc->card_num;
+    snprintf(sc->card_name, sizeof(sc->card_name), "card%d", cc->card_num);
+    snprintf(sc->alsa_name, sizeof(sc->alsa_name), "hw:%d", cc->card_num);
+    sc->pid = cc->pid;
+    sc->product_name = dev->name;
+    sc->firmware_version = cc->firmware_version;
+    snprintf(
+      sc->serial, sizeof(sc->serial), "%.*s",
+      (int)sizeof(cc->serial) - 1, cc->serial
+    );
+    snprintf(
+      sc->usb_path, sizeof(sc->usb_path), "%.*s",
+      (int)sizeof(cc->usb_path) - 1, cc->usb_path
+    );
+    found_cards_count++;
+  }
+
+  for (int i = 0; i < data->firmware_count; i++) {
+    const struct cached_firmware *cf = &firmwares[i];
+    struct found_firmware *ff = &found_firmwares[i];
+
+    if (cf->fn_offset >= data->strings_len)
+      goto miss;
+
+    ff->fn = strdup(strings + cf->fn_offset);
+    ff->firmware = malloc(sizeof(*ff->firmware));
+    found_firmwares_count++;
+    if (!ff->fn || !ff->firmware)
+      goto miss;
+    *ff->firmware = cf->header;
+  }
+
+  scarlett2_cache_release(data, len);
+  return 0;
+
+miss:
+  free_found();
+
+  scarlett2_cache_release(data, len);
+  return -1;
+}
+
+static void save_enum_cache(
+  const char                 *fn,
+  struct scarlett2_cache_key *key
+) {
+  struct cache_data data = {
+    .card_count     = found_cards_count,
+    .firmware_count = found_firmwares_count
+  };
+
+  for (int i = 0; i < found_firmwares_count; i++)
+    data.strings_len += strlen(found_firmwares[i].fn) + 1;
+
+  size_t len = sizeof(data) +
+               sizeof(struct cached_card) * data.card_count +
+               sizeof(struct cached_firmware) * data.firmware_count +
+               data.strings_len;
+
+  char *buf = calloc(1, len);
+  if (!buf)
+    return;
+
+  memcpy(buf, &data, sizeof(data));
+
+  struct cached_card *cards = (void *)(buf + sizeof(data));
+  for (int i = 0; i < found_cards_count; i++) {
+    struct sound_card *sc = &found_cards[i];
+
+    cards[i].card_num = sc->card_num;
+    cards[i].pid = sc->pid;
+    cards[i].firmware_version = sc->firmware_version;
+    memcpy(cards[i].serial, sc->serial, sizeof(cards[i].serial));
+    memcpy(cards[i].usb_path, sc->usb_path, sizeof(cards[i].usb_path));
+  }
+
+  struct cached_firmware *firmwares = (void *)(cards + data.card_count);
+  char *strings = (void *)(firmwares + data.firmware_count);
+  uint32_t offset = 0;
+
+  for (int i = 0; i < found_firmwares_count; i++) {
+    struct found_firmware *ff = &found_firmwares[i];
+
+    firmwares[i].header = *ff->firmware;
+    firmwares[i].fn_offset = offset;
+    strcpy(strings + offset, ff->fn);
+    offset += strlen(ff->fn) + 1;
+  }
+
+  scarlett2_cache_save(fn, key, buf, len);
+  free(buf);
+}
+
+// enumerate the cards and firmware for list and list-all, using the
+// cache if it's still valid
+static void enum_cards_and_firmwares_cached(void) {
+  struct scarlett2_cache_key key;
+
+  if (!use_cache) {
+    enum_cards_and_firmwares();
+    return;
+  }
+
+  get_cache_key(&key);
+  if (load_enum_cache(SCARLETT2_CACHE_FILE, &key, CACHE_TTL) == 0)
+    return;
+
+  enum_cards_and_firmwares();
+  save_enum_cache(SCARLETT2_CACHE_FILE, &key);
+}
+
+// enumerate only the firmware, for hotplug; cached separately, as
+// the card list changes with every hotplug event
+static void enum_firmwares_cached(void) {
+  struct scarlett2_cache_key key;
+
+  if (!use_cache) {
+    enum_firmwares();
+    return;
+  }
+
+  get_cache_key(&key);
+  key.cards_hash = 0;
+  key.dev_snd_mtime = -1;
+
+  if (load_enum_cache(CATALOGUE_CACHE_FILE, &key, CATALOGUE_CACHE_TTL) == 0)
+    return;
+
+  enum_firmwares();
+  save_enum_cache(CATALOGUE_CACHE_FILE, &key);
 }
 
 static struct found_firmware *get_latest_firmware(int pid) {
@@ -457,79 +1042,89 @@ static struct found_firmware *get_firmware_for_version(int pid, int version) {
   return NULL;
 }
 
-static void check_firmware_selection(void) {
+// read and verify the firmware file for a card
+static struct scarlett2_firmware_file *load_firmware(
+  struct sound_card     *sc,
+  struct found_firmware *ff
+) {
+  struct scarlett2_firmware_file *firmware =
+    scarlett2_read_firmware_file(ff->fn);
+
+  if (!firmware) {
+    fprintf(stderr, "Unable to load firmware\n");
+    return NULL;
+  }
+
+  // double-check the PID
+  if (firmware->header.usb_pid != sc->pid) {
+    fprintf(
+      stderr,
+      "Firmware file is for a different device (PID %04x != %04x)\n",
+      firmware->header.usb_pid,
+      sc->pid
+    );
+    scarlett2_free_firmware_file(firmware);
+    return NULL;
+  }
+
+  return firmware;
+}
+
+static struct found_firmware *check_firmware_selection(
+  struct sound_card *sc
+) {
 
   struct found_firmware *ff;
 
   // no firmware version specified, use latest
   if (!selected_firmware_version) {
-    ff = get_latest_firmware(selected_card->pid);
+    ff = get_latest_firmware(sc->pid);
 
     if (!ff) {
       fprintf(
         stderr,
         "No firmware available for %s\n",
-        selected_card->product_name
+        sc->product_name
       );
       exit(EXIT_FAILURE);
     }
 
     // check if latest firmware is newer
-    if (selected_card->firmware_version >= ff->firmware->firmware_version) {
+    if (sc->firmware_version >= ff->firmware->firmware_version) {
       fprintf(
         stderr,
         "Firmware %d for %s is already up to date\n",
-        selected_card->firmware_version,
-        selected_card->product_name
+        sc->firmware_version,
+        sc->product_name
       );
       exit(EXIT_FAILURE);
     }
 
   // firmware version specified, check if it's available
   } else {
-    ff = get_firmware_for_version(
-      selected_card->pid,
-      selected_firmware_version
-    );
+    ff = get_firmware_for_version(sc->pid, selected_firmware_version);
 
     if (!ff) {
       fprintf(
         stderr,
         "No firmware version %d available for %s\n",
         selected_firmware_version,
-        selected_card->product_name
+        sc->product_name
       );
       exit(EXIT_FAILURE);
     }
   }
 
-  // read the firmware file
-  selected_firmware = scarlett2_read_firmware_file(ff->fn);
-
-  if (!selected_firmware) {
-    fprintf(stderr, "Unable to load firmware\n");
-    exit(EXIT_FAILURE);
-  }
-
-  // double-check the PID
-  if (selected_firmware->header.usb_pid != selected_card->pid) {
-    fprintf(
-      stderr,
-      "Firmware file is for a different device (PID %04x != %04x)\n",
-      selected_firmware->header.usb_pid,
-      selected_card->pid
-    );
-    exit(EXIT_FAILURE);
-  }
-
   // display the firmware version and filename
   printf(
     "Found firmware version %d for %s:\n"
     "  %s\n",
-    selected_firmware->header.firmware_version,
-    selected_card->product_name,
+    ff->firmware->firmware_version,
+    sc->product_name,
     ff->fn
   );
+
+  return ff;
 }
 
 static void usage(void) {
@@ -552,11 +1147,87 @@ static void usage(void) {
     "  reboot                Reboot device\n"
     "  reset-config          Reset to default configuration\n"
     "  erase-firmware        Reset device to factory firmware\n"
+    "  apply                 Update all devices according to the\n"
+    "                        fleet policy file\n"
+    "  probe                 Measure USB link latency to devices\n"
+    "  status                Show progress of operations in progress\n"
+    "  hotplug SYSFS_PATH    Update a newly-connected device if needed\n"
+    "                        (for udev/systemd)\n"
+    "  serve                 Run the job queue service\n"
+    "  queue OP              Submit OP (list, reset-config, update, or\n"
+    "                        reboot) to the service and wait for it\n"
+    "  queue stats           Show the service's queue and wait times\n"
+    "  triage                Check every Focusrite USB device for why\n"
+    "                        it might not be listed\n"
+    "  characterize          Measure erase, write, and reboot times\n"
+    "                        of a SPARE device (erases it repeatedly)\n"
+    "  replay FILE           Re-run a session saved with --record\n"
+    "                        against the recorded device responses\n"
+    "  soak FILE             Repeat an update session saved with\n"
+    "                        --record, checking for leaks and drift\n"
+    "  config snapshot [FILE]\n"
+    "                        Show a hash of each device's settings,\n"
+    "                        and save the device's settings to FILE\n"
+    "  config apply FILE     Change the settings which differ from FILE\n"
+    "                        on each device of the same model\n"
+    "  delta pack DIR        Store all but the latest firmware for\n"
+    "                        each device in DIR as deltas\n"
+    "  delta apply DIR       Restore the deltas in DIR to full images\n"
+    "  delta sync SRC DST    Copy firmware missing from DST, as deltas\n"
+    "                        against what DST already has\n"
     "\n"
     "Lesser-used options:\n"
     "  -c NUM, --card NUM    Select a specific device\n"
-    "                        (only needed if more than one connected)\n"
+    "                        (only needed if more than one connected;\n"
+    "                        may be repeated to update several at once)\n"
     "  --fw-ver NUM          Select a specific firmware version\n"
+    "  --policy FILE         Fleet policy file for apply\n"
+    "                        (default " SYSTEM_POLICY_FILE ")\n"
+    "  --probe-count NUM     Round trips per operation for probe\n"
+    "                        (default 50)\n"
+    "  --latency-budget MS   Fail probe, and refuse to update devices,\n"
+    "                        with a p99 round-trip latency over MS\n"
+    "  --cycles NUM          Update cycles for characterize (default 3)\n"
+    "                        or soak (default 1000)\n"
+    "  --max-drift PCT       Fail characterize if the last cycle's p99\n"
+    "                        write latency is over PCT%% above the first,\n"
+    "                        or soak if a phase's is\n"
+    "  --replay-speed NUM    Replay NUM times faster than recorded\n"
+    "  --sample-every NUM    Cycles between soak samples (default 100)\n"
+    "  --max-rss-growth KB   Fail soak if its memory grows by over KB\n"
+    "                        (default 1024)\n"
+    "  --max-fd-growth NUM   Fail soak if its open files grow by over\n"
+    "                        NUM (default 0)\n"
+    "  --profile FILE        Device profile file written by characterize\n"
+    "                        (default " SYSTEM_PROFILE_FILE ")\n"
+    "  --yes                 Don't ask for confirmation\n"
+    "  --no-cache            Don't use cached results for list and\n"
+    "                        list-all\n"
+    "  --window DURATION     Only start updates expected to finish\n"
+    "                        within DURATION (e.g. 900, 15m, 1h);\n"
+    "                        others are deferred\n"
+    "  --slots NUM           Maximum concurrent updates with --window\n"
+    "                        (default: all) or serve (default: 1)\n"
+    "  --waves MAX           Update one device, then waves of 2, 4, 8,\n"
+    "                        ... up to MAX devices, verifying each wave\n"
+    "                        before starting the next\n"
+    "  --keep-config         With update or apply, keep the device's\n"
+    "                        settings (only where a keep-config rule\n"
+    "                        in the policy file allows it)\n"
+    "  --record FILE         Save every device operation with its\n"
+    "                        result and timing to FILE for replay\n"
+    "  --timeline            Show when each step started and how long\n"
+    "                        it took\n"
+    "  --cache-neutral       Read firmware files without adding them\n"
+    "                        to the page cache, and report the page\n"
+    "                        cache used before and after\n"
+    "  --op-deadline MS      Abandon a device operation blocked for\n"
+    "                        over MS (default 10000; 0 to disable)\n"
+    "  --op-stats            Show the latency of each type of device\n"
+    "                        operation\n"
+    "  --priority NUM        Priority of jobs submitted with queue;\n"
+    "                        higher runs first (default 0 for update,\n"
+    "                        10 otherwise)\n"
     "\n"
     "Support: https://github.com/geoffreybennett/scarlett2\n"
     "Configuration GUI: https://github.com/geoffreybennett/alsa-scarlett-gui\n"
@@ -572,7 +1243,9 @@ static void short_help(void) {
 }
 
 static void about(void) {
-  printf(
+  char *firmware_dir = get_firmware_exec_dir();
+
+  printf(
     "Scarlett2 Firmware Management Tool Version %s\n"
     "\n"
     "ABOUT\n"
@@ -638,12 +1311,96 @@ static void about(void) {
     "  https://liberapay.com/gdb\n"
     "  https://www.paypal.me/gdbau\n"
     "\n",
-    VERSION, SYSTEM_FIRMWARE_DIR, get_firmware_exec_dir()
+    VERSION, SYSTEM_FIRMWARE_DIR, firmware_dir
   );
+  free(firmware_dir);
   exit(0);
 }
 
+// match "--name VALUE" or "--name=VALUE"; returns the value, or NULL
+// if arg is not this option
+static char *get_option_value(
+  int         argc,
+  char       *argv[],
+  int        *i,
+  const char *name,
+  const char *what
+) {
+  char *arg = argv[*i];
+  size_t len = strlen(name);
+
+  if (strncmp(arg, name, len) != 0)
+    return NULL;
+
+  if (arg[len] == '=')
+    return arg + len + 1;
+
+  if (arg[len])
+    return NULL;
+
+  if (*i + 1 >= argc) {
+    fprintf(stderr, "Missing argument for %s (requires %s)\n", arg, what);
+    exit(EXIT_FAILURE);
+  }
+
+  return argv[++*i];
+}
+
+static int parse_int_option(const char *name, const char *value, int min) {
+  char *endptr;
+
+  errno = 0;
+  long n = strtol(value, &endptr, 10);
+  if (errno != 0 || *endptr != '\0' || n < min || n > INT_MAX) {
+    fprintf(stderr, "Invalid argument '%s' for %s\n", value, name);
+    exit(EXIT_FAILURE);
+  }
+
+  return n;
+}
+
+static double parse_double_option(
+  const char *name,
+  const char *value,
+  double      min
+) {
+  char *endptr;
+
+  errno = 0;
+  double n = strtod(value, &endptr);
+  if (errno != 0 || *endptr != '\0' || !(n >= min)) {
+    fprintf(stderr, "Invalid argument '%s' for %s\n", value, name);
+    exit(EXIT_FAILURE);
+  }
+
+  return n;
+}
+
+// seconds, with an optional s, m, or h suffix
+static double parse_duration_option(const char *name, const char *value) {
+  char *endptr;
+
+  errno = 0;
+  double n = strtod(value, &endptr);
+
+  if (!strcmp(endptr, "m"))
+    n *= 60;
+  else if (!strcmp(endptr, "h"))
+    n *= 3600;
+  else if (*endptr && strcmp(endptr, "s"))
+    endptr = NULL;
+
+  if (errno != 0 || !endptr || endptr == value || !(n > 0)) {
+    fprintf(stderr, "Invalid argument '%s' for %s\n", value, name);
+    exit(EXIT_FAILURE);
+  }
+
+  return n;
+}
+
 static void parse_args(int argc, char *argv[]) {
+  char *value;
+
   for (int i = 1; i < argc; i++) {
 
     char *arg = argv[i];
@@ -675,17 +1432,11 @@ static void parse_args(int argc, char *argv[]) {
         card_num_str = argv[++i];
       }
 
-      // make sure -c, --card hasn't already been seen
-      if (selected_card_num != -1) {
-        fprintf(stderr, "Error: multiple cards specified\n");
-        exit(EXIT_FAILURE);
-      }
-
       // parse N
       char *endptr;
       errno = 0;
-      selected_card_num = strtol(card_num_str, &endptr, 10);
-      if (errno != 0 || *endptr != '\0' || selected_card_num < 0) {
+      int card_num = strtol(card_num_str, &endptr, 10);
+      if (errno != 0 || *endptr != '\0' || card_num < 0) {
         fprintf(
           stderr,
           "Invalid argument '%s' (should be a card number)\n",
@@ -694,6 +1445,23 @@ static void parse_args(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
       }
 
+      // make sure this card hasn't already been seen
+      for (int j = 0; j < selected_card_nums_count; j++)
+        if (selected_card_nums[j] == card_num) {
+          fprintf(stderr, "Error: card %d specified twice\n", card_num);
+          exit(EXIT_FAILURE);
+        }
+
+      selected_card_nums = realloc(
+        selected_card_nums,
+        sizeof(*selected_card_nums) * (selected_card_nums_count + 1)
+      );
+      if (!selected_card_nums) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+      selected_card_nums[selected_card_nums_count++] = card_num;
+
     // --fw-ver
     } else if (strcmp(arg, "--fw-ver") == 0 ||
                strncmp(arg, "--fw-ver=", 9) == 0) {
@@ -736,6 +1504,124 @@ static void parse_args(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
       }
 
+    // --policy
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--policy", "a policy file name"))) {
+      if (!*value) {
+        fprintf(stderr, "Invalid argument '%s' (empty file name)\n", arg);
+        exit(EXIT_FAILURE);
+      }
+      policy_fn = value;
+
+    // --probe-count
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--probe-count", "a number"))) {
+      probe_count = parse_int_option("--probe-count", value, 1);
+
+    // --profile
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--profile", "a profile file name"))) {
+      if (!*value) {
+        fprintf(stderr, "Invalid argument '%s' (empty file name)\n", arg);
+        exit(EXIT_FAILURE);
+      }
+      profile_fn = value;
+
+    // --cycles
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--cycles", "a number"))) {
+      update_cycles = parse_int_option("--cycles", value, 1);
+
+    // --max-drift
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--max-drift", "a percentage"))) {
+      max_drift_pct = parse_int_option("--max-drift", value, 1);
+
+    // --replay-speed
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--replay-speed", "a number"))) {
+      replay_speed = parse_int_option("--replay-speed", value, 1);
+
+    // --sample-every
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--sample-every", "a number"))) {
+      sample_every = parse_int_option("--sample-every", value, 1);
+
+    // --max-rss-growth
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--max-rss-growth", "a size in kB"))) {
+      max_rss_growth_kb = parse_int_option("--max-rss-growth", value, 0);
+
+    // --max-fd-growth
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--max-fd-growth", "a number"))) {
+      max_fd_growth = parse_int_option("--max-fd-growth", value, 0);
+
+    // --yes
+    } else if (strcmp(arg, "--yes") == 0) {
+      assume_yes = 1;
+
+    // --no-cache
+    } else if (strcmp(arg, "--no-cache") == 0) {
+      use_cache = 0;
+
+    // --latency-budget
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--latency-budget", "milliseconds"))) {
+      latency_budget_ms = parse_double_option(
+        "--latency-budget", value, 0.001
+      );
+
+    // --window
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--window", "a duration"))) {
+      window_sec = parse_duration_option("--window", value);
+
+    // --slots
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--slots", "a number"))) {
+      window_slots = parse_int_option("--slots", value, 1);
+
+    // --record
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--record", "a session file name"))) {
+      if (!*value) {
+        fprintf(stderr, "Invalid argument '%s' (empty file name)\n", arg);
+        exit(EXIT_FAILURE);
+      }
+      record_fn = value;
+
+    // --cache-neutral
+    } else if (strcmp(arg, "--cache-neutral") == 0) {
+      cache_neutral = 1;
+
+    // --keep-config
+    } else if (strcmp(arg, "--keep-config") == 0) {
+      keep_config = 1;
+
+    // --timeline
+    } else if (strcmp(arg, "--timeline") == 0) {
+      show_timeline = 1;
+
+    // --op-deadline
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--op-deadline", "milliseconds"))) {
+      op_deadline_ms = parse_int_option("--op-deadline", value, 0);
+
+    // --op-stats
+    } else if (strcmp(arg, "--op-stats") == 0) {
+      show_op_stats = 1;
+
+    // --priority
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--priority", "a number"))) {
+      queue_priority = parse_int_option("--priority", value, 0);
+
+    // --waves
+    } else if ((value = get_option_value(
+                  argc, argv, &i, "--waves", "a number"))) {
+      max_wave = parse_int_option("--waves", value, 1);
+
     // short-form commands
     } else if (arg[0] == '-') {
       char *short_command = NULL;
@@ -767,6 +1653,19 @@ static void parse_args(int argc, char *argv[]) {
     } else if (!command) {
       command = arg;
 
+    // replay and soak's session file
+    } else if ((!strcmp(command, "replay") || !strcmp(command, "soak")) &&
+               !replay_fn) {
+      replay_fn = arg;
+
+    // delta and config's subcommand and arguments, hotplug's path,
+    // queue's operation
+    } else if ((!strcmp(command, "delta") || !strcmp(command, "config") ||
+                ((!strcmp(command, "hotplug") || !strcmp(command, "queue")) &&
+                 !command_args_count)) &&
+               command_args_count < 3) {
+      command_args[command_args_count++] = arg;
+
     // command already specified
     } else {
       fprintf(
@@ -779,10 +1678,15 @@ static void parse_args(int argc, char *argv[]) {
   }
 
   // check if a card was specified but no command
-  if (!command && selected_card_num != -1) {
+  if (!command && selected_card_nums_count) {
     fprintf(stderr, "No command specified\n");
     short_help();
   }
+
+  if (window_sec && max_wave) {
+    fprintf(stderr, "Cannot use --window with --waves\n");
+    short_help();
+  }
 }
 
 static void list_cards(void) {
@@ -840,14 +1744,17 @@ static void list_all(void) {
 
   // no firmware found in either directory
   if (!found_firmwares_count) {
+    char *firmware_dir = get_firmware_exec_dir();
+
     printf("No firmware found.\n\n");
     printf(
       "Scarlett2 firmware files should be placed in:\n"
       "  %s or\n"
       "  %s\n\n",
       SYSTEM_FIRMWARE_DIR,
-      get_firmware_exec_dir()
+      firmware_dir
     );
+    free(firmware_dir);
   }
 
   printf(
@@ -904,247 +1811,3809 @@ static void list_all(void) {
   }
 }
 
+// publish the start of a phase on the card's live status page
+static void status_set_phase(struct sound_card *sc, int phase) {
+  // don't show replayed cards as real ones
+  if (scarlett2_session_replaying())
+    return;
+
+  // the page is only created while holding the card's lock, so a
+  // process which can't get the lock never touches the page of the
+  // one which has it
+  if (!sc->status) {
+    if (!sc->hwdep)
+      return;
+    sc->status = scarlett2_status_create(sc->card_name);
+    if (!sc->status)
+      return;
+  }
+
+  struct scarlett2_status_page *page = sc->status;
+  uint64_t now = scarlett2_now_us();
+
+  scarlett2_status_begin(page);
+  page->usb_pid = sc->pid;
+  snprintf(page->serial, sizeof(page->serial), "%s", sc->serial);
+  snprintf(page->usb_path, sizeof(page->usb_path), "%s", sc->usb_path);
+  page->phase = phase;
+  page->phase_start_us = now;
+  page->updated_us = now;
+  page->erase_percent = 0;
+  page->erase_num_blocks = 0;
+  page->rate = 0;
+  page->eta = -1;
+  scarlett2_status_end(page);
+}
+
+static void status_set_erase(
+  struct sound_card *sc,
+  int                percent,
+  int                num_blocks
+) {
+  struct scarlett2_status_page *page = sc->status;
+
+  if (!page)
+    return;
+
+  uint64_t now = scarlett2_now_us();
+  double elapsed = (now - page->phase_start_us) / 1e6;
+
+  scarlett2_status_begin(page);
+  page->erase_percent = percent;
+  page->erase_num_blocks = num_blocks;
+  page->eta = percent ? elapsed * (100 - percent) / percent : -1;
+  page->updated_us = now;
+  scarlett2_status_end(page);
+}
+
+static void status_set_write(
+  struct sound_card              *sc,
+  struct scarlett2_firmware_file *firmware,
+  size_t                          written
+) {
+  struct scarlett2_status_page *page = sc->status;
+
+  if (!page)
+    return;
+
+  uint64_t now = scarlett2_now_us();
+  double elapsed = (now - page->phase_start_us) / 1e6;
+  size_t total = firmware->header.firmware_length;
+
+  scarlett2_status_begin(page);
+  page->firmware_version = firmware->header.firmware_version;
+  page->bytes_written = written;
+  page->bytes_total = total;
+  page->rate = elapsed > 0 ? written / elapsed : 0;
+  page->eta = page->rate > 0 ? (total - written) / page->rate : -1;
+  page->updated_us = now;
+  scarlett2_status_end(page);
+}
+
+// print a message about an operation on a card
+static void card_printf(struct sound_card *sc, const char *fmt, ...) {
+  va_list ap;
+  char buf[256];
+
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  if (multi_card)
+    printf("%s: %s", sc->card_name, buf);
+  else
+    printf("%s", buf);
+}
+
+// what's been learned about the driver is host state, so it's
+// recorded too
+static void get_caps(struct sound_card *sc) {
+  struct scarlett2_caps *caps = &sc->caps;
+
+  scarlett2_caps_get(
+    caps,
+    sc->protocol_version,
+    sc->pid,
+    *sc->serial ? sc->serial : sc->usb_path
+  );
+
+  const struct scarlett2_session_event *ev = scarlett2_session_replay(
+    sc->alsa_name, SCARLETT2_OP_CAPS, 0, 0
+  );
+  if (ev) {
+    caps->max_write = ev->v[0];
+    caps->reliable_progress = ev->v[1];
+    caps->erase_poll_ms = ev->v[2];
+    caps->erase_stall_ms = ev->v[3];
+
+    // don't save anything learned during a replay
+    caps->id[0] = 0;
+    return;
+  }
+
+  scarlett2_session_record(
+    scarlett2_session_now(), sc->alsa_name, SCARLETT2_OP_CAPS,
+    caps->max_write, caps->reliable_progress,
+    caps->erase_poll_ms, caps->erase_stall_ms
+  );
+}
+
 // open the device
-static void open_card(char *alsa_name) {
+static int open_card(struct sound_card *sc) {
   int err;
 
-  if (hwdep)
-    return;
+  if (sc->hwdep)
+    return 0;
 
-  err = scarlett2_open_card(alsa_name, &hwdep);
+  err = scarlett2_open_card(sc->alsa_name, &sc->hwdep);
   if (err < 0) {
     fprintf(
       stderr,
       "Unable to open card %s: %s\n",
-      alsa_name,
-      snd_strerror(errno)
+      sc->alsa_name,
+      snd_strerror(err)
     );
-    exit(EXIT_FAILURE);
+    sc->hwdep = NULL;
+    return -1;
   }
 
-  err = scarlett2_get_protocol_version(hwdep);
+  err = scarlett2_get_protocol_version(sc->hwdep);
   if (err < 0) {
     fprintf(
       stderr,
       "Unable to get protocol version on card %s: %s\n",
-      alsa_name,
-      snd_strerror(errno)
+      sc->alsa_name,
+      snd_strerror(err)
     );
-    exit(EXIT_FAILURE);
+    goto error;
   }
-  protocol_version = err;
-  if (SCARLETT2_HWDEP_VERSION_MAJOR(protocol_version) !=
+  sc->protocol_version = err;
+  if (SCARLETT2_HWDEP_VERSION_MAJOR(sc->protocol_version) !=
         REQUIRED_HWDEP_VERSION_MAJOR) {
     fprintf(
       stderr,
       "Unsupported hwdep protocol version %d.%d.%d on card %s\n",
-      SCARLETT2_HWDEP_VERSION_MAJOR(protocol_version),
-      SCARLETT2_HWDEP_VERSION_MINOR(protocol_version),
-      SCARLETT2_HWDEP_VERSION_SUBMINOR(protocol_version),
-      alsa_name
+      SCARLETT2_HWDEP_VERSION_MAJOR(sc->protocol_version),
+      SCARLETT2_HWDEP_VERSION_MINOR(sc->protocol_version),
+      SCARLETT2_HWDEP_VERSION_SUBMINOR(sc->protocol_version),
+      sc->alsa_name
     );
-    exit(EXIT_FAILURE);
+    goto error;
   }
-}
-
-static void reboot_card(void) {
-  open_card(selected_card->alsa_name);
 
-  printf("Rebooting interface...\n");
+  get_caps(sc);
 
-  int err = scarlett2_reboot(hwdep);
+  // make sure no other process is operating on the card
+  err = scarlett2_lock(sc->hwdep);
   if (err < 0) {
-    fprintf(
-      stderr,
-      "Unable to reboot card %s: %s\n",
-      selected_card->alsa_name,
-      snd_strerror(errno)
-    );
-    exit(EXIT_FAILURE);
-  }
-}
-
-static void monitor_erase_progress(void) {
-  int last_progress = 0;
-  int progress = 0;
-  for (int i = 0; i < 10; i++) {
-    progress = scarlett2_get_erase_progress(hwdep);
-    if (progress < 0) {
+    if (err == -EWOULDBLOCK)
       fprintf(
         stderr,
-        "Unable to get erase progress on card %s: %s\n",
-        selected_card->alsa_name,
-        snd_strerror(progress)
+        "Card %s is in use by another process\n",
+        sc->alsa_name
       );
-      exit(EXIT_FAILURE);
-    }
-
-    if (progress == 255)
-      break;
-
-    if (progress > last_progress) {
-      printf("\rErase progress: %d%%", progress);
-      fflush(stdout);
-      last_progress = progress;
-      i = 0;
-    } else if (progress < last_progress) {
+    else
       fprintf(
         stderr,
-        "\nErase progress went backwards! (%d%% -> %d%%)\n",
-        last_progress,
-        progress
+        "Unable to lock card %s: %s\n",
+        sc->alsa_name,
+        snd_strerror(err)
       );
-      exit(EXIT_FAILURE);
-    }
-    usleep(50000);
+    goto error;
   }
 
-  if (progress != 255) {
-    fprintf(
-      stderr,
-      "\nUnable to get erase progress on card %s: timed out\n",
-      selected_card->alsa_name
-    );
-    exit(EXIT_FAILURE);
-  } else {
-    printf("\rErase progress: Done!\n");
+  return 0;
+
+error:
+  scarlett2_close(sc->hwdep);
+  sc->hwdep = NULL;
+  return -1;
+}
+
+static void close_card(struct sound_card *sc) {
+  if (!sc->hwdep)
+    return;
+
+  scarlett2_close(sc->hwdep);
+  sc->hwdep = NULL;
+}
+
+// record the outcome of an operation, and release the card
+static int finish_card(struct sound_card *sc, int err) {
+  status_set_phase(
+    sc, err < 0 ? SCARLETT2_PHASE_FAILED : SCARLETT2_PHASE_DONE
+  );
+  scarlett2_status_close(sc->status);
+  sc->status = NULL;
+
+  close_card(sc);
+
+  return err;
+}
+
+// the card was left alone; mark it so in the status page
+static void defer_card(struct sound_card *sc) {
+  status_set_phase(sc, SCARLETT2_PHASE_DEFERRED);
+  scarlett2_status_close(sc->status);
+  sc->status = NULL;
+
+  close_card(sc);
+}
+
+// look for a card with the same USB serial number as sc (or USB path
+// if it has no serial number); returns 1 and fills in found if
+// present
+static int find_card_by_usb(struct sound_card *sc, struct sound_card *found) {
+  int card_num = -1;
+
+  while (snd_card_next(&card_num) >= 0 && card_num >= 0) {
+    memset(found, 0, sizeof(*found));
+    found->card_num = card_num;
+    snprintf(found->card_name, sizeof(found->card_name), "card%d", card_num);
+
+    if (check_usb_id(found->card_name) != sc->pid)
+      continue;
+
+    get_usb_info(found);
+
+    if (*sc->serial ?
+          !strcmp(found->serial, sc->serial) :
+          !strcmp(found->usb_path, sc->usb_path))
+      return 1;
   }
+
+  return 0;
 }
 
-static void reset_config(void) {
-  open_card(selected_card->alsa_name);
+// check if a card has come up far enough to be used: the Firmware
+// Version control can be read and the hwdep device opened
+static int is_card_ready(struct sound_card *sc) {
+  snd_ctl_t *ctl;
+  snd_hwdep_t *hwdep;
 
-  printf("Resetting to default configuration...\n");
+  if (scarlett2_ctl_open(sc->alsa_name, &ctl) < 0)
+    return 0;
 
-  // send request to erase config
-  int err = scarlett2_erase_config(hwdep);
-  if (err < 0) {
+  sc->firmware_version = scarlett2_ctl_get_firmware_version(ctl);
+  scarlett2_ctl_close(ctl);
+  if (sc->firmware_version < 0)
+    return 0;
+
+  if (scarlett2_open_card(sc->alsa_name, &hwdep) < 0)
+    return 0;
+  scarlett2_close(hwdep);
+
+  return 1;
+}
+
+// waiting for a card to come back after a reboot
+struct reboot_wait {
+  char    dev[32];
+  double  start_us;
+  int64_t session_start;
+  int     disconnected;
+};
+
+// check once whether the card has disconnected and come back ready,
+// possibly with a different card number; sc is updated to match.
+// Returns 0 when it's ready, -1 on failure, or the number of ms to
+// wait before checking again
+static int check_card_back(struct sound_card *sc, struct reboot_wait *wait) {
+  struct sound_card found;
+  double elapsed_us = scarlett2_now_us() - wait->start_us;
+
+  // the card should disappear before it comes back
+  if (!wait->disconnected) {
+    if (find_card_by_usb(sc, &found) &&
+        found.card_num == sc->card_num) {
+      if (elapsed_us > REBOOT_DISCONNECT_TIMEOUT_MS * 1000) {
+        fprintf(
+          stderr,
+          "Card %s did not disconnect after reboot\n",
+          sc->alsa_name
+        );
+        return -1;
+      }
+      return 10;
+    }
+    wait->disconnected = 1;
+  }
+
+  if (find_card_by_usb(sc, &found)) {
+    set_card_num(sc, found.card_num);
+    strcpy(sc->usb_path, found.usb_path);
+
+    if (is_card_ready(sc))
+      return 0;
+  }
+
+  if (elapsed_us > REBOOT_READY_TIMEOUT_MS * 1000) {
     fprintf(
       stderr,
-      "Unable to reset configuration on card %s: %s\n",
-      selected_card->alsa_name,
-      snd_strerror(errno)
+      "Card %s (serial %s) did not come back after reboot\n",
+      sc->alsa_name,
+      *sc->serial ? sc->serial : "unknown"
     );
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
-  monitor_erase_progress();
+  return 50;
 }
 
-static void erase_firmware(void) {
-  open_card(selected_card->alsa_name);
+static int finish_reboot_wait(
+  struct sound_card  *sc,
+  struct reboot_wait *wait,
+  int                 err
+) {
+  scarlett2_session_record(
+    wait->session_start, wait->dev, SCARLETT2_OP_REBOOT_WAIT,
+    err, sc->card_num, sc->firmware_version, 0
+  );
+  scarlett2_timeline_add(
+    sc->card_name, err < 0 ? "reboot wait (failed)" : "reboot wait",
+    wait->start_us, scarlett2_now_us()
+  );
+
+  if (soak_phase_us && err >= 0)
+    scarlett2_stats_add(
+      &soak_phase_us[SOAK_REBOOT_WAIT], scarlett2_now_us() - wait->start_us
+    );
 
-  printf("Erasing upgrade firmware...\n");
+  return err;
+}
 
-  // send request to erase firmware
-  int err = scarlett2_erase_firmware(hwdep);
-  if (err < 0) {
+// start waiting for a card to come back after a reboot; sessions
+// record the wait as a whole, as how often the card is polled while
+// it reboots depends on timing. Returns 1 to continue with
+// check_reboot_wait(), otherwise the outcome (0 or -1).
+static int start_reboot_wait(struct sound_card *sc, struct reboot_wait *wait) {
+  memset(wait, 0, sizeof(*wait));
+  strcpy(wait->dev, sc->alsa_name);
+  close_card(sc);
+
+  const struct scarlett2_session_event *ev = scarlett2_session_replay(
+    wait->dev, SCARLETT2_OP_REBOOT_WAIT, 0, 0
+  );
+  if (ev) {
+    if (ev->v[0] < 0) {
+      fprintf(stderr, "Card %s did not come back after reboot\n", wait->dev);
+      return -1;
+    }
+    set_card_num(sc, ev->v[1]);
+    sc->firmware_version = ev->v[2];
+    return 0;
+  }
+
+  wait->session_start = scarlett2_session_now();
+  wait->start_us = scarlett2_now_us();
+
+  if (!*sc->serial && !*sc->usb_path) {
     fprintf(
       stderr,
-      "Unable to erase upgrade firmware on card %s: %s\n",
-      selected_card->alsa_name,
-      snd_strerror(errno)
+      "Unable to identify card %s after reboot (no USB serial or path)\n",
+      sc->alsa_name
     );
-    exit(EXIT_FAILURE);
+    return finish_reboot_wait(sc, wait, -1);
   }
 
-  monitor_erase_progress();
+  return 1;
 }
 
-static void update_firmware(void) {
-  open_card(selected_card->alsa_name);
+// returns 0 when the card is back, -1 on failure, or the number of
+// ms to wait before calling again
+static int check_reboot_wait(struct sound_card *sc, struct reboot_wait *wait) {
+  scarlett2_session_suppress(1);
+  int result = check_card_back(sc, wait);
+  scarlett2_session_suppress(0);
 
-  // write the firmware
-  size_t offset = 0;
-  size_t len = selected_firmware->header.firmware_length;
-  unsigned char *buf = selected_firmware->firmware_data;
+  if (result > 0)
+    return result;
 
-  while (offset < len) {
-    int err = snd_hwdep_write(hwdep, buf + offset, len - offset);
-    if (err < 0) {
-      fprintf(
-        stderr,
-        "Unable to write firmware to card %s: %s\n",
-        selected_card->alsa_name,
-        snd_strerror(errno)
-      );
-      exit(EXIT_FAILURE);
-    }
+  return finish_reboot_wait(sc, wait, result);
+}
 
-    if (!err) {
-      fprintf(
-        stderr,
-        "Unable to write firmware to card %s: offset %lu (len %lu) "
-          "returned 0\n",
-        selected_card->alsa_name,
-        offset,
-        len
-      );
-      exit(EXIT_FAILURE);
-    }
+static int wait_for_reboot(struct sound_card *sc) {
+  struct reboot_wait wait;
 
-    offset += err;
+  int result = start_reboot_wait(sc, &wait);
+  if (result <= 0)
+    return result;
 
-    int progress = (offset * 100) / len;
-    printf("\rFirmware write progress: %d%%", progress);
-    fflush(stdout);
-  }
+  while ((result = check_reboot_wait(sc, &wait)) > 0)
+    usleep(result * 1000);
 
-  printf("\rFirmware write progress: Done!\n");
+  return result;
 }
 
-int main(int argc, char *argv[]) {
-  program_name = argv[0];
+// a phase of the update state machine has started
+static void start_update_phase(
+  struct sound_card              *sc,
+  struct scarlett2_firmware_file *firmware,
+  int                             state
+) {
+  sc->phase_start_us = scarlett2_now_us();
 
-  parse_args(argc, argv);
+  switch (state) {
+    case SCARLETT2_UPDATE_STATE_RESET_CONFIG:
+      card_printf(sc, "Resetting to default configuration...\n");
+      status_set_phase(sc, SCARLETT2_PHASE_RESET_CONFIG);
+      break;
 
-  if (!command)
-    command = "list";
+    case SCARLETT2_UPDATE_STATE_ERASE_FIRMWARE:
+      card_printf(sc, "Erasing upgrade firmware...\n");
+      status_set_phase(sc, SCARLETT2_PHASE_ERASE_FIRMWARE);
+      break;
 
-  if (!strcmp(command, "help")) {
-    usage();
-  } else if (!strcmp(command, "about")) {
-    about();
-  } else if (!strcmp(command, "list")) {
-    enum_cards();
-    enum_firmwares();
-    list_cards();
-  } else if (!strcmp(command, "list-all")) {
-    enum_cards();
-    enum_firmwares();
-    list_all();
-  } else if (!strcmp(command, "reboot")) {
-    enum_cards();
-    check_card_selection();
-    reboot_card();
-  } else if (!strcmp(command, "reset-config")) {
-    enum_cards();
-    check_card_selection();
-    reset_config();
-    reboot_card();
-  } else if (!strcmp(command, "erase-firmware")) {
-    enum_cards();
-    check_card_selection();
-    reset_config();
-    erase_firmware();
-    reboot_card();
-  } else if (!strcmp(command, "update")) {
-    enum_cards();
-    enum_firmwares();
-    check_card_selection();
-    check_firmware_selection();
+    case SCARLETT2_UPDATE_STATE_WRITE:
+      status_set_phase(sc, SCARLETT2_PHASE_WRITE);
+      status_set_write(sc, firmware, 0);
+      break;
 
-    printf(
-      "Updating %s from firmware version %d to %d\n",
-      selected_card->product_name,
-      selected_card->firmware_version,
-      selected_firmware->header.firmware_version
-    );
+    case SCARLETT2_UPDATE_STATE_REBOOT:
+      card_printf(sc, "Rebooting interface...\n");
+      status_set_phase(sc, SCARLETT2_PHASE_REBOOT);
 
-    reset_config();
-    erase_firmware();
-    update_firmware();
-    reboot_card();
+      // the card will re-enumerate, possibly running different
+      // firmware
+      scarlett2_cache_invalidate(SCARLETT2_CACHE_FILE);
+      break;
+  }
+}
+
+// add a phase of the update state machine which has ended to the
+// timeline
+static void add_phase_span(struct sound_card *sc, int state, int failed) {
+  static const char *names[] = {
+    [SCARLETT2_UPDATE_STATE_RESET_CONFIG]   = "reset config",
+    [SCARLETT2_UPDATE_STATE_ERASE_FIRMWARE] = "erase firmware",
+    [SCARLETT2_UPDATE_STATE_WRITE]          = "write firmware",
+    [SCARLETT2_UPDATE_STATE_REBOOT]         = "reboot"
+  };
+  char what[64];
+
+  if (state < SCARLETT2_UPDATE_STATE_RESET_CONFIG ||
+      state > SCARLETT2_UPDATE_STATE_REBOOT)
+    return;
+
+  snprintf(what, sizeof(what), "%s%s", names[state], failed ? " (failed)" : "");
+  scarlett2_timeline_add(
+    sc->card_name, what, sc->phase_start_us, scarlett2_now_us()
+  );
+
+  if (soak_phase_us && !failed)
+    scarlett2_stats_add(
+      &soak_phase_us[
+        SOAK_RESET_CONFIG + state - SCARLETT2_UPDATE_STATE_RESET_CONFIG
+      ],
+      scarlett2_now_us() - sc->phase_start_us
+    );
+}
+
+static void end_update_phase(struct sound_card *sc, int state) {
+  add_phase_span(sc, state, 0);
+
+  const char *what =
+    state == SCARLETT2_UPDATE_STATE_RESET_CONFIG ||
+    state == SCARLETT2_UPDATE_STATE_ERASE_FIRMWARE ? "Erase progress" :
+    state == SCARLETT2_UPDATE_STATE_WRITE ? "Firmware write progress" :
+    NULL;
+
+  if (!what)
+    return;
+
+  if (multi_card)
+    card_printf(sc, "%s: Done!\n", what);
+  else
+    printf("\r%s: Done!\n", what);
+}
+
+// show progress made by a step of the update state machine
+static void show_update_progress(
+  struct sound_card              *sc,
+  struct scarlett2_update        *update,
+  struct scarlett2_firmware_file *firmware,
+  int                             last_progress,
+  size_t                          last_written,
+  struct scarlett2_stats         *write_stats
+) {
+  sc->erase_num_blocks = update->erase_num_blocks;
+
+  if (update->erase_progress != last_progress) {
+    status_set_erase(sc, update->erase_progress, update->erase_num_blocks);
+    if (!multi_card) {
+      printf("\rErase progress: %d%%", update->erase_progress);
+      fflush(stdout);
+    }
+  }
+
+  if (update->written != last_written) {
+    if (write_stats)
+      scarlett2_stats_add(write_stats, update->write_us);
+
+    if (update->write_us > TIMELINE_SLOW_WRITE_MS * 1000) {
+      char what[64];
+      double now = scarlett2_now_us();
+
+      snprintf(what, sizeof(what), "slow write at %zu", last_written);
+      scarlett2_timeline_add(
+        sc->card_name, what, now - update->write_us, now
+      );
+    }
+
+    status_set_write(sc, firmware, update->written);
+    if (!multi_card) {
+      int progress = update->written * 100 /
+                     firmware->header.firmware_length;
+      printf("\rFirmware write progress: %d%%", progress);
+      fflush(stdout);
+    }
+  }
+}
+
+// wait until the update state machine has something to do
+static void wait_for_update_step(struct scarlett2_update *update) {
+  struct pollfd pfd = { .fd = -1 };
+  int timeout = scarlett2_update_timeout_ms(update);
+
+  pfd.fd = scarlett2_update_get_fd(update, &pfd.events);
+  if (!timeout || (timeout < 0 && pfd.fd < 0))
+    return;
+
+  poll(&pfd, pfd.fd >= 0, timeout);
+}
+
+// what an engine task driving an update waits for before its next
+// step: the update's fd while a write is in progress, otherwise its
+// deadline
+static int wait_for_update_task(
+  struct scarlett2_engine_task *task,
+  struct scarlett2_update      *update
+) {
+  short events;
+  int fd = scarlett2_update_get_fd(update, &events);
+
+  if (fd < 0)
+    return scarlett2_update_timeout_ms(update);
+
+  task->fd = fd;
+  return SCARLETT2_ENGINE_WAIT_FD;
+}
+
+// take a step of the update state machine and show what it did;
+// returns the new state
+static int step_card_update(
+  struct sound_card              *sc,
+  struct scarlett2_update        *update,
+  struct scarlett2_firmware_file *firmware,
+  struct scarlett2_stats         *write_stats
+) {
+  int last_state = update->state;
+  int last_progress = update->erase_progress;
+  size_t last_written = update->written;
+
+  int state = scarlett2_update_step(update);
+
+  if (state == SCARLETT2_UPDATE_STATE_FAILED) {
+    add_phase_span(sc, last_state, 1);
+    if (!multi_card && (last_progress || last_written))
+      printf("\n");
+    fprintf(
+      stderr,
+      "Unable to %s on card %s: %s\n",
+      update->failed,
+      sc->alsa_name,
+      snd_strerror(update->err)
+    );
+    return state;
+  }
+
+  if (state != last_state) {
+    end_update_phase(sc, last_state);
+    if (state != SCARLETT2_UPDATE_STATE_DONE)
+      start_update_phase(sc, firmware, state);
+    return state;
+  }
+
+  show_update_progress(
+    sc, update, firmware, last_progress, last_written, write_stats
+  );
+  return state;
+}
+
+// run the selected phases of an update (SCARLETT2_UPDATE_*) on a
+// card, blocking until they're done; write_stats (if not NULL)
+// collects the latency of each write in microseconds
+static int run_update(
+  struct sound_card              *sc,
+  struct scarlett2_firmware_file *firmware,
+  int                             phases,
+  struct scarlett2_stats         *write_stats
+) {
+  struct scarlett2_update update;
+
+  if (open_card(sc) < 0)
+    return -1;
+
+  scarlett2_update_init(
+    &update, sc->hwdep, &sc->caps, firmware, phases, sc->card_num
+  );
+
+  for (;;) {
+    int state = step_card_update(sc, &update, firmware, write_stats);
+
+    if (state == SCARLETT2_UPDATE_STATE_FAILED)
+      return -1;
+    if (state == SCARLETT2_UPDATE_STATE_DONE)
+      return 0;
+
+    wait_for_update_step(&update);
+  }
+}
+
+static int reset_config(struct sound_card *sc) {
+  return run_update(sc, NULL, SCARLETT2_UPDATE_RESET_CONFIG, NULL);
+}
+
+static int erase_firmware(struct sound_card *sc) {
+  return run_update(sc, NULL, SCARLETT2_UPDATE_ERASE_FIRMWARE, NULL);
+}
+
+static int update_firmware(
+  struct sound_card              *sc,
+  struct scarlett2_firmware_file *firmware,
+  struct scarlett2_stats         *write_stats
+) {
+  return run_update(sc, firmware, SCARLETT2_UPDATE_WRITE, write_stats);
+}
+
+static int reboot_card(struct sound_card *sc) {
+  return run_update(sc, NULL, SCARLETT2_UPDATE_REBOOT, NULL);
+}
+
+// check that a card came back running the new firmware
+static int check_card_version(
+  struct sound_card              *sc,
+  struct scarlett2_firmware_file *firmware
+) {
+  if (sc->firmware_version != firmware->header.firmware_version) {
+    fprintf(
+      stderr,
+      "Card %s is running firmware version %d after updating to %d\n",
+      sc->alsa_name,
+      sc->firmware_version,
+      firmware->header.firmware_version
+    );
+    return -1;
+  }
+
+  card_printf(sc, "Verified firmware version %d\n", sc->firmware_version);
+
+  return 0;
+}
+
+// wait for the card to come back after an update and check that
+// it's running the new firmware
+static int verify_card(
+  struct sound_card              *sc,
+  struct scarlett2_firmware_file *firmware
+) {
+  card_printf(sc, "Waiting for reboot...\n");
+
+  if (wait_for_reboot(sc) < 0)
+    return -1;
+
+  return check_card_version(sc, firmware);
+}
+
+// with --keep-config, check that the firmware can be updated without
+// resetting the configuration: the driver can erase the firmware
+// segment on its own, and the settings layout is the same in both
+// versions (they're equal, or a keep-config rule covers them)
+static int check_keep_config(
+  struct sound_card              *sc,
+  struct scarlett2_firmware_file *firmware
+) {
+  int to_version = firmware->header.firmware_version;
+  const char *problem = NULL;
+
+  if (!sc->caps.firmware_only)
+    problem = "driver not known to erase the firmware on its own";
+  else if (sc->firmware_version != to_version &&
+           (!keep_config_policy ||
+            !scarlett2_policy_keep_config(
+              keep_config_policy, sc->pid, sc->firmware_version, to_version
+            )))
+    problem = "no keep-config rule in the policy file covers both";
+
+  if (!problem)
+    return 0;
+
+  fprintf(
+    stderr,
+    "Unable to keep the configuration of card %s updating from "
+      "firmware %d to %d: %s\n",
+    sc->alsa_name,
+    sc->firmware_version,
+    to_version,
+    problem
+  );
+  return -1;
+}
+
+// the update phases to run
+static int get_update_phases(void) {
+  if (keep_config)
+    return SCARLETT2_UPDATE_ALL & ~SCARLETT2_UPDATE_RESET_CONFIG;
+
+  return SCARLETT2_UPDATE_ALL;
+}
+
+static void announce_update(
+  struct sound_card              *sc,
+  struct scarlett2_firmware_file *firmware
+) {
+  card_printf(
+    sc,
+    "Updating %s from firmware version %d to %d\n",
+    sc->product_name,
+    sc->firmware_version,
+    firmware->header.firmware_version
+  );
+
+  struct scarlett2_profile *profile = scarlett2_get_profile(
+    profiles, sc->pid, sc->firmware_version
+  );
+  if (profile)
+    card_printf(
+      sc,
+      "Estimated update time: %.1f seconds\n",
+      scarlett2_profile_estimate_ms(
+        profile, firmware->header.firmware_length
+      ) / 1000
+    );
+}
+
+// the complete update sequence for one card; if verify is set, wait
+// for it to come back running the new firmware
+static int update_card(
+  struct sound_card              *sc,
+  struct scarlett2_firmware_file *firmware,
+  int                             verify
+) {
+  announce_update(sc, firmware);
+
+  if (run_update(sc, firmware, get_update_phases(), NULL) < 0 ||
+      (verify && verify_card(sc, firmware) < 0))
+    return finish_card(sc, -1);
+
+  return finish_card(sc, 0);
+}
+
+// round-trip latencies of cheap operations on a card
+struct probe_result {
+  struct scarlett2_stats ctl;
+  struct scarlett2_stats ioctl;
+  int                    ctl_errors;
+  int                    ioctl_errors;
+};
+
+// time probe_count round trips each of a Firmware Version control
+// read and a protocol version ioctl
+static int probe_card(struct sound_card *sc, struct probe_result *result) {
+  snd_ctl_t *ctl;
+
+  int err = scarlett2_ctl_open(sc->alsa_name, &ctl);
+  if (err < 0) {
+    fprintf(
+      stderr,
+      "Unable to open control interface for card %s: %s\n",
+      sc->alsa_name,
+      snd_strerror(err)
+    );
+    return -1;
+  }
+
+  if (open_card(sc) < 0) {
+    scarlett2_ctl_close(ctl);
+    return -1;
+  }
+
+  for (int i = 0; i < probe_count; i++) {
+    double start = scarlett2_now_us();
+    err = scarlett2_ctl_get_firmware_version(ctl);
+    double end = scarlett2_now_us();
+
+    if (err < 0)
+      result->ctl_errors++;
+    else
+      scarlett2_stats_add(&result->ctl, end - start);
+
+    start = scarlett2_now_us();
+    err = scarlett2_get_protocol_version(sc->hwdep);
+    end = scarlett2_now_us();
+
+    if (err < 0)
+      result->ioctl_errors++;
+    else
+      scarlett2_stats_add(&result->ioctl, end - start);
+  }
+
+  scarlett2_ctl_close(ctl);
+  return 0;
+}
+
+static void print_probe_stats(
+  const char             *name,
+  struct scarlett2_stats *stats,
+  int                     errors
+) {
+  printf(
+    "  %-12s p50 %7.3f ms  p99 %7.3f ms  max %7.3f ms  errors %d/%d\n",
+    name,
+    scarlett2_stats_percentile(stats, 50) / 1000,
+    scarlett2_stats_percentile(stats, 99) / 1000,
+    scarlett2_stats_max(stats) / 1000,
+    errors,
+    probe_count
+  );
+}
+
+static void print_caps(struct scarlett2_caps *caps) {
+  printf(
+    "  driver       protocol %d.%d.%d (%s), ",
+    SCARLETT2_HWDEP_VERSION_MAJOR(caps->protocol_version),
+    SCARLETT2_HWDEP_VERSION_MINOR(caps->protocol_version),
+    SCARLETT2_HWDEP_VERSION_SUBMINOR(caps->protocol_version),
+    caps->known ? "known" : "untested"
+  );
+  if (caps->max_write)
+    printf("%zu-byte writes, ", caps->max_write);
+  else
+    printf("write size unknown, ");
+  printf(
+    "erase progress %s, poll every %d ms\n",
+    caps->reliable_progress ? "reliable" : "unreliable",
+    caps->erase_poll_ms
+  );
+}
+
+static void print_probe_result(
+  struct sound_card   *sc,
+  struct probe_result *result
+) {
+  printf(
+    "%s: %s (usb %s)\n",
+    sc->card_name,
+    sc->product_name,
+    *sc->usb_path ? sc->usb_path : "unknown"
+  );
+  print_probe_stats("ctl read", &result->ctl, result->ctl_errors);
+  print_probe_stats("hwdep ioctl", &result->ioctl, result->ioctl_errors);
+  print_caps(&sc->caps);
+}
+
+// check the probe result against --latency-budget; any error or a
+// p99 over budget fails
+static int check_probe_result(
+  struct sound_card   *sc,
+  struct probe_result *result
+) {
+  double ctl_p99 = scarlett2_stats_percentile(&result->ctl, 99) / 1000;
+  double ioctl_p99 = scarlett2_stats_percentile(&result->ioctl, 99) / 1000;
+
+  if (result->ctl_errors || result->ioctl_errors) {
+    fprintf(
+      stderr,
+      "Card %s: %d errors in %d probe round trips\n",
+      sc->alsa_name,
+      result->ctl_errors + result->ioctl_errors,
+      probe_count * 2
+    );
+    return -1;
+  }
+
+  if (latency_budget_ms &&
+      (ctl_p99 > latency_budget_ms || ioctl_p99 > latency_budget_ms)) {
+    fprintf(
+      stderr,
+      "Card %s: USB link latency over budget "
+        "(p99 %.3f ms ctl, %.3f ms ioctl > %.3f ms)\n",
+      sc->alsa_name,
+      ctl_p99,
+      ioctl_p99,
+      latency_budget_ms
+    );
+    return -1;
+  }
+
+  return 0;
+}
+
+static void free_probe_result(struct probe_result *result) {
+  scarlett2_stats_clear(&result->ctl);
+  scarlett2_stats_clear(&result->ioctl);
+}
+
+// an operation on one card as part of a batch
+struct card_job {
+  struct sound_card              *card;
+  struct found_firmware          *ff;
+  struct scarlett2_firmware_file *firmware;
+  struct probe_result             probe;
+  pthread_t                       thread;
+  int                             started;
+  int                             result;
+
+  // with --window: expected duration, and why the job wasn't run
+  double                          estimate_ms;
+  const char                     *deferred;
+
+  // config: the card's configuration, and controls written
+  struct scarlett2_config         config;
+  int                             writes;
+};
+
+// check everything that can be checked without touching the flash:
+// the card opens, speaks a supported protocol version, isn't in use,
+// and the firmware file is readable, for this PID, and intact
+static void *preflight_job_thread(void *arg) {
+  struct card_job *job = arg;
+
+  job->result = -1;
+
+  if (open_card(job->card) < 0)
+    return NULL;
+
+  status_set_phase(job->card, SCARLETT2_PHASE_PREFLIGHT);
+
+  // refuse cards behind a slow or unreliable USB link
+  if (latency_budget_ms &&
+      (probe_card(job->card, &job->probe) < 0 ||
+       check_probe_result(job->card, &job->probe) < 0))
+    return NULL;
+
+  job->firmware = load_firmware(job->card, job->ff);
+  if (!job->firmware)
+    return NULL;
+
+  if (keep_config && check_keep_config(job->card, job->firmware) < 0)
+    return NULL;
+
+  job->result = 0;
+  return NULL;
+}
+
+static void *probe_job_thread(void *arg) {
+  struct card_job *job = arg;
+
+  job->result = probe_card(job->card, &job->probe);
+  close_card(job->card);
+
+  return NULL;
+}
+
+// the update of a card, as a task for the engine
+struct card_task {
+  struct scarlett2_engine_task  task;
+  struct card_job              *job;
+  int                           verify;
+  struct scarlett2_update       update;
+  struct reboot_wait            reboot;
+  int                           rebooting;
+};
+
+static int card_task_step(struct scarlett2_engine_task *task) {
+  struct card_task *ct = (struct card_task *)task;
+  struct sound_card *sc = ct->job->card;
+  struct scarlett2_firmware_file *firmware = ct->job->firmware;
+  int result;
+
+  if (ct->rebooting) {
+    result = check_reboot_wait(sc, &ct->reboot);
+    if (result > 0)
+      return result;
+    if (!result)
+      result = check_card_version(sc, firmware);
+    goto done;
+  }
+
+  int state = step_card_update(sc, &ct->update, firmware, NULL);
+
+  if (state == SCARLETT2_UPDATE_STATE_FAILED) {
+    result = -1;
+    goto done;
+  }
+  if (state != SCARLETT2_UPDATE_STATE_DONE)
+    return wait_for_update_task(task, &ct->update);
+
+  result = 0;
+  if (!ct->verify)
+    goto done;
+
+  card_printf(sc, "Waiting for reboot...\n");
+  result = start_reboot_wait(sc, &ct->reboot);
+  if (result > 0) {
+    ct->rebooting = 1;
+    return 0;
+  }
+  if (!result)
+    result = check_card_version(sc, firmware);
+
+done:
+  ct->job->result = finish_card(sc, result);
+  return -1;
+}
+
+// update the cards of all the jobs from this thread, with each card's
+// writes on a writer thread of its own so they overlap; returns the
+// number of jobs that failed
+static int run_engine_jobs(struct card_job *jobs, int count, int verify) {
+  struct scarlett2_engine engine;
+  int failed = 0;
+
+  struct card_task *tasks = calloc(count, sizeof(*tasks));
+  if (!tasks) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  scarlett2_engine_init(&engine);
+
+  for (int i = 0; i < count; i++) {
+    struct card_task *ct = &tasks[i];
+    struct sound_card *sc = jobs[i].card;
+
+    announce_update(sc, jobs[i].firmware);
+
+    if (open_card(sc) < 0) {
+      jobs[i].result = finish_card(sc, -1);
+      continue;
+    }
+
+    ct->task.step = card_task_step;
+    ct->job = &jobs[i];
+    ct->verify = verify;
+    scarlett2_update_init(
+      &ct->update, sc->hwdep, &sc->caps, jobs[i].firmware,
+      get_update_phases(), sc->card_num
+    );
+    scarlett2_engine_add(&engine, &ct->task);
+  }
+
+  scarlett2_engine_run(&engine);
+
+  for (int i = 0; i < count; i++)
+    if (jobs[i].result < 0)
+      failed++;
+
+  free(tasks);
+
+  return failed;
+}
+
+// run a thread per job and wait for them all; returns the number of
+// jobs that failed
+static int run_job_threads(
+  struct card_job *jobs,
+  int                count,
+  void            *(*fn)(void *)
+) {
+  int failed = 0;
+
+  for (int i = 0; i < count; i++) {
+    jobs[i].started = 0;
+
+    int err = pthread_create(&jobs[i].thread, NULL, fn, &jobs[i]);
+    if (err) {
+      fprintf(
+        stderr,
+        "Unable to start thread for card %s: %s\n",
+        jobs[i].card->alsa_name,
+        strerror(err)
+      );
+      jobs[i].result = -1;
+      continue;
+    }
+    jobs[i].started = 1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (jobs[i].started)
+      pthread_join(jobs[i].thread, NULL);
+    if (jobs[i].result < 0)
+      failed++;
+  }
+
+  return failed;
+}
+
+static void free_card_jobs(struct card_job *jobs, int count) {
+  for (int i = 0; i < count; i++) {
+    if (jobs[i].deferred)
+      defer_card(jobs[i].card);
+    else if (jobs[i].card->status)
+      finish_card(jobs[i].card, jobs[i].result);
+    close_card(jobs[i].card);
+    scarlett2_free_firmware_file(jobs[i].firmware);
+    jobs[i].firmware = NULL;
+    free_probe_result(&jobs[i].probe);
+    scarlett2_config_free(&jobs[i].config);
+  }
+}
+
+// pre-flight check all the cards in parallel; if any fail, none are
+// touched
+static int preflight_card_jobs(struct card_job *jobs, int count) {
+  int failed = run_job_threads(jobs, count, preflight_job_thread);
+  if (!failed)
+    return 0;
+
+  fprintf(
+    stderr,
+    "Pre-flight check failed for %d of %d device%s; "
+      "no devices were modified\n",
+    failed,
+    count,
+    count > 1 ? "s" : ""
+  );
+  for (int i = 0; i < count; i++)
+    jobs[i].result = -1;
+
+  return -1;
+}
+
+// longest first; jobs without an estimate go last
+static int compare_job_estimates(const void *a, const void *b) {
+  const struct card_job *ja = a, *jb = b;
+
+  return (ja->estimate_ms < jb->estimate_ms) -
+         (ja->estimate_ms > jb->estimate_ms);
+}
+
+// fit jobs into the window: longest first, each into the slot that
+// frees up soonest, deferring any that would then finish late; the
+// jobs to run are moved to the front, and their number returned
+static int plan_window(struct card_job *jobs, int count, int slot_count) {
+  double window_ms = window_sec * 1000;
+  double *slot_free = calloc(slot_count, sizeof(*slot_free));
+  if (!slot_free) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < count; i++) {
+    struct card_job *job = &jobs[i];
+    struct scarlett2_profile *profile = scarlett2_get_profile(
+      profiles, job->card->pid, job->card->firmware_version
+    );
+
+    job->deferred = NULL;
+    job->estimate_ms = profile ?
+      scarlett2_profile_estimate_ms(
+        profile, job->ff->firmware->firmware_length
+      ) * WINDOW_ESTIMATE_MARGIN :
+      0;
+    if (!profile)
+      job->deferred = "no duration estimate; run characterize";
+  }
+
+  qsort(jobs, count, sizeof(*jobs), compare_job_estimates);
+
+  printf(
+    "Maintenance window %.0f s, %d slot%s:\n",
+    window_sec,
+    slot_count,
+    slot_count > 1 ? "s" : ""
+  );
+
+  int scheduled = 0;
+
+  for (int i = 0; i < count; i++) {
+    struct card_job *job = &jobs[i];
+    int slot = 0;
+
+    for (int j = 1; j < slot_count; j++)
+      if (slot_free[j] < slot_free[slot])
+        slot = j;
+
+    if (!job->deferred && slot_free[slot] + job->estimate_ms > window_ms)
+      job->deferred = "would not finish within the window";
+
+    printf("  %s: %s: ", job->card->card_name, job->card->product_name);
+
+    if (job->deferred) {
+      printf("deferred (%s)\n", job->deferred);
+      continue;
+    }
+
+    printf(
+      "~%.0f s in slot %d, from +%.0f s\n",
+      job->estimate_ms / 1000,
+      slot + 1,
+      slot_free[slot] / 1000
+    );
+    slot_free[slot] += job->estimate_ms;
+
+    // keep the scheduled jobs in front, in order
+    struct card_job tmp = *job;
+    memmove(&jobs[scheduled + 1], &jobs[scheduled],
+            (i - scheduled) * sizeof(*jobs));
+    jobs[scheduled++] = tmp;
+  }
+
+  free(slot_free);
+
+  return scheduled;
+}
+
+static void print_deferred_jobs(
+  struct card_job *jobs,
+  int              count,
+  const char      *until
+) {
+  int deferred = 0;
+
+  for (int i = 0; i < count; i++)
+    if (jobs[i].deferred)
+      deferred++;
+
+  if (!deferred)
+    return;
+
+  printf(
+    "Deferred %d device%s%s%s:\n",
+    deferred,
+    deferred > 1 ? "s" : "",
+    *until ? " " : "",
+    until
+  );
+  for (int i = 0; i < count; i++)
+    if (jobs[i].deferred)
+      printf(
+        "  %s: %s (serial %s): %s\n",
+        jobs[i].card->card_name,
+        jobs[i].card->product_name,
+        *jobs[i].card->serial ? jobs[i].card->serial : "unknown",
+        jobs[i].deferred
+      );
+}
+
+// jobs in a window shared between the slot threads
+struct window_queue {
+  struct card_job *jobs;
+  int              count;
+  int              next;
+  double           start_us;
+  pthread_mutex_t  lock;
+};
+
+// run jobs from the queue until it's empty; the time left is checked
+// again before each start, as earlier jobs may have overrun
+static void *window_slot_thread(void *arg) {
+  struct window_queue *queue = arg;
+
+  for (;;) {
+    struct card_job *job = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->next < queue->count) {
+      struct card_job *j = &queue->jobs[queue->next++];
+      double elapsed_ms = (scarlett2_now_us() - queue->start_us) / 1000;
+
+      if (elapsed_ms + j->estimate_ms <= window_sec * 1000) {
+        job = j;
+        break;
+      }
+
+      j->deferred = "window time used up by earlier updates";
+      card_printf(j->card, "Deferred: %s\n", j->deferred);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (!job)
+      return NULL;
+
+    job->result = update_card(job->card, job->firmware, 0);
+  }
+}
+
+// update as many cards as will fit in the maintenance window;
+// returns the number of jobs that failed
+static int run_window_jobs(struct card_job *jobs, int count) {
+  struct window_queue queue = {
+    .jobs     = jobs,
+    .start_us = scarlett2_now_us(),
+    .lock     = PTHREAD_MUTEX_INITIALIZER
+  };
+  int slot_count = window_slots && window_slots < count ?
+                     window_slots : count;
+
+  queue.count = plan_window(jobs, count, slot_count);
+  if (slot_count > queue.count)
+    slot_count = queue.count;
+
+  multi_card = queue.count > 1;
+
+  if (preflight_card_jobs(jobs, queue.count) < 0) {
+    free_card_jobs(jobs, count);
+    return queue.count;
+  }
+
+  pthread_t *threads = calloc(slot_count + 1, sizeof(*threads));
+  if (!threads) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  int started = 0;
+  for (; started < slot_count; started++) {
+    int err = pthread_create(
+      &threads[started], NULL, window_slot_thread, &queue
+    );
+    if (err) {
+      fprintf(stderr, "Unable to start thread: %s\n", strerror(err));
+      break;
+    }
+  }
+
+  // no threads; run the queue one at a time instead
+  if (!started)
+    window_slot_thread(&queue);
+
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  int failed = 0;
+  for (int i = 0; i < count; i++)
+    if (!jobs[i].deferred && jobs[i].result < 0)
+      failed++;
+
+  print_deferred_jobs(jobs, count, "to the next window");
+
+  free_card_jobs(jobs, count);
+
+  return failed;
+}
+
+// update one canary card, then waves of 2, 4, 8, ... up to max_wave
+// cards; each wave must come back running the new firmware before
+// the next starts, so a bad image can only reach one wave
+static int run_wave_jobs(struct card_job *jobs, int count) {
+  multi_card = count > 1;
+
+  if (preflight_card_jobs(jobs, count) < 0) {
+    free_card_jobs(jobs, count);
+    return count;
+  }
+
+  int failed = 0;
+  int wave_size = 1;
+  int done = 0;
+
+  for (int wave = 1; done < count; wave++) {
+    int n = count - done < wave_size ? count - done : wave_size;
+
+    printf(
+      "Wave %d: updating %d device%s (%d of %d done)\n",
+      wave,
+      n,
+      n > 1 ? "s" : "",
+      done,
+      count
+    );
+
+    failed = run_engine_jobs(jobs + done, n, 1);
+    done += n;
+
+    if (failed) {
+      fprintf(
+        stderr,
+        "Wave %d: %d of %d device%s failed; halting rollout\n",
+        wave,
+        failed,
+        n,
+        n > 1 ? "s" : ""
+      );
+      for (int i = done; i < count; i++)
+        jobs[i].deferred = "rollout halted";
+      break;
+    }
+
+    printf("Wave %d: verified\n", wave);
+
+    wave_size *= 2;
+    if (wave_size > max_wave)
+      wave_size = max_wave;
+  }
+
+  print_deferred_jobs(jobs, count, "");
+
+  free_card_jobs(jobs, count);
+
+  return failed;
+}
+
+// pre-flight check all the cards in parallel, then if they all pass,
+// update them concurrently; returns the number of jobs that failed
+static int run_card_jobs(struct card_job *jobs, int count) {
+  if (!count)
+    return 0;
+
+  if (window_sec)
+    return run_window_jobs(jobs, count);
+
+  if (max_wave)
+    return run_wave_jobs(jobs, count);
+
+  multi_card = count > 1;
+
+  if (preflight_card_jobs(jobs, count) < 0) {
+    free_card_jobs(jobs, count);
+    return count;
+  }
+
+  int failed = run_engine_jobs(jobs, count, 0);
+
+  free_card_jobs(jobs, count);
+
+  return failed;
+}
+
+// measure USB link latency to each selected card
+static void probe_cards(void) {
+  struct card_job *jobs = calloc(selected_cards_count, sizeof(*jobs));
+  if (!jobs) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < selected_cards_count; i++)
+    jobs[i].card = selected_cards[i];
+
+  int failed = run_job_threads(jobs, selected_cards_count, probe_job_thread);
+
+  for (int i = 0; i < selected_cards_count; i++) {
+    struct card_job *job = &jobs[i];
+
+    if (job->result < 0)
+      continue;
+
+    print_probe_result(job->card, &job->probe);
+    if (check_probe_result(job->card, &job->probe) < 0)
+      failed++;
+  }
+
+  free_card_jobs(jobs, selected_cards_count);
+  free(jobs);
+
+  if (failed)
+    exit(EXIT_FAILURE);
+}
+
+static int confirm(const char *prompt) {
+  char buf[16];
+
+  if (assume_yes)
+    return 1;
+
+  printf("%sType 'yes' to continue: ", prompt);
+  fflush(stdout);
+
+  if (!fgets(buf, sizeof(buf), stdin))
+    return 0;
+
+  return !strcmp(buf, "yes\n");
+}
+
+// per-cycle measurements from characterize
+struct characterize_stats {
+  struct scarlett2_stats settings_block_ms;
+  struct scarlett2_stats firmware_block_ms;
+  struct scarlett2_stats write_bytes_per_sec;
+  struct scarlett2_stats write_us;
+  struct scarlett2_stats reboot_ms;
+  int                    settings_blocks;
+  int                    firmware_blocks;
+
+  // write latency of the current cycle, and its p99 in the first and
+  // last cycles
+  struct scarlett2_stats cycle_write_us;
+  double                 write_p99_ms[2];
+
+  // memory and open files after the first and last cycles; by then
+  // anything allocated once has been, so growth is a leak
+  long                   rss_kb[2];
+  int                    fds[2];
+};
+
+// resident set size in kB and number of open file descriptors of
+// this process; returns -1 if /proc can't tell
+static int get_resource_usage(long *rss_kb, int *fds) {
+  long pages;
+
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return -1;
+  int count = fscanf(f, "%*d %ld", &pages);
+  fclose(f);
+  if (count != 1)
+    return -1;
+  *rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+
+  *fds = 0;
+  DIR *dir = opendir("/proc/self/fd");
+  if (!dir)
+    return -1;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)))
+    if (entry->d_name[0] != '.')
+      (*fds)++;
+  closedir(dir);
+
+  // not counting the one opendir() used
+  (*fds)--;
+
+  return 0;
+}
+
+// after each cycle, note what it used
+static void end_characterize_cycle(
+  struct characterize_stats *stats,
+  int                        cycle
+) {
+  struct scarlett2_stats *cycle_write_us = &stats->cycle_write_us;
+  int i = cycle > 0;
+
+  for (int j = 0; j < cycle_write_us->count; j++)
+    scarlett2_stats_add(&stats->write_us, cycle_write_us->samples[j]);
+
+  stats->write_p99_ms[i] =
+    scarlett2_stats_percentile(cycle_write_us, 99) / 1000;
+  scarlett2_stats_clear(cycle_write_us);
+
+  // -1 open files marks the usage as unknown
+  if (get_resource_usage(&stats->rss_kb[i], &stats->fds[i]) < 0)
+    stats->fds[i] = -1;
+}
+
+// compare the last cycle with the first; returns -1 if file
+// descriptors leaked or latency drifted more than --max-drift
+static int check_characterize_drift(struct characterize_stats *stats) {
+  int err = 0;
+
+  if (update_cycles < 2)
+    return 0;
+
+  printf(
+    "  %-16s first %.2f  last %.2f ms (p99 write latency)\n",
+    "drift",
+    stats->write_p99_ms[0],
+    stats->write_p99_ms[1]
+  );
+  if (stats->fds[0] < 0 || stats->fds[1] < 0)
+    printf(
+      "  %-16s not checked (/proc/self unreadable)\n", "resources"
+    );
+  else
+    printf(
+      "  %-16s RSS %ld -> %ld kB, %d -> %d open files "
+        "(after first and last cycles)\n",
+      "resources",
+      stats->rss_kb[0],
+      stats->rss_kb[1],
+      stats->fds[0],
+      stats->fds[1]
+    );
+
+  if (stats->fds[0] >= 0 && stats->fds[1] > stats->fds[0]) {
+    fprintf(
+      stderr,
+      "%d file descriptor%s leaked over %d cycles\n",
+      stats->fds[1] - stats->fds[0],
+      stats->fds[1] - stats->fds[0] > 1 ? "s" : "",
+      update_cycles - 1
+    );
+    err = -1;
+  }
+
+  if (max_drift_pct &&
+      stats->write_p99_ms[1] >
+        stats->write_p99_ms[0] * (1 + max_drift_pct / 100.0)) {
+    fprintf(
+      stderr,
+      "p99 write latency drifted from %.2f to %.2f ms (limit %d%%)\n",
+      stats->write_p99_ms[0],
+      stats->write_p99_ms[1],
+      max_drift_pct
+    );
+    err = -1;
+  }
+
+  return err;
+}
+
+// time one full update cycle
+static int characterize_cycle(
+  struct sound_card              *sc,
+  struct scarlett2_firmware_file *firmware,
+  struct characterize_stats      *stats
+) {
+  double start = scarlett2_now_us();
+  if (reset_config(sc) < 0)
+    return -1;
+  stats->settings_blocks = sc->erase_num_blocks;
+  if (stats->settings_blocks)
+    scarlett2_stats_add(
+      &stats->settings_block_ms,
+      (scarlett2_now_us() - start) / 1000 / stats->settings_blocks
+    );
+
+  start = scarlett2_now_us();
+  if (erase_firmware(sc) < 0)
+    return -1;
+  stats->firmware_blocks = sc->erase_num_blocks;
+  if (stats->firmware_blocks)
+    scarlett2_stats_add(
+      &stats->firmware_block_ms,
+      (scarlett2_now_us() - start) / 1000 / stats->firmware_blocks
+    );
+
+  start = scarlett2_now_us();
+  if (update_firmware(sc, firmware, &stats->cycle_write_us) < 0)
+    return -1;
+  scarlett2_stats_add(
+    &stats->write_bytes_per_sec,
+    firmware->header.firmware_length * 1e6 / (scarlett2_now_us() - start)
+  );
+
+  if (reboot_card(sc) < 0)
+    return -1;
+  start = scarlett2_now_us();
+  if (wait_for_reboot(sc) < 0)
+    return -1;
+  scarlett2_stats_add(
+    &stats->reboot_ms, (scarlett2_now_us() - start) / 1000
+  );
+
+  return 0;
+}
+
+static void print_characterize_stats(
+  const char             *name,
+  struct scarlett2_stats *stats,
+  const char             *units,
+  double                  scale
+) {
+  printf(
+    "  %-16s mean %9.2f  stddev %8.2f  min %9.2f  max %9.2f %s\n",
+    name,
+    scarlett2_stats_mean(stats) * scale,
+    scarlett2_stats_stddev(stats) * scale,
+    scarlett2_stats_min(stats) * scale,
+    scarlett2_stats_max(stats) * scale,
+    units
+  );
+}
+
+// repeatedly erase, write, and reboot a (spare!) card to measure its
+// performance, and save the results as a device profile
+static void characterize(void) {
+  struct sound_card *sc = selected_card;
+  struct found_firmware *ff;
+  char prompt[256];
+
+  // rewrite the firmware the card is running unless told otherwise,
+  // so it ends up as it started (apart from the configuration)
+  if (selected_firmware_version)
+    ff = get_firmware_for_version(sc->pid, selected_firmware_version);
+  else
+    ff = get_firmware_for_version(sc->pid, sc->firmware_version);
+  if (!ff && !selected_firmware_version)
+    ff = get_latest_firmware(sc->pid);
+  if (!ff) {
+    fprintf(stderr, "No suitable firmware available for %s\n",
+            sc->product_name);
+    exit(EXIT_FAILURE);
+  }
+
+  struct scarlett2_firmware_file *firmware = load_firmware(sc, ff);
+  if (!firmware)
+    exit(EXIT_FAILURE);
+
+  snprintf(
+    prompt, sizeof(prompt),
+    "WARNING: this will reset the configuration of %s (%s) and\n"
+    "rewrite its firmware with version %d, %d times.\n"
+    "Only use this on a spare device.\n",
+    sc->product_name,
+    sc->card_name,
+    firmware->header.firmware_version,
+    update_cycles
+  );
+  if (!confirm(prompt)) {
+    fprintf(stderr, "Not confirmed; no changes made\n");
+    exit(EXIT_FAILURE);
+  }
+
+  struct characterize_stats stats = { 0 };
+
+  for (int i = 0; i < update_cycles; i++) {
+    printf("Cycle %d of %d\n", i + 1, update_cycles);
+    if (characterize_cycle(sc, firmware, &stats) < 0) {
+      finish_card(sc, -1);
+      fprintf(stderr, "Characterization of %s failed\n", sc->alsa_name);
+      exit(EXIT_FAILURE);
+    }
+    end_characterize_cycle(&stats, i);
+  }
+
+  printf(
+    "\n%s (PID %04x), firmware %d, %d cycle%s:\n",
+    sc->product_name,
+    sc->pid,
+    firmware->header.firmware_version,
+    update_cycles,
+    update_cycles > 1 ? "s" : ""
+  );
+  print_characterize_stats(
+    "settings erase", &stats.settings_block_ms, "ms/block", 1
+  );
+  print_characterize_stats(
+    "firmware erase", &stats.firmware_block_ms, "ms/block", 1
+  );
+  print_characterize_stats(
+    "write throughput", &stats.write_bytes_per_sec, "kB/s", 1e-3
+  );
+  print_characterize_stats("write latency", &stats.write_us, "ms", 1e-3);
+  printf(
+    "  %-16s p50 %.2f  p99 %.2f  max %.2f ms (%d writes)\n",
+    "",
+    scarlett2_stats_percentile(&stats.write_us, 50) / 1000,
+    scarlett2_stats_percentile(&stats.write_us, 99) / 1000,
+    scarlett2_stats_max(&stats.write_us) / 1000,
+    stats.write_us.count
+  );
+  print_characterize_stats("reboot to ready", &stats.reboot_ms, "ms", 1);
+  int drift_err = check_characterize_drift(&stats);
+
+  finish_card(sc, 0);
+
+  struct scarlett2_profile profile = {
+    .pid                     = sc->pid,
+    .firmware_version        = firmware->header.firmware_version,
+    .cycles                  = update_cycles,
+    .settings_blocks         = stats.settings_blocks,
+    .settings_erase_block_ms = scarlett2_stats_mean(&stats.settings_block_ms),
+    .firmware_blocks         = stats.firmware_blocks,
+    .firmware_erase_block_ms = scarlett2_stats_mean(&stats.firmware_block_ms),
+    .write_bytes_per_sec     = scarlett2_stats_mean(
+                                 &stats.write_bytes_per_sec
+                               ),
+    .write_p50_ms            = scarlett2_stats_percentile(
+                                 &stats.write_us, 50
+                               ) / 1000,
+    .write_p99_ms            = scarlett2_stats_percentile(
+                                 &stats.write_us, 99
+                               ) / 1000,
+    .write_max_ms            = scarlett2_stats_max(&stats.write_us) / 1000,
+    .reboot_ms               = scarlett2_stats_mean(&stats.reboot_ms)
+  };
+
+  struct scarlett2_profiles *saved = scarlett2_read_profiles(profile_fn);
+  if (!saved ||
+      scarlett2_set_profile(saved, &profile) < 0 ||
+      scarlett2_write_profiles(profile_fn, saved) < 0) {
+    fprintf(stderr, "Unable to save profile to %s\n", profile_fn);
+    exit(EXIT_FAILURE);
+  }
+  printf("\nProfile saved to %s\n", profile_fn);
+
+  scarlett2_free_profiles(saved);
+  scarlett2_free_firmware_file(firmware);
+  scarlett2_stats_clear(&stats.settings_block_ms);
+  scarlett2_stats_clear(&stats.firmware_block_ms);
+  scarlett2_stats_clear(&stats.write_bytes_per_sec);
+  scarlett2_stats_clear(&stats.write_us);
+  scarlett2_stats_clear(&stats.reboot_ms);
+
+  if (drift_err < 0)
+    exit(EXIT_FAILURE);
+}
+
+static const char *soak_phase_names[SOAK_PHASE_COUNT] = {
+  [SOAK_ENUMERATE]      = "enumerate",
+  [SOAK_SELECT]         = "select",
+  [SOAK_RESET_CONFIG]   = "reset config",
+  [SOAK_ERASE_FIRMWARE] = "erase firmware",
+  [SOAK_WRITE]          = "write firmware",
+  [SOAK_REBOOT]         = "reboot",
+  [SOAK_REBOOT_WAIT]    = "reboot wait"
+};
+
+// phases quicker than this at the first sample are too short for
+// their drift to mean anything
+#define SOAK_MIN_DRIFT_MS 1
+
+// measurements over the current interval, and from the first one
+struct soak_stats {
+  struct scarlett2_stats phase_us[SOAK_PHASE_COUNT];
+
+  // memory, open files, and p99 phase times after the first
+  // interval; by then anything allocated once has been, so growth is
+  // a leak
+  int                    sampled;
+  long                   rss_kb;
+  int                    fds;
+  double                 p99_ms[SOAK_PHASE_COUNT];
+};
+
+// stdout as it was, and /dev/null, which the cycles' card output is
+// sent to so that only the samples and failures are shown
+static int soak_stdout_fd = -1;
+static int soak_null_fd = -1;
+
+static void open_soak_output(void) {
+  fflush(stdout);
+  soak_stdout_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+  soak_null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (soak_stdout_fd < 0 || soak_null_fd < 0) {
+    perror("Unable to redirect the card output");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// send stdout to the terminal (or wherever it was), or discard it
+static void show_soak_output(int show) {
+  fflush(stdout);
+  if (dup2(show ? soak_stdout_fd : soak_null_fd, STDOUT_FILENO) < 0) {
+    perror("dup2");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void close_soak_output(void) {
+  show_soak_output(1);
+  close(soak_stdout_fd);
+  close(soak_null_fd);
+  soak_stdout_fd = soak_null_fd = -1;
+}
+
+// enumerate, select, and update the cards as the session recorded,
+// including any reboot and wait for the cards to come back; returns
+// the number of cards that failed
+static int soak_cycle(void) {
+  double start_us = scarlett2_now_us();
+
+  enum_cards_and_firmwares();
+  scarlett2_stats_add(
+    &soak_phase_us[SOAK_ENUMERATE], scarlett2_now_us() - start_us
+  );
+
+  start_us = scarlett2_now_us();
+  check_card_selection(1);
+
+  struct card_job *jobs = calloc(selected_cards_count, sizeof(*jobs));
+  if (!jobs) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < selected_cards_count; i++) {
+    jobs[i].card = selected_cards[i];
+    jobs[i].ff = check_firmware_selection(selected_cards[i]);
+  }
+  scarlett2_stats_add(
+    &soak_phase_us[SOAK_SELECT], scarlett2_now_us() - start_us
+  );
+
+  int failed = run_card_jobs(jobs, selected_cards_count);
+  free(jobs);
+
+  // the next cycle finds and selects the cards again
+  free(selected_cards);
+  selected_cards = NULL;
+  selected_cards_count = 0;
+  selected_card = NULL;
+  free_found();
+
+  return failed;
+}
+
+// print the memory, open files, and phase times at the end of an
+// interval; returns -1 if they've grown or drifted past a limit since
+// the first interval
+static int check_soak_sample(struct soak_stats *stats, int cycle) {
+  long rss_kb;
+  int fds;
+  int err = 0;
+
+  if (get_resource_usage(&rss_kb, &fds) < 0) {
+    fprintf(
+      stderr,
+      "Unable to read memory and open files from /proc/self after "
+        "%d cycles\n",
+      cycle
+    );
+    return -1;
+  }
+
+  printf(
+    "\nAfter %d cycle%s: RSS %ld kB, %d open files\n",
+    cycle,
+    cycle > 1 ? "s" : "",
+    rss_kb,
+    fds
+  );
+
+  for (int i = 0; i < SOAK_PHASE_COUNT; i++) {
+    struct scarlett2_stats *phase_us = &stats->phase_us[i];
+
+    if (!phase_us->count)
+      continue;
+
+    double p99_ms = scarlett2_stats_percentile(phase_us, 99) / 1000;
+
+    printf(
+      "  %-16s p50 %9.3f  p99 %9.3f  max %9.3f ms\n",
+      soak_phase_names[i],
+      scarlett2_stats_percentile(phase_us, 50) / 1000,
+      p99_ms,
+      scarlett2_stats_max(phase_us) / 1000
+    );
+
+    if (!stats->sampled) {
+      stats->p99_ms[i] = p99_ms;
+    } else if (max_drift_pct &&
+               stats->p99_ms[i] >= SOAK_MIN_DRIFT_MS &&
+               p99_ms > stats->p99_ms[i] * (1 + max_drift_pct / 100.0)) {
+      fprintf(
+        stderr,
+        "p99 %s time drifted from %.3f to %.3f ms (limit %d%%)\n",
+        soak_phase_names[i],
+        stats->p99_ms[i],
+        p99_ms,
+        max_drift_pct
+      );
+      err = -1;
+    }
+
+    scarlett2_stats_clear(phase_us);
+  }
+
+  if (!stats->sampled) {
+    stats->sampled = 1;
+    stats->rss_kb = rss_kb;
+    stats->fds = fds;
+    return 0;
+  }
+
+  if (rss_kb - stats->rss_kb > max_rss_growth_kb) {
+    fprintf(
+      stderr,
+      "RSS grew from %ld to %ld kB (limit %d kB)\n",
+      stats->rss_kb,
+      rss_kb,
+      max_rss_growth_kb
+    );
+    err = -1;
+  }
+
+  if (fds - stats->fds > max_fd_growth) {
+    fprintf(
+      stderr,
+      "Open files grew from %d to %d (limit %d)\n",
+      stats->fds,
+      fds,
+      max_fd_growth
+    );
+    err = -1;
+  }
+
+  return err;
+}
+
+// repeat the update session being replayed, to find leaks and
+// slowdowns that only show after many cycles
+static void soak(void) {
+  struct soak_stats stats = { 0 };
+  int cycles = update_cycles ? update_cycles : 1000;
+
+  if (strcmp(command, "update")) {
+    fprintf(
+      stderr,
+      "soak needs a session recorded with update, not %s\n",
+      command
+    );
+    exit(EXIT_FAILURE);
+  }
+
+  soak_phase_us = stats.phase_us;
+  profiles = scarlett2_read_profiles(profile_fn);
+
+  // the policy file is optional here; it only supplies keep-config
+  // rules
+  if (keep_config && access(policy_fn, F_OK) == 0) {
+    keep_config_policy = scarlett2_read_policy(policy_fn);
+    if (!keep_config_policy)
+      exit(EXIT_FAILURE);
+  }
+
+  // without /proc the leak checks would pass having measured nothing
+  long rss_kb;
+  int fds;
+  if (get_resource_usage(&rss_kb, &fds) < 0) {
+    fprintf(
+      stderr, "Unable to read memory and open files from /proc/self\n"
+    );
+    exit(EXIT_FAILURE);
+  }
+
+  printf("Soaking for %d cycles\n", cycles);
+  open_soak_output();
+
+  for (int i = 1; i <= cycles; i++) {
+    scarlett2_session_replay_rewind();
+
+    show_soak_output(0);
+    int failed = soak_cycle();
+    show_soak_output(1);
+
+    if (failed) {
+      fprintf(stderr, "Soak cycle %d of %d failed\n", i, cycles);
+      exit(EXIT_FAILURE);
+    }
+
+    if ((i % sample_every == 0 || i == cycles) &&
+        check_soak_sample(&stats, i) < 0) {
+      fprintf(stderr, "Soak failed after %d of %d cycles\n", i, cycles);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  close_soak_output();
+
+  soak_phase_us = NULL;
+  scarlett2_free_policy(keep_config_policy);
+  keep_config_policy = NULL;
+
+  printf("\nSoak passed: %d cycles\n", cycles);
+}
+
+// show the live status pages of operations in progress (or finished)
+static void show_status(void) {
+  DIR *dir = opendir(SCARLETT2_STATUS_DIR);
+  struct dirent *entry;
+  int count = 0;
+
+  if (!dir) {
+    if (errno != ENOENT) {
+      fprintf(
+        stderr,
+        "Unable to opendir %s: %s\n",
+        SCARLETT2_STATUS_DIR,
+        strerror(errno)
+      );
+      exit(EXIT_FAILURE);
+    }
+    printf("No operations found.\n");
+    return;
+  }
+
+  uint64_t now = scarlett2_now_us();
+
+  while ((entry = readdir(dir)) != NULL) {
+    char fn[PATH_MAX];
+    struct scarlett2_status_page page;
+
+    if (strncmp(entry->d_name, "card", 4) != 0)
+      continue;
+
+    snprintf(fn, sizeof(fn), "%s/%s", SCARLETT2_STATUS_DIR, entry->d_name);
+    if (scarlett2_status_read(fn, &page) < 0)
+      continue;
+
+    struct scarlett2_device *dev = get_device_for_pid(page.usb_pid);
+    int finished = page.phase == SCARLETT2_PHASE_DONE ||
+                   page.phase == SCARLETT2_PHASE_FAILED ||
+                   page.phase == SCARLETT2_PHASE_DEFERRED;
+
+    printf(
+      "%s: %s (serial %s): %s",
+      page.card_name,
+      dev ? dev->name : "unknown device",
+      *page.serial ? page.serial : "unknown",
+      scarlett2_status_phase_name(page.phase)
+    );
+
+    if (page.phase == SCARLETT2_PHASE_RESET_CONFIG ||
+        page.phase == SCARLETT2_PHASE_ERASE_FIRMWARE)
+      printf(" %d%% of %d blocks", page.erase_percent, page.erase_num_blocks);
+
+    if (page.phase == SCARLETT2_PHASE_WRITE)
+      printf(
+        " %d %llu/%llu bytes, %.1f kB/s",
+        page.firmware_version,
+        (unsigned long long)page.bytes_written,
+        (unsigned long long)page.bytes_total,
+        page.rate / 1000
+      );
+
+    if (!finished && page.eta >= 0)
+      printf(", ETA %.0f s", page.eta);
+
+    if (!finished && kill(page.writer_pid, 0) < 0 && errno == ESRCH)
+      printf(" [stale: process %d has exited]", page.writer_pid);
+    else if (page.updated_us <= now)
+      printf(" (%.1f s ago)", (now - page.updated_us) / 1e6);
+
+    printf("\n");
+    count++;
+  }
+
+  closedir(dir);
+
+  if (!count)
+    printf("No operations found.\n");
+}
+
+// look through the interfaces of a USB device for the drivers bound
+// to them and the ALSA card, if any
+static void get_usb_interfaces(
+  const char *dev_path,
+  const char *dev_name,
+  char       *drivers,
+  size_t      drivers_size,
+  int        *card_num
+) {
+  size_t name_len = strlen(dev_name);
+  struct dirent *entry;
+
+  *drivers = 0;
+  *card_num = -1;
+
+  DIR *dir = opendir(dev_path);
+  if (!dir)
+    return;
+
+  while ((entry = readdir(dir)) != NULL) {
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+
+    // interfaces are named <device>:<config>.<interface>
+    if (strncmp(entry->d_name, dev_name, name_len) != 0 ||
+        entry->d_name[name_len] != ':')
+      continue;
+
+    if (snprintf(path, sizeof(path), "%s/%s/driver",
+                 dev_path, entry->d_name) >= sizeof(path))
+      continue;
+    ssize_t len = readlink(path, link, sizeof(link) - 1);
+    if (len > 0) {
+      link[len] = 0;
+      char *driver = strrchr(link, '/');
+      driver = driver ? driver + 1 : link;
+
+      if (!strstr(drivers, driver) &&
+          strlen(drivers) + strlen(driver) + 2 < drivers_size) {
+        if (*drivers)
+          strcat(drivers, ",");
+        strcat(drivers, driver);
+      }
+    }
+
+    if (snprintf(path, sizeof(path), "%s/%s/sound",
+                 dev_path, entry->d_name) >= sizeof(path))
+      continue;
+    DIR *sound_dir = opendir(path);
+    if (!sound_dir)
+      continue;
+
+    struct dirent *sound_entry;
+    while ((sound_entry = readdir(sound_dir)) != NULL)
+      if (sscanf(sound_entry->d_name, "card%d", card_num) == 1)
+        break;
+    closedir(sound_dir);
+  }
+
+  closedir(dir);
+}
+
+// check one Focusrite USB device as far as it goes; returns 0 if
+// it's usable, -1 with *problem set if not
+static int triage_device(const char *dev_name, int pid, const char **problem) {
+  char dev_path[PATH_MAX];
+  char drivers[64];
+  char buf[64];
+  int card_num;
+
+  snprintf(dev_path, sizeof(dev_path), "%s/%s", SYSFS_USB_DEVICES, dev_name);
+
+  struct scarlett2_device *dev = get_device_for_pid(pid);
+  char serial[64];
+  read_sysfs_attr(dev_path, "serial", serial, sizeof(serial));
+  read_sysfs_attr(dev_path, "product", buf, sizeof(buf));
+
+  printf(
+    "%s: %04x:%04x %s (serial %s)\n",
+    dev_name,
+    VENDOR_VID,
+    pid,
+    dev ? dev->name : *buf ? buf : "unknown product",
+    *serial ? serial : "unknown"
+  );
+
+  get_usb_interfaces(
+    dev_path, dev_name, drivers, sizeof(drivers), &card_num
+  );
+  printf("  driver %s", *drivers ? drivers : "none");
+
+  if (!dev) {
+    *problem = "product not supported by this tool";
+    return -1;
+  }
+  if (!*drivers) {
+    *problem = "no driver bound";
+    return -1;
+  }
+  if (card_num < 0) {
+    *problem = "no ALSA card";
+    return -1;
+  }
+  printf(", card%d", card_num);
+
+  snprintf(buf, sizeof(buf), "/dev/snd/hwC%dD0", card_num);
+  if (access(buf, F_OK) != 0) {
+    *problem = "no hwdep device (needs Linux 6.8 or later)";
+    return -1;
+  }
+  printf(", hwC%dD0", card_num);
+
+  char alsa_name[32];
+  snprintf(alsa_name, sizeof(alsa_name), "hw:%d", card_num);
+
+  snd_hwdep_t *hwdep;
+  int err = scarlett2_open_card(alsa_name, &hwdep);
+  if (err < 0) {
+    *problem = err == -EBUSY ?
+                 "hwdep device busy (operation in progress?)" :
+                 "unable to open hwdep device";
+    return -1;
+  }
+
+  int version = scarlett2_get_protocol_version(hwdep);
+  scarlett2_close(hwdep);
+
+  if (version < 0) {
+    *problem = "unable to get hwdep protocol version";
+    return -1;
+  }
+  printf(
+    ", protocol %d.%d.%d",
+    SCARLETT2_HWDEP_VERSION_MAJOR(version),
+    SCARLETT2_HWDEP_VERSION_MINOR(version),
+    SCARLETT2_HWDEP_VERSION_SUBMINOR(version)
+  );
+  if (SCARLETT2_HWDEP_VERSION_MAJOR(version) != REQUIRED_HWDEP_VERSION_MAJOR) {
+    *problem = "unsupported hwdep protocol version";
+    return -1;
+  }
+
+  snd_ctl_t *ctl;
+  if (scarlett2_ctl_open(alsa_name, &ctl) < 0) {
+    *problem = "unable to open control interface";
+    return -1;
+  }
+  int firmware_version = scarlett2_ctl_get_firmware_version(ctl);
+  scarlett2_ctl_close(ctl);
+
+  if (firmware_version < 0) {
+    *problem = "unable to read Firmware Version control";
+    return -1;
+  }
+  printf(", firmware %d", firmware_version);
+
+  return 0;
+}
+
+// pack, apply, or sync firmware deltas
+static void delta(void) {
+  const char *sub = command_args_count ? command_args[0] : NULL;
+  int err;
+
+  if (sub && !strcmp(sub, "pack") && command_args_count == 2) {
+    err = scarlett2_delta_pack(command_args[1]);
+  } else if (sub && !strcmp(sub, "apply") && command_args_count == 2) {
+    err = scarlett2_delta_unpack(command_args[1]);
+  } else if (sub && !strcmp(sub, "sync") && command_args_count == 3) {
+    err = scarlett2_delta_sync(command_args[1], command_args[2]);
+  } else {
+    fprintf(
+      stderr,
+      "delta requires 'pack DIR', 'apply DIR', or 'sync SRC DST'\n"
+    );
+    short_help();
+  }
+
+  if (err)
+    exit(EXIT_FAILURE);
+}
+
+// golden configuration for config apply
+static struct scarlett2_config golden_config;
+
+static int read_card_config(
+  struct sound_card       *sc,
+  snd_ctl_t              **ctl,
+  struct scarlett2_config *config
+) {
+  int err = scarlett2_ctl_open(sc->alsa_name, ctl);
+  if (err < 0) {
+    fprintf(
+      stderr,
+      "Unable to open control interface for card %s: %s\n",
+      sc->alsa_name,
+      snd_strerror(err)
+    );
+    return -1;
+  }
+
+  err = scarlett2_config_read(*ctl, config);
+  if (err < 0) {
+    fprintf(
+      stderr,
+      "Unable to read controls of card %s: %s\n",
+      sc->alsa_name,
+      snd_strerror(err)
+    );
+    scarlett2_ctl_close(*ctl);
+    return -1;
+  }
+
+  config->pid = sc->pid;
+  return 0;
+}
+
+static void *config_snapshot_thread(void *arg) {
+  struct card_job *job = arg;
+  snd_ctl_t *ctl;
+
+  job->result = read_card_config(job->card, &ctl, &job->config);
+  if (!job->result)
+    scarlett2_ctl_close(ctl);
+
+  return NULL;
+}
+
+// read the card's configuration and write the controls which differ
+// from the golden configuration
+static void *config_apply_thread(void *arg) {
+  struct card_job *job = arg;
+  snd_ctl_t *ctl;
+
+  job->result = read_card_config(job->card, &ctl, &job->config);
+  if (job->result)
+    return NULL;
+
+  job->writes = scarlett2_config_apply(ctl, &job->config, &golden_config);
+  if (job->writes < 0)
+    job->result = -1;
+
+  scarlett2_ctl_close(ctl);
+  return NULL;
+}
+
+static void config_snapshot(const char *fn) {
+  if (fn && selected_cards_count > 1) {
+    fprintf(stderr, "Select one device with -c to save a snapshot\n");
+    exit(EXIT_FAILURE);
+  }
+
+  struct card_job *jobs = calloc(selected_cards_count, sizeof(*jobs));
+  if (!jobs) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < selected_cards_count; i++)
+    jobs[i].card = selected_cards[i];
+
+  int failed = run_job_threads(
+    jobs, selected_cards_count, config_snapshot_thread
+  );
+
+  for (int i = 0; i < selected_cards_count; i++) {
+    struct card_job *job = &jobs[i];
+
+    if (job->result < 0)
+      continue;
+
+    printf(
+      "%s: %d controls, hash %016" PRIx64,
+      job->card->alsa_name,
+      job->config.count,
+      job->config.hash
+    );
+
+    // drift: compare with the first card of the same model
+    for (int j = 0; j < i; j++)
+      if (jobs[j].result >= 0 && jobs[j].card->pid == job->card->pid) {
+        if (jobs[j].config.hash != job->config.hash)
+          printf(" (differs from %s)", jobs[j].card->alsa_name);
+        break;
+      }
+    printf("\n");
+  }
+
+  if (fn && !failed) {
+    if (scarlett2_config_save(fn, &jobs[0].config) < 0)
+      failed++;
+    else
+      printf("Saved snapshot to %s\n", fn);
+  }
+
+  free_card_jobs(jobs, selected_cards_count);
+  free(jobs);
+
+  if (failed)
+    exit(EXIT_FAILURE);
+}
+
+static void config_apply(const char *fn) {
+  if (scarlett2_config_load(fn, &golden_config) < 0)
+    exit(EXIT_FAILURE);
+
+  struct card_job *jobs = calloc(selected_cards_count, sizeof(*jobs));
+  if (!jobs) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  // controls differ between models, so only apply to the same model
+  int count = 0;
+  for (int i = 0; i < selected_cards_count; i++) {
+    struct sound_card *sc = selected_cards[i];
+
+    if (sc->pid != golden_config.pid) {
+      printf(
+        "%s: skipped, snapshot is for a different model (PID %04x)\n",
+        sc->alsa_name,
+        golden_config.pid
+      );
+      continue;
+    }
+    jobs[count++].card = sc;
+  }
+
+  int failed = run_job_threads(jobs, count, config_apply_thread);
+  int total = 0;
+
+  for (int i = 0; i < count; i++) {
+    struct card_job *job = &jobs[i];
+
+    if (job->result < 0)
+      continue;
+
+    if (job->writes)
+      printf(
+        "%s: wrote %d of %d controls\n",
+        job->card->alsa_name,
+        job->writes,
+        golden_config.count
+      );
+    else
+      printf("%s: already matches\n", job->card->alsa_name);
+    total += job->writes;
+  }
+
+  if (count > 1)
+    printf(
+      "Wrote %d control%s to %d devices\n",
+      total,
+      total == 1 ? "" : "s",
+      count - failed
+    );
+
+  free_card_jobs(jobs, count);
+  free(jobs);
+  scarlett2_config_free(&golden_config);
+
+  if (failed || !count)
+    exit(EXIT_FAILURE);
+}
+
+static void config(void) {
+  const char *sub = command_args_count ? command_args[0] : NULL;
+
+  if (sub && !strcmp(sub, "snapshot") && command_args_count <= 2) {
+    enum_cards();
+    select_all_cards();
+    check_card_selection(1);
+    config_snapshot(command_args_count == 2 ? command_args[1] : NULL);
+  } else if (sub && !strcmp(sub, "apply") && command_args_count == 2) {
+    enum_cards();
+    select_all_cards();
+    check_card_selection(1);
+    config_apply(command_args[1]);
+  } else {
+    fprintf(
+      stderr,
+      "config requires 'snapshot [FILE]' or 'apply FILE'\n"
+    );
+    short_help();
+  }
+}
+
+// one pass over the USB devices, reporting how far each Focusrite
+// device gets towards being usable; finds devices that enum_cards()
+// can't see because ALSA doesn't know about them
+static void triage(void) {
+  struct dirent **entries;
+  int count = 0;
+  int failed = 0;
+
+  int entries_count = scandir(SYSFS_USB_DEVICES, &entries, NULL, alphasort);
+  if (entries_count < 0) {
+    fprintf(
+      stderr,
+      "Unable to scan %s: %s\n",
+      SYSFS_USB_DEVICES,
+      strerror(errno)
+    );
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < entries_count; i++) {
+    struct dirent *entry = entries[i];
+    char path[PATH_MAX];
+    char buf[16];
+
+    // skip interfaces
+    if (entry->d_name[0] == '.' || strchr(entry->d_name, ':'))
+      continue;
+
+    snprintf(path, sizeof(path), "%s/%s", SYSFS_USB_DEVICES, entry->d_name);
+    read_sysfs_attr(path, "idVendor", buf, sizeof(buf));
+    if (strtol(buf, NULL, 16) != VENDOR_VID)
+      continue;
+
+    read_sysfs_attr(path, "idProduct", buf, sizeof(buf));
+    int pid = strtol(buf, NULL, 16);
+
+    const char *problem = NULL;
+    if (triage_device(entry->d_name, pid, &problem) < 0) {
+      printf(": %s\n", problem);
+      failed++;
+    } else {
+      printf(": OK\n");
+    }
+    count++;
+  }
+
+  for (int i = 0; i < entries_count; i++)
+    free(entries[i]);
+  free(entries);
+
+  if (!count)
+    printf("No Focusrite USB devices found.\n");
+  else if (failed)
+    printf(
+      "%d of %d Focusrite device%s not usable\n",
+      failed,
+      count,
+      count > 1 ? "s" : ""
+    );
+
+  if (failed)
+    exit(EXIT_FAILURE);
+}
+
+// work out what firmware the policy wants on a card; returns NULL if
+// no change is needed, sets *error if the policy can't be satisfied
+static struct found_firmware *get_policy_firmware(
+  struct sound_card            *sc,
+  struct scarlett2_policy_rule *rule,
+  const char                  **error
+) {
+  struct found_firmware *ff = NULL;
+
+  *error = NULL;
+
+  if (sc->firmware_version < 0) {
+    *error = "unable to read running firmware version";
+    return NULL;
+  }
+
+  switch (rule->target) {
+
+    case SCARLETT2_POLICY_TARGET_PIN:
+      if (sc->firmware_version == rule->version)
+        return NULL;
+      ff = get_firmware_for_version(sc->pid, rule->version);
+      if (!ff)
+        *error = "pinned firmware version not available";
+      return ff;
+
+    case SCARLETT2_POLICY_TARGET_MIN:
+      if (sc->firmware_version >= rule->version)
+        return NULL;
+      ff = get_latest_firmware(sc->pid);
+      if (!ff || ff->firmware->firmware_version < rule->version) {
+        *error = "no firmware available at the minimum version";
+        return NULL;
+      }
+      return ff;
+
+    case SCARLETT2_POLICY_TARGET_LATEST:
+      ff = get_latest_firmware(sc->pid);
+      if (!ff) {
+        *error = "no firmware available";
+        return NULL;
+      }
+      if (sc->firmware_version >= ff->firmware->firmware_version)
+        return NULL;
+      return ff;
+  }
+
+  return NULL;
+}
+
+static void print_policy_rule(struct scarlett2_policy_rule *rule) {
+  printf(
+    "%s %s ",
+    scarlett2_policy_match_name(rule->match),
+    rule->value
+  );
+
+  switch (rule->target) {
+    case SCARLETT2_POLICY_TARGET_LATEST:
+      printf("latest");
+      break;
+    case SCARLETT2_POLICY_TARGET_PIN:
+      printf("%d", rule->version);
+      break;
+    case SCARLETT2_POLICY_TARGET_MIN:
+      printf("min %d", rule->version);
+      break;
+  }
+}
+
+// bring every connected card in line with the policy file
+static void apply_policy(void) {
+  struct scarlett2_policy *policy = scarlett2_read_policy(policy_fn);
+  if (!policy)
+    exit(EXIT_FAILURE);
+
+  if (!found_cards_count) {
+    printf("No supported devices found.\n");
+    scarlett2_free_policy(policy);
+    return;
+  }
+
+  struct card_job *jobs = calloc(found_cards_count, sizeof(*jobs));
+  if (!jobs) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  int job_count = 0;
+  int errors = 0;
+
+  // work out the desired state of every card in one pass
+  printf("Policy %s:\n", policy_fn);
+  for (int i = 0; i < found_cards_count; i++) {
+    struct sound_card *sc = &found_cards[i];
+    struct scarlett2_policy_rule *rule = scarlett2_policy_lookup(
+      policy, sc->serial, sc->usb_path, sc->pid
+    );
+
+    printf(
+      "  %s: %s (serial %s, usb %s, firmware %d): ",
+      sc->card_name,
+      sc->product_name,
+      *sc->serial ? sc->serial : "unknown",
+      *sc->usb_path ? sc->usb_path : "unknown",
+      sc->firmware_version
+    );
+
+    if (!rule) {
+      printf("no policy\n");
+      continue;
+    }
+
+    const char *error;
+    struct found_firmware *ff = get_policy_firmware(sc, rule, &error);
+
+    printf("[");
+    print_policy_rule(rule);
+    printf("] ");
+
+    if (error) {
+      printf("error: %s\n", error);
+      errors++;
+    } else if (!ff) {
+      printf("up to date\n");
+    } else {
+      printf("update to %d\n", ff->firmware->firmware_version);
+      jobs[job_count].card = sc;
+      jobs[job_count].ff = ff;
+      job_count++;
+    }
+  }
+
+  // then run only the needed updates, concurrently
+  keep_config_policy = policy;
+  int failed = run_card_jobs(jobs, job_count);
+  keep_config_policy = NULL;
+
+  scarlett2_free_policy(policy);
+
+  int deferred = 0;
+  for (int i = 0; i < job_count; i++)
+    if (jobs[i].deferred)
+      deferred++;
+
+  free(jobs);
+
+  if (job_count)
+    printf(
+      "Updated %d of %d device%s\n",
+      job_count - deferred - failed,
+      job_count,
+      job_count > 1 ? "s" : ""
+    );
+
+  if (failed || errors)
+    exit(EXIT_FAILURE);
+}
+
+// claim a device for a hotplug update, so that the events from it
+// re-enumerating (or being replugged) don't start another; returns 0
+// if claimed, -1 if an update was started recently or the claim
+// can't be recorded
+static int claim_hotplug(struct sound_card *sc, char *fn, size_t fn_size) {
+  const char *id = *sc->serial ? sc->serial : sc->usb_path;
+  struct stat st;
+
+  if (!*id || strchr(id, '/')) {
+    fprintf(stderr, "Unable to identify card %s for hotplug\n", sc->alsa_name);
+    return -1;
+  }
+
+  snprintf(fn, fn_size, "%s%s", HOTPLUG_DEBOUNCE_PREFIX, id);
+  mkdir("/run/scarlett2", 0755);
+
+  // the claim file is never removed to take it over, so runs racing
+  // for it all get the same file; under its lock, an empty file is
+  // unclaimed and a non-empty one was claimed at its mtime
+  int fd = open(fn, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror(fn);
+    return -1;
+  }
+
+  if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+    perror(fn);
+    close(fd);
+    return -1;
+  }
+
+  long age = time(NULL) - st.st_mtime;
+  if (st.st_size && age < HOTPLUG_DEBOUNCE_SEC) {
+    printf(
+      "%s: update started %ld seconds ago; ignoring\n",
+      sc->card_name,
+      age
+    );
+    close(fd);
+    return -1;
+  }
+
+  // claim it (again, if the old claim expired); writing sets the mtime
+  char pid[16];
+  int len = snprintf(pid, sizeof(pid), "%d\n", getpid());
+
+  if (ftruncate(fd, 0) < 0 || pwrite(fd, pid, len, 0) != len) {
+    perror(fn);
+    close(fd);
+    return -1;
+  }
+
+  close(fd);
+  return 0;
+}
+
+// empty the claim file, so the next hotplug of the card is acted on
+static void release_hotplug(const char *fn) {
+  int fd = open(fn, O_WRONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return;
+
+  if (flock(fd, LOCK_EX) == 0 && ftruncate(fd, 0) < 0)
+    perror(fn);
+  close(fd);
+}
+
+// udev/systemd entry point for a newly-connected card: decide from
+// that card and the firmware catalogue alone whether it needs
+// updating (to the policy file's target if there is one, otherwise
+// the latest), and if so, update it and wait for it to come back
+static void hotplug(void) {
+  double start_us = scarlett2_now_us();
+  int card_num;
+  char extra;
+
+  if (command_args_count != 1) {
+    fprintf(stderr, "hotplug requires the card's sysfs path\n");
+    short_help();
+  }
+
+  const char *path = command_args[0];
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+
+  if (sscanf(base, "card%d%c", &card_num, &extra) != 1 || card_num < 0) {
+    fprintf(stderr, "Not a sound card sysfs path: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  // every sound card is reported; only act on supported ones
+  char card_name[32];
+  snprintf(card_name, sizeof(card_name), "card%d", card_num);
+
+  int pid = check_usb_id(card_name);
+  struct sound_card *sc = pid ? add_card(card_num, pid) : NULL;
+  if (!sc)
+    return;
+
+  sc->firmware_version = get_firmware_version(sc->alsa_name);
+  get_usb_info(sc);
+
+  enum_firmwares_cached();
+
+  struct scarlett2_policy *policy = NULL;
+  struct scarlett2_policy_rule latest = {
+    .target = SCARLETT2_POLICY_TARGET_LATEST
+  };
+  struct scarlett2_policy_rule *rule = &latest;
+
+  if (access(policy_fn, F_OK) == 0) {
+    policy = scarlett2_read_policy(policy_fn);
+    if (!policy)
+      exit(EXIT_FAILURE);
+    rule = scarlett2_policy_lookup(
+      policy, sc->serial, sc->usb_path, sc->pid
+    );
+  }
+
+  const char *error = NULL;
+  struct found_firmware *ff = rule ? get_policy_firmware(sc, rule, &error)
+                                   : NULL;
+
+  printf(
+    "%s: %s (serial %s, firmware %d): ",
+    sc->card_name,
+    sc->product_name,
+    *sc->serial ? sc->serial : "unknown",
+    sc->firmware_version
+  );
+  if (error)
+    printf("error: %s", error);
+  else if (!rule)
+    printf("no policy");
+  else if (!ff)
+    printf("up to date");
+  else
+    printf("update to %d", ff->firmware->firmware_version);
+  printf(" (decided in %.1f ms)\n", (scarlett2_now_us() - start_us) / 1000);
+
+  char claim_fn[PATH_MAX];
+  if (error || !ff || claim_hotplug(sc, claim_fn, sizeof(claim_fn)) < 0) {
+    scarlett2_free_policy(policy);
+    free_found();
+    if (error)
+      exit(EXIT_FAILURE);
+    return;
+  }
+
+  struct card_job job = { .card = sc, .ff = ff };
+
+  keep_config_policy = policy;
+
+  int failed = 1;
+  if (preflight_card_jobs(&job, 1) == 0)
+    failed = run_engine_jobs(&job, 1, 1);
+  free_card_jobs(&job, 1);
+
+  keep_config_policy = NULL;
+  scarlett2_free_policy(policy);
+
+  // on failure, the claim stays until it expires, so a device that
+  // fails to update isn't retried on every re-enumeration
+  if (failed)
+    exit(EXIT_FAILURE);
+
+  release_hotplug(claim_fn);
+  free_found();
+}
+
+// operations which can be submitted to the service
+enum queue_op {
+  QUEUE_OP_LIST,
+  QUEUE_OP_RESET_CONFIG,
+  QUEUE_OP_UPDATE,
+  QUEUE_OP_REBOOT,
+  QUEUE_OP_COUNT
+};
+
+static const char *queue_op_names[QUEUE_OP_COUNT] = {
+  [QUEUE_OP_LIST]         = "list",
+  [QUEUE_OP_RESET_CONFIG] = "reset-config",
+  [QUEUE_OP_UPDATE]       = "update",
+  [QUEUE_OP_REBOOT]       = "reboot"
+};
+
+static int get_queue_op(const char *name) {
+  for (int i = 0; i < QUEUE_OP_COUNT; i++)
+    if (!strcmp(name, queue_op_names[i]))
+      return i;
+
+  return -1;
+}
+
+// a connection to the service; closed when its last job finishes
+struct service_client {
+  int fd;
+  int jobs;
+};
+
+struct service {
+  int                     fd;
+  int                     requests[2];
+  struct scarlett2_engine engine;
+  struct scarlett2_queue  queue;
+};
+
+// a job submitted to the service, as a task for the engine
+struct service_job {
+  struct scarlett2_engine_task    task;
+  struct scarlett2_queue_job      qj;
+  struct service                 *service;
+  struct service_client          *client;
+  int                             op;
+  int                             started;
+
+  // device operations: a copy of the card, as the found cards are
+  // re-enumerated for each submission
+  struct sound_card               card;
+  struct scarlett2_firmware_file *firmware;
+  struct scarlett2_update         update;
+  struct reboot_wait              reboot;
+  int                             rebooting;
+};
+
+static struct service_job *get_service_job(struct scarlett2_queue_job *qj) {
+  return (struct service_job *)((char *)qj - offsetof(struct service_job, qj));
+}
+
+static void client_printf(
+  struct service_client *client,
+  const char            *fmt,
+  ...
+) {
+  va_list ap;
+  char buf[256];
+
+  va_start(ap, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  if (len >= (int)sizeof(buf))
+    len = sizeof(buf) - 1;
+
+  // a client which went away doesn't stop its jobs
+  if (send(client->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+    return;
+}
+
+static void put_client(struct service_client *client) {
+  if (client->jobs)
+    return;
+
+  close(client->fd);
+  free(client);
+}
+
+// start jobs while there are free slots
+static void start_service_jobs(struct service *service) {
+  struct scarlett2_queue_job *qj;
+
+  while ((qj = scarlett2_queue_start_next(&service->queue))) {
+    struct service_job *job = get_service_job(qj);
+
+    if (job->started)
+      client_printf(job->client, "resumed %d\n", qj->id);
+    else
+      client_printf(
+        job->client,
+        "started %d after %.0f ms\n",
+        qj->id,
+        (qj->start_us - qj->submit_us) / 1000
+      );
+    job->started = 1;
+
+    scarlett2_engine_add(&service->engine, &job->task);
+  }
+}
+
+// returns -1 for the engine
+static int end_service_job(struct service_job *job, int result) {
+  struct service *service = job->service;
+  struct service_client *client = job->client;
+
+  scarlett2_queue_finish(&service->queue, &job->qj, result);
+
+  if (job->op != QUEUE_OP_LIST)
+    finish_card(&job->card, result);
+  scarlett2_free_firmware_file(job->firmware);
+
+  client_printf(
+    client,
+    "done %d %s\n",
+    job->qj.id,
+    result < 0 ? "failed" : "ok"
+  );
+  client->jobs--;
+  put_client(client);
+  free(job);
+
+  start_service_jobs(service);
+  return -1;
+}
+
+static void service_list(struct service_job *job) {
+  free_found();
+  enum_cards_and_firmwares();
+
+  for (int i = 0; i < found_cards_count; i++) {
+    struct sound_card *sc = &found_cards[i];
+    struct found_firmware *ff = get_latest_firmware(sc->pid);
+
+    client_printf(
+      job->client,
+      "card %s: %s (firmware %d",
+      sc->card_name,
+      sc->product_name,
+      sc->firmware_version
+    );
+    if (ff && ff->firmware->firmware_version > sc->firmware_version)
+      client_printf(
+        job->client,
+        ", update to %d available",
+        ff->firmware->firmware_version
+      );
+    client_printf(job->client, ")\n");
+  }
+}
+
+static int service_job_step(struct scarlett2_engine_task *task) {
+  struct service_job *job = (struct service_job *)task;
+  struct service *service = job->service;
+  struct sound_card *sc = &job->card;
+  int result;
+
+  if (job->op == QUEUE_OP_LIST) {
+    service_list(job);
+    return end_service_job(job, 0);
+  }
+
+  if (job->rebooting) {
+    result = check_reboot_wait(sc, &job->reboot);
+    if (result > 0)
+      return result;
+    if (!result && job->firmware)
+      result = check_card_version(sc, job->firmware);
+    return end_service_job(job, result);
+  }
+
+  if (!sc->hwdep) {
+    int phases =
+      job->op == QUEUE_OP_UPDATE ? get_update_phases() :
+      job->op == QUEUE_OP_RESET_CONFIG ?
+        SCARLETT2_UPDATE_RESET_CONFIG | SCARLETT2_UPDATE_REBOOT :
+      SCARLETT2_UPDATE_REBOOT;
+
+    if (job->firmware)
+      announce_update(sc, job->firmware);
+    if (open_card(sc) < 0)
+      return end_service_job(job, -1);
+
+    scarlett2_update_init(
+      &job->update, sc->hwdep, &sc->caps, job->firmware, phases,
+      sc->card_num
+    );
+  }
+
+  int last_state = job->update.state;
+  int state = step_card_update(sc, &job->update, job->firmware, NULL);
+
+  if (state == SCARLETT2_UPDATE_STATE_FAILED)
+    return end_service_job(job, -1);
+
+  // the card is rebooting; the slot is free for another job while
+  // it comes back, but later jobs on the card wait for it
+  if (state == SCARLETT2_UPDATE_STATE_DONE) {
+    card_printf(sc, "Waiting for reboot...\n");
+    result = start_reboot_wait(sc, &job->reboot);
+    if (result <= 0) {
+      if (!result && job->firmware)
+        result = check_card_version(sc, job->firmware);
+      return end_service_job(job, result);
+    }
+    job->rebooting = 1;
+    scarlett2_queue_release(&service->queue, &job->qj);
+    start_service_jobs(service);
+    return 0;
+  }
+
+  // an erase has just completed: a safe point to make way for a job
+  // with a higher priority; the card stays open and locked meanwhile
+  if (state != last_state &&
+      (last_state == SCARLETT2_UPDATE_STATE_RESET_CONFIG ||
+       last_state == SCARLETT2_UPDATE_STATE_ERASE_FIRMWARE)) {
+    int next_id = scarlett2_queue_yield(&service->queue, &job->qj);
+
+    if (next_id) {
+      card_printf(sc, "Pausing for job %d\n", next_id);
+      client_printf(job->client, "paused %d for %d\n", job->qj.id, next_id);
+      start_service_jobs(service);
+      return -1;
+    }
+  }
+
+  return wait_for_update_task(task, &job->update);
+}
+
+// add a job for a client; returns 0 if added
+static int add_service_job(
+  struct service        *service,
+  struct service_client *client,
+  int                    op,
+  int                    priority,
+  int                    version,
+  struct sound_card     *sc
+) {
+  struct scarlett2_firmware_file *firmware = NULL;
+  const char *dev = "";
+
+  if (sc) {
+    dev = *sc->serial ? sc->serial : sc->usb_path;
+    if (!*dev) {
+      client_printf(client, "error %s: no USB serial or path\n", sc->card_name);
+      return -1;
+    }
+  }
+
+  if (op == QUEUE_OP_UPDATE) {
+    struct found_firmware *ff = version
+      ? get_firmware_for_version(sc->pid, version)
+      : get_latest_firmware(sc->pid);
+
+    if (!ff) {
+      client_printf(client, "error %s: no firmware found\n", sc->card_name);
+      return -1;
+    }
+
+    if (!version && ff->firmware->firmware_version <= sc->firmware_version) {
+      client_printf(
+        client,
+        "up-to-date %s (firmware %d)\n",
+        sc->card_name,
+        sc->firmware_version
+      );
+      return -1;
+    }
+
+    firmware = load_firmware(sc, ff);
+    if (!firmware ||
+        (keep_config && check_keep_config(sc, firmware) < 0)) {
+      client_printf(
+        client, "error %s: firmware not usable\n", sc->card_name
+      );
+      scarlett2_free_firmware_file(firmware);
+      return -1;
+    }
+  }
+
+  struct service_job *job = calloc(1, sizeof(*job));
+  if (!job) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  job->task.step = service_job_step;
+  job->service = service;
+  job->client = client;
+  job->op = op;
+  job->firmware = firmware;
+  if (sc)
+    job->card = *sc;
+
+  int ahead = scarlett2_queue_add(&service->queue, &job->qj, priority, dev);
+
+  client_printf(
+    client,
+    "queued %d %s%s%s (priority %d, %d ahead)\n",
+    job->qj.id,
+    queue_op_names[op],
+    sc ? " " : "",
+    sc ? sc->card_name : "",
+    priority,
+    ahead
+  );
+  client->jobs++;
+
+  return 0;
+}
+
+static void print_wait_stats(
+  struct service_client  *client,
+  const char             *name,
+  struct scarlett2_stats *stats
+) {
+  client_printf(
+    client,
+    "Wait (%s): %d jobs, p50 %.0f ms, p99 %.0f ms, max %.0f ms\n",
+    name,
+    stats->count,
+    scarlett2_stats_percentile(stats, 50) / 1000,
+    scarlett2_stats_percentile(stats, 99) / 1000,
+    scarlett2_stats_max(stats) / 1000
+  );
+}
+
+static void service_stats(
+  struct service        *service,
+  struct service_client *client
+) {
+  struct scarlett2_queue *queue = &service->queue;
+
+  client_printf(
+    client,
+    "Queue: %d waiting, %d running, %d paused, %d rebooting\n",
+    scarlett2_queue_count(queue, SCARLETT2_QUEUE_WAITING),
+    scarlett2_queue_count(queue, SCARLETT2_QUEUE_RUNNING),
+    scarlett2_queue_count(queue, SCARLETT2_QUEUE_PARKED),
+    scarlett2_queue_count(queue, SCARLETT2_QUEUE_RELEASED)
+  );
+  client_printf(
+    client,
+    "Jobs: %d submitted, %d completed, %d failed, %d paused for "
+      "higher-priority jobs\n",
+    queue->submitted,
+    queue->completed,
+    queue->failed,
+    queue->preempted
+  );
+  print_wait_stats(client, "interactive", &queue->wait_us[0]);
+  print_wait_stats(client, "bulk", &queue->wait_us[1]);
+}
+
+// handle a request from a client: "stats", or "submit PRIORITY OP
+// VERSION [CARD...]" (every card if none)
+static void service_request(
+  struct service        *service,
+  struct service_client *client,
+  char                  *line
+) {
+  char op_name[32];
+  int priority, version, n;
+
+  if (!strcmp(line, "stats")) {
+    service_stats(service, client);
+    return;
+  }
+
+  if (sscanf(line, "submit %d %31s %d%n", &priority, op_name, &version, &n)
+        != 3) {
+    client_printf(client, "error invalid request\n");
+    return;
+  }
+
+  int op = get_queue_op(op_name);
+  if (op < 0) {
+    client_printf(client, "error unknown operation %s\n", op_name);
+    return;
+  }
+
+  if (op == QUEUE_OP_LIST) {
+    add_service_job(service, client, op, priority, 0, NULL);
+    return;
+  }
+
+  free_found();
+  enum_cards_and_firmwares();
+
+  char *p = line + n;
+  int card_num, len, selected = 0;
+
+  while (sscanf(p, "%d%n", &card_num, &len) == 1) {
+    struct sound_card *sc = get_card(card_num);
+
+    if (sc)
+      add_service_job(service, client, op, priority, version, sc);
+    else
+      client_printf(client, "error card %d not found\n", card_num);
+    p += len;
+    selected = 1;
+  }
+
+  if (!selected)
+    for (int i = 0; i < found_cards_count; i++)
+      add_service_job(service, client, op, priority, version, &found_cards[i]);
+
+  if (!selected && !found_cards_count)
+    client_printf(client, "error no supported devices found\n");
+}
+
+// a request from a client, read on its own thread so that a slow
+// client can't hold up the engine's thread, then passed to the
+// engine's thread through service->requests
+struct service_request {
+  struct service        *service;
+  struct service_client *client;
+  char                   line[1024];
+};
+
+static void *service_reader_thread(void *arg) {
+  struct service_request *request = arg;
+  struct timeval timeout = { .tv_sec = 1 };
+  int fd = request->client->fd;
+  int len = 0;
+
+  // a client that doesn't send its request promptly gets an empty
+  // one, which is refused
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  while (len < (int)sizeof(request->line) - 1) {
+    ssize_t n = recv(
+      fd, request->line + len, sizeof(request->line) - 1 - len, 0
+    );
+    if (n <= 0)
+      break;
+    len += n;
+    if (memchr(request->line, '\n', len))
+      break;
+  }
+  request->line[len] = '\0';
+  request->line[strcspn(request->line, "\n")] = '\0';
+
+  // a pointer is written in one piece
+  if (write(request->service->requests[1], &request, sizeof(request))
+        != sizeof(request)) {
+    perror("write");
+    exit(EXIT_FAILURE);
+  }
+
+  return NULL;
+}
+
+// take connections, and start a reader thread for each
+static void *service_accept_thread(void *arg) {
+  struct service *service = arg;
+  pthread_attr_t attr;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (;;) {
+    pthread_t thread;
+
+    int fd = accept(service->fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+
+    struct service_request *request = calloc(1, sizeof(*request));
+    struct service_client *client = calloc(1, sizeof(*client));
+    if (!request || !client) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+    client->fd = fd;
+    request->service = service;
+    request->client = client;
+
+    int err = pthread_create(
+      &thread, &attr, service_reader_thread, request
+    );
+    if (err) {
+      fprintf(stderr, "Unable to start reader thread: %s\n", strerror(err));
+      close(fd);
+      free(client);
+      free(request);
+    }
+  }
+
+  return NULL;
+}
+
+// a request has been read: act on it
+static void service_request_ready(void *arg) {
+  struct service *service = arg;
+  struct service_request *request;
+
+  if (read(service->requests[0], &request, sizeof(request))
+        != sizeof(request))
+    return;
+
+  service_request(service, request->client, request->line);
+  put_client(request->client);
+  free(request);
+
+  start_service_jobs(service);
+}
+
+// resident service: take jobs from clients (the queue command) on a
+// local socket, and run them in priority order, one job per device
+// at a time, in --slots slots (default 1)
+static void serve(void) {
+  struct service service;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", QUEUE_SOCKET);
+
+  if (mkdir(SCARLETT2_STATUS_DIR, 0755) < 0 && errno != EEXIST) {
+    perror(SCARLETT2_STATUS_DIR);
+    exit(EXIT_FAILURE);
+  }
+
+  service.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (service.fd < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+
+  // a socket left behind by a service which is no longer running is
+  // replaced
+  if (connect(service.fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "The service is already running\n");
+    exit(EXIT_FAILURE);
+  }
+  unlink(QUEUE_SOCKET);
+
+  mode_t old_umask = umask(077);
+  int err = bind(service.fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_umask);
+  if (err < 0 || listen(service.fd, 16) < 0) {
+    perror(QUEUE_SOCKET);
+    exit(EXIT_FAILURE);
+  }
+
+  // the policy file is optional here; it only supplies keep-config
+  // rules
+  if (keep_config && access(policy_fn, F_OK) == 0) {
+    keep_config_policy = scarlett2_read_policy(policy_fn);
+    if (!keep_config_policy)
+      exit(EXIT_FAILURE);
+  }
+
+  profiles = scarlett2_read_profiles(profile_fn);
+  multi_card = 1;
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  scarlett2_engine_init(&service.engine);
+  scarlett2_queue_init(&service.queue, window_slots ? window_slots : 1);
+  pthread_t accept_thread;
+
+  if (pipe(service.requests) < 0) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+
+  int thread_err = pthread_create(
+    &accept_thread, NULL, service_accept_thread, &service
+  );
+  if (thread_err) {
+    fprintf(
+      stderr, "Unable to start accept thread: %s\n", strerror(thread_err)
+    );
+    exit(EXIT_FAILURE);
+  }
+
+  scarlett2_engine_watch(
+    &service.engine, service.requests[0], service_request_ready, &service
+  );
+
+  printf("Listening on %s\n", QUEUE_SOCKET);
+  scarlett2_engine_run(&service.engine);
+}
+
+// submit an operation on the selected cards (every card if none) to
+// the service, and show its progress until it's done
+static void queue_command(void) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  char request[1024];
+
+  if (command_args_count != 1) {
+    fprintf(stderr, "queue requires an operation or stats\n");
+    short_help();
+  }
+
+  const char *what = command_args[0];
+  int op = get_queue_op(what);
+
+  if (op < 0 && strcmp(what, "stats")) {
+    fprintf(stderr, "Unknown queue operation: %s\n", what);
+    short_help();
+  }
+
+  if (op < 0) {
+    snprintf(request, sizeof(request), "stats\n");
+  } else {
+    int priority = queue_priority >= 0 ? queue_priority :
+                   op == QUEUE_OP_UPDATE ? 0 : SCARLETT2_QUEUE_INTERACTIVE;
+    int len = snprintf(
+      request, sizeof(request), "submit %d %s %d",
+      priority, what, selected_firmware_version
+    );
+
+    for (int i = 0; i < selected_card_nums_count && len < 1000; i++)
+      len += snprintf(
+        request + len, sizeof(request) - len, " %d", selected_card_nums[i]
+      );
+    snprintf(request + len, sizeof(request) - len, "\n");
+  }
+
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", QUEUE_SOCKET);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(
+      stderr,
+      "Unable to connect to %s (is '%s serve' running?): %s\n",
+      QUEUE_SOCKET,
+      program_name,
+      strerror(errno)
+    );
+    exit(EXIT_FAILURE);
+  }
+
+  if (send(fd, request, strlen(request), MSG_NOSIGNAL) < 0) {
+    perror("send");
+    exit(EXIT_FAILURE);
+  }
+
+  FILE *f = fdopen(fd, "r");
+  char line[256];
+  int failed = 0;
+
+  while (fgets(line, sizeof(line), f)) {
+    fputs(line, stdout);
+    fflush(stdout);
+    if (!strncmp(line, "error ", 6) ||
+        (!strncmp(line, "done ", 5) && strstr(line, " failed")))
+      failed = 1;
+  }
+  fclose(f);
+
+  if (failed)
+    exit(EXIT_FAILURE);
+}
+
+static void start_recording(int argc, char *argv[]) {
+  if (command && !strcmp(command, "replay")) {
+    fprintf(stderr, "Cannot use --record with replay\n");
+    short_help();
+  }
+
+  if (command && !strcmp(command, "soak")) {
+    fprintf(stderr, "Cannot use --record with soak\n");
+    short_help();
+  }
+
+  // control values aren't recorded
+  if (command && !strcmp(command, "config")) {
+    fprintf(stderr, "Cannot use --record with config\n");
+    short_help();
+  }
+
+  // hotplug looks at one card without enumerating, so there'd be no
+  // cards to replay against
+  if (command && !strcmp(command, "hotplug")) {
+    fprintf(stderr, "Cannot use --record with hotplug\n");
+    short_help();
+  }
+
+  // the service's jobs come from other processes
+  if (command && !strcmp(command, "serve")) {
+    fprintf(stderr, "Cannot use --record with serve\n");
+    short_help();
+  }
+
+  if (scarlett2_session_record_start(record_fn, argc, argv) < 0)
+    exit(EXIT_FAILURE);
+  atexit(scarlett2_session_end);
+
+  // enumeration needs to be done for real to be recorded
+  use_cache = 0;
+}
+
+// load the session and pick up its command line; the options given
+// with replay are added to it
+static void start_replay(void) {
+  int session_argc;
+  char **session_argv;
+
+  if (!replay_fn) {
+    fprintf(
+      stderr,
+      "Missing argument for %s (requires a session file name)\n",
+      command
+    );
+    short_help();
+  }
+
+  if (scarlett2_session_replay_start(
+        replay_fn, &session_argc, &session_argv) < 0)
+    exit(EXIT_FAILURE);
+  atexit(scarlett2_session_end);
+  scarlett2_session_set_replay_speed(replay_speed);
+
+  command = NULL;
+  parse_args(session_argc, session_argv);
+  record_fn = NULL;
+  use_cache = 0;
+}
+
+int main(int argc, char *argv[]) {
+  program_name = argv[0];
+
+  parse_args(argc, argv);
+
+  if (show_timeline) {
+    scarlett2_timeline_enable();
+    atexit(scarlett2_timeline_print);
+
+    // replays don't touch the devices, so the kernel has nothing to
+    // say about them
+    if (!command ||
+        (strcmp(command, "replay") && strcmp(command, "soak"))) {
+      scarlett2_kmsg_start();
+      atexit(scarlett2_kmsg_stop);
+    }
+  }
+
+  if (cache_neutral) {
+    scarlett2_io_set_cache_neutral(1);
+    atexit(scarlett2_io_print_footprint);
+  }
+
+  scarlett2_watchdog_set_deadline(op_deadline_ms);
+  if (show_op_stats) {
+    scarlett2_watchdog_enable_stats();
+    atexit(scarlett2_watchdog_print_stats);
+  }
+
+  if (record_fn) {
+    start_recording(argc, argv);
+  } else if (command && !strcmp(command, "replay")) {
+    start_replay();
+  } else if (command && !strcmp(command, "soak")) {
+    start_replay();
+    soak();
+    return 0;
+  }
+
+  if (!command)
+    command = "list";
+
+  if (!strcmp(command, "help")) {
+    usage();
+  } else if (!strcmp(command, "about")) {
+    about();
+  } else if (!strcmp(command, "list")) {
+    enum_cards_and_firmwares_cached();
+    list_cards();
+  } else if (!strcmp(command, "list-all")) {
+    enum_cards_and_firmwares_cached();
+    list_all();
+  } else if (!strcmp(command, "reboot")) {
+    enum_cards();
+    check_card_selection(0);
+    if (finish_card(selected_card, reboot_card(selected_card)) < 0)
+      exit(EXIT_FAILURE);
+  } else if (!strcmp(command, "reset-config")) {
+    enum_cards();
+    check_card_selection(0);
+    int err = reset_config(selected_card);
+    if (!err)
+      err = reboot_card(selected_card);
+    if (finish_card(selected_card, err) < 0)
+      exit(EXIT_FAILURE);
+  } else if (!strcmp(command, "erase-firmware")) {
+    if (keep_config) {
+      fprintf(
+        stderr,
+        "Cannot use --keep-config with erase-firmware (the settings "
+          "layout of the factory firmware isn't known)\n"
+      );
+      exit(EXIT_FAILURE);
+    }
+    enum_cards();
+    check_card_selection(0);
+    int err = reset_config(selected_card);
+    if (!err)
+      err = erase_firmware(selected_card);
+    if (!err)
+      err = reboot_card(selected_card);
+    if (finish_card(selected_card, err) < 0)
+      exit(EXIT_FAILURE);
+  } else if (!strcmp(command, "update")) {
+    start_enum_firmwares();
+    enum_cards();
+    check_card_selection(1);
+    finish_enum_firmwares();
+    profiles = scarlett2_read_profiles(profile_fn);
+
+    struct card_job *jobs = calloc(selected_cards_count, sizeof(*jobs));
+    if (!jobs) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < selected_cards_count; i++) {
+      jobs[i].card = selected_cards[i];
+      jobs[i].ff = check_firmware_selection(selected_cards[i]);
+    }
+
+    // the policy file is optional here; it only supplies keep-config
+    // rules
+    if (keep_config && access(policy_fn, F_OK) == 0) {
+      keep_config_policy = scarlett2_read_policy(policy_fn);
+      if (!keep_config_policy)
+        exit(EXIT_FAILURE);
+    }
+
+    int failed = run_card_jobs(jobs, selected_cards_count);
+    free(jobs);
+    scarlett2_free_policy(keep_config_policy);
+
+    if (failed)
+      exit(EXIT_FAILURE);
+  } else if (!strcmp(command, "hotplug")) {
+    hotplug();
+  } else if (!strcmp(command, "serve")) {
+    serve();
+  } else if (!strcmp(command, "queue")) {
+    queue_command();
+  } else if (!strcmp(command, "triage")) {
+    triage();
+  } else if (!strcmp(command, "delta")) {
+    delta();
+  } else if (!strcmp(command, "config")) {
+    config();
+  } else if (!strcmp(command, "status")) {
+    show_status();
+  } else if (!strcmp(command, "probe")) {
+    enum_cards();
+    select_all_cards();
+    check_card_selection(1);
+    probe_cards();
+  } else if (!strcmp(command, "apply")) {
+    enum_cards_and_firmwares();
+    profiles = scarlett2_read_profiles(profile_fn);
+    apply_policy();
+  } else if (!strcmp(command, "characterize")) {
+    if (!update_cycles)
+      update_cycles = 3;
+    start_enum_firmwares();
+    enum_cards();
+    check_card_selection(0);
+    finish_enum_firmwares();
+    characterize();
   } else {
     fprintf(stderr, "Unknown command: %s\n\n", command);
     short_help();
@@ -0,0 +1,184 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Enumeration result cache
+//
+// The file is a header (magic, key, creation time, data length)
+// followed by the caller's data. A cache hit costs reading
+// /proc/asound/cards, a stat of /dev/snd and each firmware
+// directory, and an mmap.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scarlett2-cache.h"
+
+#define CACHE_MAGIC 0x53324341 // "S2CA"
+#define CACHE_VERSION 1
+
+struct cache_header {
+  uint32_t                   magic;
+  uint32_t                   version;
+  struct scarlett2_cache_key key;
+  int64_t                    created; // CLOCK_BOOTTIME seconds
+  uint64_t                   len;
+};
+
+static int64_t get_mtime(const char *path) {
+  struct stat st;
+
+  if (stat(path, &st) < 0)
+    return -1;
+
+  return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// FNV-1a
+static uint64_t hash_file(const char *fn) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  char buf[4096];
+  ssize_t len;
+
+  int fd = open(fn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  while ((len = read(fd, buf, sizeof(buf))) > 0)
+    for (ssize_t i = 0; i < len; i++) {
+      hash ^= (unsigned char)buf[i];
+      hash *= 0x100000001b3ULL;
+    }
+
+  close(fd);
+  return hash;
+}
+
+static int64_t boottime(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return ts.tv_sec;
+}
+
+void scarlett2_cache_get_key(
+  struct scarlett2_cache_key *key,
+  const char                **dirs,
+  int                         dir_count
+) {
+  memset(key, 0, sizeof(*key));
+
+  key->cards_hash = hash_file("/proc/asound/cards");
+  key->dev_snd_mtime = get_mtime("/dev/snd");
+
+  for (int i = 0; i < SCARLETT2_CACHE_MAX_DIRS; i++)
+    key->dir_mtime[i] = i < dir_count && dirs[i] ? get_mtime(dirs[i]) : -1;
+}
+
+const void *scarlett2_cache_load(
+  const char                 *fn,
+  struct scarlett2_cache_key *key,
+  int                         ttl,
+  size_t                     *len
+) {
+  struct stat st;
+
+  int fd = open(fn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct cache_header)) {
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  struct cache_header *header = map;
+  int64_t age = boottime() - header->created;
+
+  if (header->magic != CACHE_MAGIC ||
+      header->version != CACHE_VERSION ||
+      memcmp(&header->key, key, sizeof(*key)) != 0 ||
+      age < 0 || age >= ttl ||
+      header->len != st.st_size - sizeof(*header)) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  *len = header->len;
+  return header + 1;
+}
+
+void scarlett2_cache_release(const void *data, size_t len) {
+  if (data)
+    munmap(
+      (char *)data - sizeof(struct cache_header),
+      len + sizeof(struct cache_header)
+    );
+}
+
+// silently does nothing if the cache can't be written (e.g. not
+// running as root)
+int scarlett2_cache_save(
+  const char                 *fn,
+  struct scarlett2_cache_key *key,
+  const void                 *data,
+  size_t                      len
+) {
+  char tmp_fn[strlen(fn) + 32];
+  struct cache_header header = {
+    .magic   = CACHE_MAGIC,
+    .version = CACHE_VERSION,
+    .key     = *key,
+    .created = boottime(),
+    .len     = len
+  };
+
+  // the directory is shared with the live status pages
+  char *dir = strdup(fn);
+  if (!dir)
+    return -1;
+  char *last_slash = strrchr(dir, '/');
+  if (last_slash) {
+    *last_slash = '\0';
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+      free(dir);
+      return -1;
+    }
+  }
+  free(dir);
+
+  snprintf(tmp_fn, sizeof(tmp_fn), "%s.%d", fn, getpid());
+
+  FILE *file = fopen(tmp_fn, "w");
+  if (!file)
+    return -1;
+
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      (len && fwrite(data, len, 1, file) != 1)) {
+    fclose(file);
+    remove(tmp_fn);
+    return -1;
+  }
+
+  if (fclose(file) || rename(tmp_fn, fn) < 0) {
+    remove(tmp_fn);
+    return -1;
+  }
+
+  return 0;
+}
+
+void scarlett2_cache_invalidate(const char *fn) {
+  unlink(fn);
+}
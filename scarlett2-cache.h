@@ -0,0 +1,47 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_CACHE_H
+#define SCARLETT2_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCARLETT2_CACHE_FILE "/run/scarlett2/cache"
+
+#define SCARLETT2_CACHE_MAX_DIRS 4
+
+// Everything that, if changed, invalidates the cache
+struct scarlett2_cache_key {
+  uint64_t cards_hash;                          // of /proc/asound/cards
+  int64_t  dev_snd_mtime;                       // ns, or -1
+  int64_t  dir_mtime[SCARLETT2_CACHE_MAX_DIRS]; // ns, or -1
+};
+
+void scarlett2_cache_get_key(
+  struct scarlett2_cache_key *key,
+  const char                **dirs,
+  int                         dir_count
+);
+
+// Map the cached data if the cache exists, matches key, and is
+// younger than ttl seconds; returns NULL otherwise
+const void *scarlett2_cache_load(
+  const char                 *fn,
+  struct scarlett2_cache_key *key,
+  int                         ttl,
+  size_t                     *len
+);
+
+void scarlett2_cache_release(const void *data, size_t len);
+
+int scarlett2_cache_save(
+  const char                 *fn,
+  struct scarlett2_cache_key *key,
+  const void                 *data,
+  size_t                      len
+);
+
+void scarlett2_cache_invalidate(const char *fn);
+
+#endif // SCARLETT2_CACHE_H
@@ -0,0 +1,264 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// hwdep driver capabilities
+//
+// The protocol version reported by the driver is looked up in a
+// table of known versions. A newer minor version of a supported
+// major is assumed compatible but gets the conservative settings
+// until its behaviour has been observed.
+//
+// Observations (the write size the driver accepted, whether erase
+// progress misbehaved) are cached, one line per card per kernel
+// build, as space-separated key=value pairs:
+//
+//   kernel=0123456789abcdef pid=8211 id=Y8XXXXXX protocol=65536
+//     max-write=1016 progress=1
+//
+// The cache lives under /run so it starts afresh on each boot.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "scarlett2.h"
+
+#include "scarlett2-caps.h"
+
+// poll quickly when progress can be trusted to report completion;
+// otherwise give the device longer before deciding it's stuck
+#define FAST_ERASE_POLL_MS 10
+#define FAST_ERASE_STALL_MS 500
+#define SAFE_ERASE_POLL_MS 50
+#define SAFE_ERASE_STALL_MS 2000
+
+static const struct known_version {
+  int    major;
+  int    minor;
+  size_t max_write;
+  int    reliable_progress;
+  int    firmware_only;
+} known_versions[] = {
+
+  // 6.8+: each write carries at most 1016 bytes of data; either
+  // segment can be selected and erased on its own
+  { 1, 0, SCARLETT2_CAPS_SAFE_WRITE, 1, 1 },
+
+  { 0 }
+};
+
+// card threads may learn things at the same time
+static pthread_mutex_t caps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t get_kernel_build(void) {
+  struct utsname u;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  if (uname(&u) < 0)
+    return 0;
+
+  // release alone isn't enough; rebuilds keep the same release
+  const char *s[] = { u.release, u.version };
+  for (int i = 0; i < 2; i++)
+    for (const char *p = s[i]; ; p++) {
+      hash ^= (unsigned char)*p;
+      hash *= 0x100000001b3ULL;
+      if (!*p)
+        break;
+    }
+
+  return hash;
+}
+
+// id is written unquoted, so it must be a single token
+static int is_cacheable(struct scarlett2_caps *caps) {
+  return *caps->id && !strpbrk(caps->id, " \t\r\n=");
+}
+
+// parse one cache line; returns 1 if it's for caps on this kernel
+static int parse_line(
+  char                  *line,
+  uint64_t               kernel,
+  struct scarlett2_caps *caps,
+  size_t                *max_write,
+  int                   *progress
+) {
+  char *saveptr;
+  int matched = 0;
+
+  *max_write = 0;
+  *progress = -1;
+
+  for (char *token = strtok_r(line, " \t\r\n", &saveptr);
+       token;
+       token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+    char *eq = strchr(token, '=');
+    if (!eq)
+      return 0;
+    *eq++ = 0;
+
+    if (!strcmp(token, "kernel")) {
+      if (strtoull(eq, NULL, 16) != kernel)
+        return 0;
+      matched |= 1;
+    } else if (!strcmp(token, "pid")) {
+      if (strtol(eq, NULL, 16) != caps->pid)
+        return 0;
+      matched |= 2;
+    } else if (!strcmp(token, "id")) {
+      if (strcmp(eq, caps->id))
+        return 0;
+      matched |= 4;
+    } else if (!strcmp(token, "protocol")) {
+      if (atoi(eq) != caps->protocol_version)
+        return 0;
+      matched |= 8;
+    } else if (!strcmp(token, "max-write")) {
+      *max_write = strtoul(eq, NULL, 10);
+    } else if (!strcmp(token, "progress")) {
+      *progress = atoi(eq);
+    }
+  }
+
+  return matched == 15;
+}
+
+static void load_cached(struct scarlett2_caps *caps) {
+  if (!is_cacheable(caps))
+    return;
+
+  FILE *f = fopen(SCARLETT2_CAPS_FILE, "r");
+  if (!f)
+    return;
+
+  uint64_t kernel = get_kernel_build();
+  char buf[256];
+
+  while (fgets(buf, sizeof(buf), f)) {
+    size_t max_write;
+    int progress;
+
+    if (!parse_line(buf, kernel, caps, &max_write, &progress))
+      continue;
+
+    if (max_write)
+      caps->max_write = max_write;
+    if (progress == 0)
+      caps->reliable_progress = 0;
+    break;
+  }
+
+  fclose(f);
+}
+
+// rewrite the cache with this card's line replaced; failure is
+// silent, as it only costs speed next time
+static void save_cached(struct scarlett2_caps *caps) {
+  if (!is_cacheable(caps))
+    return;
+
+  pthread_mutex_lock(&caps_lock);
+
+  uint64_t kernel = get_kernel_build();
+  char tmp_fn[64];
+  snprintf(tmp_fn, sizeof(tmp_fn), "%s.%d", SCARLETT2_CAPS_FILE, getpid());
+
+  mkdir("/run/scarlett2", 0755);
+
+  FILE *out = fopen(tmp_fn, "w");
+  if (!out)
+    goto done;
+
+  FILE *in = fopen(SCARLETT2_CAPS_FILE, "r");
+  if (in) {
+    char buf[256], copy[256];
+
+    while (fgets(buf, sizeof(buf), in)) {
+      size_t max_write;
+      int progress;
+
+      strcpy(copy, buf);
+      if (!parse_line(copy, kernel, caps, &max_write, &progress))
+        fputs(buf, out);
+    }
+    fclose(in);
+  }
+
+  fprintf(
+    out,
+    "kernel=%016" PRIx64 " pid=%04x id=%s protocol=%d "
+      "max-write=%zu progress=%d\n",
+    kernel,
+    caps->pid,
+    caps->id,
+    caps->protocol_version,
+    caps->max_write,
+    caps->reliable_progress
+  );
+
+  if (fclose(out) || rename(tmp_fn, SCARLETT2_CAPS_FILE))
+    unlink(tmp_fn);
+
+done:
+  pthread_mutex_unlock(&caps_lock);
+}
+
+void scarlett2_caps_get(
+  struct scarlett2_caps *caps,
+  int                    protocol_version,
+  int                    pid,
+  const char            *id
+) {
+  int major = SCARLETT2_HWDEP_VERSION_MAJOR(protocol_version);
+  int minor = SCARLETT2_HWDEP_VERSION_MINOR(protocol_version);
+
+  memset(caps, 0, sizeof(*caps));
+  caps->protocol_version = protocol_version;
+  caps->pid = pid;
+  snprintf(caps->id, sizeof(caps->id), "%s", id);
+
+  // unknown versions are left to find out the write size by trying,
+  // and not to rely on erase progress
+  for (const struct known_version *v = known_versions; v->major; v++) {
+    if (v->major != major || v->minor != minor)
+      continue;
+
+    caps->known = 1;
+    caps->max_write = v->max_write;
+    caps->reliable_progress = v->reliable_progress;
+    caps->firmware_only = v->firmware_only;
+    break;
+  }
+
+  load_cached(caps);
+
+  caps->erase_poll_ms =
+    caps->reliable_progress ? FAST_ERASE_POLL_MS : SAFE_ERASE_POLL_MS;
+  caps->erase_stall_ms =
+    caps->reliable_progress ? FAST_ERASE_STALL_MS : SAFE_ERASE_STALL_MS;
+}
+
+void scarlett2_caps_set_max_write(struct scarlett2_caps *caps, size_t size) {
+  if (caps->max_write == size)
+    return;
+
+  caps->max_write = size;
+  save_cached(caps);
+}
+
+void scarlett2_caps_set_unreliable_progress(struct scarlett2_caps *caps) {
+  caps->erase_poll_ms = SAFE_ERASE_POLL_MS;
+  caps->erase_stall_ms = SAFE_ERASE_STALL_MS;
+
+  if (!caps->reliable_progress)
+    return;
+
+  caps->reliable_progress = 0;
+  save_cached(caps);
+}
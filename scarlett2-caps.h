@@ -0,0 +1,60 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_CAPS_H
+#define SCARLETT2_CAPS_H
+
+#include <stddef.h>
+
+#define SCARLETT2_CAPS_FILE "/run/scarlett2/caps"
+
+// Largest write() every driver version is known to accept: the
+// driver's 1024-byte flash write request, less its offset and pad
+#define SCARLETT2_CAPS_SAFE_WRITE 1016
+
+// What the kernel driver behind a hwdep device can do, from the
+// table of known protocol versions, refined by what was observed the
+// last time this card was used on this kernel build
+struct scarlett2_caps {
+  int    protocol_version;
+
+  // protocol version is in the table (not just a compatible major)
+  int    known;
+
+  // bytes accepted per write(); 0 if not yet known
+  size_t max_write;
+
+  // erase progress counts up monotonically to 255
+  int    reliable_progress;
+
+  // the firmware segment can be erased and written without first
+  // erasing the settings segment
+  int    firmware_only;
+
+  // erase progress polling interval, and how long without progress
+  // before giving up
+  int    erase_poll_ms;
+  int    erase_stall_ms;
+
+  // cache identity
+  char   id[64];
+  int    pid;
+};
+
+// Fill in caps for protocol_version on the card with this USB PID
+// and id (serial number, or USB path if it has none)
+void scarlett2_caps_get(
+  struct scarlett2_caps *caps,
+  int                    protocol_version,
+  int                    pid,
+  const char            *id
+);
+
+// Record a learned write size
+void scarlett2_caps_set_max_write(struct scarlett2_caps *caps, size_t size);
+
+// Record that erase progress misbehaved; later erases on this card
+// and kernel poll conservatively
+void scarlett2_caps_set_unreliable_progress(struct scarlett2_caps *caps);
+
+#endif // SCARLETT2_CAPS_H
@@ -0,0 +1,503 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Device configuration snapshots
+//
+// A configuration is the value of every control which can be both
+// read and written and isn't volatile, so meters, sync status, and
+// the firmware version are left out. Its hash covers each control's
+// identity and values in the order the driver lists them, so two
+// cards of the same model have the same hash exactly when they are
+// configured the same.
+//
+// Snapshot files have a header line then one line per control; the
+// name goes last as it may contain spaces:
+//
+//   # scarlett2 config 1
+//   pid=8211 controls=57 hash=0123456789abcdef
+//   control iface=MIXER device=0 subdevice=0 index=0 type=BOOLEAN
+//     values=0,1 name=Line In 1 Air Capture Switch
+//
+// Snapshots may be edited by hand; only pid= is read from the second
+// line.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "scarlett2-config.h"
+
+#define CONFIG_HEADER "# scarlett2 config 1"
+
+static uint64_t hash_bytes(uint64_t hash, const void *p, size_t len) {
+  const unsigned char *s = p;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= s[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static uint64_t config_hash(const struct scarlett2_config *config) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (int i = 0; i < config->count; i++) {
+    const struct scarlett2_control *c = &config->controls[i];
+    int64_t fields[] = {
+      c->iface, c->device, c->subdevice, c->index, c->type, c->count
+    };
+
+    hash = hash_bytes(hash, c->name, strlen(c->name) + 1);
+    hash = hash_bytes(hash, fields, sizeof(fields));
+    for (unsigned j = 0; j < c->count; j++) {
+      int64_t v = c->values[j];
+      hash = hash_bytes(hash, &v, sizeof(v));
+    }
+  }
+
+  return hash;
+}
+
+static struct scarlett2_control *add_control(struct scarlett2_config *config) {
+  struct scarlett2_control *controls = realloc(
+    config->controls, sizeof(*controls) * (config->count + 1)
+  );
+  if (!controls) {
+    perror("realloc");
+    return NULL;
+  }
+
+  config->controls = controls;
+  struct scarlett2_control *c = &controls[config->count++];
+  memset(c, 0, sizeof(*c));
+  return c;
+}
+
+static int is_config_type(int type) {
+  return type == SND_CTL_ELEM_TYPE_BOOLEAN ||
+         type == SND_CTL_ELEM_TYPE_INTEGER ||
+         type == SND_CTL_ELEM_TYPE_ENUMERATED ||
+         type == SND_CTL_ELEM_TYPE_BYTES ||
+         type == SND_CTL_ELEM_TYPE_INTEGER64;
+}
+
+static long long get_value(
+  const snd_ctl_elem_value_t *value,
+  int                         type,
+  unsigned                    i
+) {
+  switch (type) {
+    case SND_CTL_ELEM_TYPE_BOOLEAN:
+      return snd_ctl_elem_value_get_boolean(value, i);
+    case SND_CTL_ELEM_TYPE_INTEGER:
+      return snd_ctl_elem_value_get_integer(value, i);
+    case SND_CTL_ELEM_TYPE_ENUMERATED:
+      return snd_ctl_elem_value_get_enumerated(value, i);
+    case SND_CTL_ELEM_TYPE_BYTES:
+      return snd_ctl_elem_value_get_byte(value, i);
+    case SND_CTL_ELEM_TYPE_INTEGER64:
+      return snd_ctl_elem_value_get_integer64(value, i);
+  }
+
+  return 0;
+}
+
+static void set_value(
+  snd_ctl_elem_value_t *value,
+  int                   type,
+  unsigned              i,
+  long long             v
+) {
+  switch (type) {
+    case SND_CTL_ELEM_TYPE_BOOLEAN:
+      snd_ctl_elem_value_set_boolean(value, i, v);
+      break;
+    case SND_CTL_ELEM_TYPE_INTEGER:
+      snd_ctl_elem_value_set_integer(value, i, v);
+      break;
+    case SND_CTL_ELEM_TYPE_ENUMERATED:
+      snd_ctl_elem_value_set_enumerated(value, i, v);
+      break;
+    case SND_CTL_ELEM_TYPE_BYTES:
+      snd_ctl_elem_value_set_byte(value, i, v);
+      break;
+    case SND_CTL_ELEM_TYPE_INTEGER64:
+      snd_ctl_elem_value_set_integer64(value, i, v);
+      break;
+  }
+}
+
+// read one control into config if it's part of the configuration
+static int read_control(
+  snd_ctl_t               *ctl,
+  snd_ctl_elem_id_t       *id,
+  struct scarlett2_config *config
+) {
+  snd_ctl_elem_info_t *info;
+  snd_ctl_elem_value_t *value;
+  int err;
+
+  snd_ctl_elem_info_alloca(&info);
+  snd_ctl_elem_value_alloca(&value);
+
+  snd_ctl_elem_info_set_id(info, id);
+  if ((err = snd_ctl_elem_info(ctl, info)) < 0)
+    return err;
+
+  int type = snd_ctl_elem_info_get_type(info);
+
+  if (!snd_ctl_elem_info_is_readable(info) ||
+      !snd_ctl_elem_info_is_writable(info) ||
+      snd_ctl_elem_info_is_volatile(info) ||
+      !is_config_type(type))
+    return 0;
+
+  snd_ctl_elem_value_set_id(value, id);
+  if ((err = snd_ctl_elem_read(ctl, value)) < 0)
+    return err;
+
+  struct scarlett2_control *c = add_control(config);
+  if (!c)
+    return -ENOMEM;
+
+  snprintf(c->name, sizeof(c->name), "%s", snd_ctl_elem_id_get_name(id));
+  c->iface = snd_ctl_elem_id_get_interface(id);
+  c->device = snd_ctl_elem_id_get_device(id);
+  c->subdevice = snd_ctl_elem_id_get_subdevice(id);
+  c->index = snd_ctl_elem_id_get_index(id);
+  c->type = type;
+  c->count = snd_ctl_elem_info_get_count(info);
+  c->values = calloc(c->count ? c->count : 1, sizeof(*c->values));
+  if (!c->values) {
+    perror("calloc");
+    config->count--;
+    return -ENOMEM;
+  }
+
+  for (unsigned i = 0; i < c->count; i++)
+    c->values[i] = get_value(value, type, i);
+
+  return 0;
+}
+
+int scarlett2_config_read(snd_ctl_t *ctl, struct scarlett2_config *config) {
+  snd_ctl_elem_list_t *list;
+  snd_ctl_elem_id_t *id;
+  int err;
+
+  snd_ctl_elem_list_alloca(&list);
+  snd_ctl_elem_id_alloca(&id);
+
+  memset(config, 0, sizeof(*config));
+
+  // the first call gets the count, the second the IDs
+  if ((err = snd_ctl_elem_list(ctl, list)) < 0)
+    return err;
+
+  unsigned count = snd_ctl_elem_list_get_count(list);
+  if ((err = snd_ctl_elem_list_alloc_space(list, count)) < 0)
+    return err;
+
+  if ((err = snd_ctl_elem_list(ctl, list)) < 0)
+    goto done;
+
+  count = snd_ctl_elem_list_get_used(list);
+  for (unsigned i = 0; i < count; i++) {
+    snd_ctl_elem_list_get_id(list, i, id);
+    if ((err = read_control(ctl, id, config)) < 0)
+      goto done;
+  }
+
+  config->hash = config_hash(config);
+
+done:
+  snd_ctl_elem_list_free_space(list);
+  if (err < 0)
+    scarlett2_config_free(config);
+  return err < 0 ? err : 0;
+}
+
+void scarlett2_config_free(struct scarlett2_config *config) {
+  for (int i = 0; i < config->count; i++)
+    free(config->controls[i].values);
+  free(config->controls);
+  config->controls = NULL;
+  config->count = 0;
+}
+
+int scarlett2_config_save(
+  const char                    *fn,
+  const struct scarlett2_config *config
+) {
+  char tmp_fn[PATH_MAX];
+
+  snprintf(tmp_fn, sizeof(tmp_fn), "%s.%d", fn, getpid());
+
+  FILE *f = fopen(tmp_fn, "w");
+  if (!f) {
+    fprintf(stderr, "Unable to create %s: %s\n", tmp_fn, strerror(errno));
+    return -1;
+  }
+
+  fprintf(f, "%s\n", CONFIG_HEADER);
+  fprintf(
+    f,
+    "pid=%04x controls=%d hash=%016" PRIx64 "\n",
+    config->pid,
+    config->count,
+    config->hash
+  );
+
+  for (int i = 0; i < config->count; i++) {
+    const struct scarlett2_control *c = &config->controls[i];
+
+    fprintf(
+      f,
+      "control iface=%s device=%u subdevice=%u index=%u type=%s values=",
+      snd_ctl_elem_iface_name(c->iface),
+      c->device,
+      c->subdevice,
+      c->index,
+      snd_ctl_elem_type_name(c->type)
+    );
+    for (unsigned j = 0; j < c->count; j++)
+      fprintf(f, "%s%lld", j ? "," : "", c->values[j]);
+    fprintf(f, " name=%s\n", c->name);
+  }
+
+  if (fclose(f) || rename(tmp_fn, fn)) {
+    fprintf(stderr, "Unable to write %s: %s\n", fn, strerror(errno));
+    unlink(tmp_fn);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int parse_iface(const char *s) {
+  for (int i = 0; i <= SND_CTL_ELEM_IFACE_LAST; i++)
+    if (!strcmp(s, snd_ctl_elem_iface_name(i)))
+      return i;
+
+  return -1;
+}
+
+static int parse_type(const char *s) {
+  for (int i = 0; i <= SND_CTL_ELEM_TYPE_LAST; i++)
+    if (is_config_type(i) && !strcmp(s, snd_ctl_elem_type_name(i)))
+      return i;
+
+  return -1;
+}
+
+static int parse_values(struct scarlett2_control *c, char *s) {
+  c->count = 1;
+  for (char *p = s; *p; p++)
+    if (*p == ',')
+      c->count++;
+
+  c->values = calloc(c->count, sizeof(*c->values));
+  if (!c->values) {
+    perror("calloc");
+    return -1;
+  }
+
+  for (unsigned i = 0; i < c->count; i++) {
+    char *end;
+
+    c->values[i] = strtoll(s, &end, 10);
+    if (end == s || (*end && *end != ','))
+      return -1;
+    s = end + 1;
+  }
+
+  return 0;
+}
+
+// parse a control line (after "control ")
+static int parse_control(char *line, struct scarlett2_control *c) {
+  char *name = strstr(line, " name=");
+  char *saveptr;
+  int seen = 0;
+
+  if (!name)
+    return -1;
+  *name = 0;
+  name += 6;
+  name[strcspn(name, "\r\n")] = 0;
+  snprintf(c->name, sizeof(c->name), "%s", name);
+
+  for (char *token = strtok_r(line, " ", &saveptr);
+       token;
+       token = strtok_r(NULL, " ", &saveptr)) {
+    char *eq = strchr(token, '=');
+    if (!eq)
+      return -1;
+    *eq++ = 0;
+
+    if (!strcmp(token, "iface")) {
+      c->iface = parse_iface(eq);
+      if (c->iface < 0)
+        return -1;
+      seen |= 1;
+    } else if (!strcmp(token, "device")) {
+      c->device = strtoul(eq, NULL, 10);
+    } else if (!strcmp(token, "subdevice")) {
+      c->subdevice = strtoul(eq, NULL, 10);
+    } else if (!strcmp(token, "index")) {
+      c->index = strtoul(eq, NULL, 10);
+    } else if (!strcmp(token, "type")) {
+      c->type = parse_type(eq);
+      if (c->type < 0)
+        return -1;
+      seen |= 2;
+    } else if (!strcmp(token, "values")) {
+      if (c->values || parse_values(c, eq) < 0)
+        return -1;
+      seen |= 4;
+    }
+  }
+
+  return seen == 7 ? 0 : -1;
+}
+
+int scarlett2_config_load(const char *fn, struct scarlett2_config *config) {
+  char buf[4096];
+  int line_num = 0;
+
+  memset(config, 0, sizeof(*config));
+
+  FILE *f = fopen(fn, "r");
+  if (!f) {
+    fprintf(stderr, "Unable to open %s: %s\n", fn, strerror(errno));
+    return -1;
+  }
+
+  while (fgets(buf, sizeof(buf), f)) {
+    line_num++;
+
+    if (line_num == 1) {
+      if (strncmp(buf, CONFIG_HEADER, strlen(CONFIG_HEADER)))
+        goto invalid;
+      continue;
+    }
+
+    if (!strncmp(buf, "control ", 8)) {
+      struct scarlett2_control *c = add_control(config);
+      if (!c || parse_control(buf + 8, c) < 0)
+        goto invalid;
+      continue;
+    }
+
+    if (sscanf(buf, "pid=%x", &config->pid) != 1)
+      goto invalid;
+  }
+
+  fclose(f);
+
+  if (!config->pid) {
+    fprintf(stderr, "Snapshot %s has no pid line\n", fn);
+    scarlett2_config_free(config);
+    return -1;
+  }
+
+  // the snapshot may have been edited, so the hash isn't checked
+  config->hash = config_hash(config);
+
+  return 0;
+
+invalid:
+  fprintf(stderr, "Invalid snapshot %s at line %d\n", fn, line_num);
+  fclose(f);
+  scarlett2_config_free(config);
+  return -1;
+}
+
+static const struct scarlett2_control *find_control(
+  const struct scarlett2_config  *config,
+  const struct scarlett2_control *c
+) {
+  for (int i = 0; i < config->count; i++) {
+    const struct scarlett2_control *o = &config->controls[i];
+
+    if (o->iface == c->iface &&
+        o->device == c->device &&
+        o->subdevice == c->subdevice &&
+        o->index == c->index &&
+        !strcmp(o->name, c->name))
+      return o;
+  }
+
+  return NULL;
+}
+
+static int write_control(snd_ctl_t *ctl, const struct scarlett2_control *c) {
+  snd_ctl_elem_id_t *id;
+  snd_ctl_elem_value_t *value;
+
+  snd_ctl_elem_id_alloca(&id);
+  snd_ctl_elem_value_alloca(&value);
+
+  snd_ctl_elem_id_set_interface(id, c->iface);
+  snd_ctl_elem_id_set_device(id, c->device);
+  snd_ctl_elem_id_set_subdevice(id, c->subdevice);
+  snd_ctl_elem_id_set_index(id, c->index);
+  snd_ctl_elem_id_set_name(id, c->name);
+  snd_ctl_elem_value_set_id(value, id);
+
+  for (unsigned i = 0; i < c->count; i++)
+    set_value(value, c->type, i, c->values[i]);
+
+  return snd_ctl_elem_write(ctl, value);
+}
+
+int scarlett2_config_apply(
+  snd_ctl_t                     *ctl,
+  const struct scarlett2_config *current,
+  const struct scarlett2_config *golden
+) {
+  int written = 0;
+
+  if (current->hash == golden->hash)
+    return 0;
+
+  for (int i = 0; i < golden->count; i++) {
+    const struct scarlett2_control *want = &golden->controls[i];
+    const struct scarlett2_control *have = find_control(current, want);
+
+    if (!have || have->type != want->type || have->count != want->count) {
+      fprintf(
+        stderr,
+        "Control '%s' index %u not found on the device; skipping\n",
+        want->name,
+        want->index
+      );
+      continue;
+    }
+
+    if (!memcmp(have->values, want->values,
+                sizeof(*want->values) * want->count))
+      continue;
+
+    int err = write_control(ctl, want);
+    if (err < 0) {
+      fprintf(
+        stderr,
+        "Unable to write control '%s': %s\n",
+        want->name,
+        snd_strerror(err)
+      );
+      return err;
+    }
+
+    written++;
+  }
+
+  return written;
+}
@@ -0,0 +1,51 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_CONFIG_H
+#define SCARLETT2_CONFIG_H
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+// One ALSA control's identity and values
+struct scarlett2_control {
+  char       name[64];
+  int        iface;
+  unsigned   device;
+  unsigned   subdevice;
+  unsigned   index;
+  int        type;
+  unsigned   count;
+  long long *values;
+};
+
+// The settable controls of a card: its configuration (routing,
+// levels, switches), without meters and other read-only controls
+struct scarlett2_config {
+  int                       pid;
+  int                       count;
+  struct scarlett2_control *controls;
+  uint64_t                  hash;
+};
+
+// Read the configuration of a card
+int scarlett2_config_read(snd_ctl_t *ctl, struct scarlett2_config *config);
+
+void scarlett2_config_free(struct scarlett2_config *config);
+
+int scarlett2_config_save(
+  const char                    *fn,
+  const struct scarlett2_config *config
+);
+
+int scarlett2_config_load(const char *fn, struct scarlett2_config *config);
+
+// Write the controls where current (as read from the card) differs
+// from golden; returns the number written or a negative error code
+int scarlett2_config_apply(
+  snd_ctl_t                     *ctl,
+  const struct scarlett2_config *current,
+  const struct scarlett2_config *golden
+);
+
+#endif // SCARLETT2_CONFIG_H
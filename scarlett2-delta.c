@@ -0,0 +1,1046 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Firmware deltas
+//
+// Successive firmware versions for a device are mostly the same, so
+// a repository holding every version can store one full image per
+// PID and the rest as diffs against it.
+//
+// After the header, a delta is a sequence of operations which
+// together produce exactly firmware_length bytes:
+//
+//   'C' offset length   copy length bytes from offset in the base
+//   'A' length data     add length literal bytes
+//
+// with offset and length as big-endian uint32s. Copies are found
+// rsync-style: the base is indexed by a rolling checksum of each
+// BLOCK_SIZE-aligned block, and the target is scanned a byte at a
+// time for a matching block which is then extended in both
+// directions.
+//
+// Reconstruction writes straight into the image buffer, hashing as it
+// goes, so a delta is checked against the target's SHA-256 the same
+// way as a full image without an intermediate file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "scarlett2-delta.h"
+#include "scarlett2-io.h"
+#include "scarlett2-trace.h"
+
+#define BLOCK_SIZE 32
+#define HASH_BITS 16
+#define MAX_CHAIN 64
+
+// a firmware image or delta found in a directory
+struct entry {
+  char                             *fn;
+  int                               is_delta;
+  uint32_t                          base_version;
+  struct scarlett2_firmware_header *header;
+};
+
+static uint32_t get_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static int has_suffix(const char *s, const char *suffix) {
+  size_t len = strlen(s), suffix_len = strlen(suffix);
+
+  return len > suffix_len && !strcmp(s + len - suffix_len, suffix);
+}
+
+static char *join_path(const char *dir, const char *name, const char *suffix) {
+  size_t len = strlen(dir) + strlen(name) + strlen(suffix) + 2;
+  char *path = malloc(len);
+
+  if (!path) {
+    perror("malloc");
+    return NULL;
+  }
+
+  snprintf(path, len, "%s/%s%s", dir, name, suffix);
+  return path;
+}
+
+// file name without the directory or .bin/.delta suffix
+static char *get_stem(const char *fn) {
+  const char *slash = strrchr(fn, '/');
+  char *stem = strdup(slash ? slash + 1 : fn);
+
+  if (!stem) {
+    perror("strdup");
+    return NULL;
+  }
+
+  if (has_suffix(stem, ".bin"))
+    stem[strlen(stem) - 4] = 0;
+  else if (has_suffix(stem, DELTA_SUFFIX))
+    stem[strlen(stem) - strlen(DELTA_SUFFIX)] = 0;
+
+  return stem;
+}
+
+static struct scarlett2_delta_header *read_delta_header(
+  FILE       *file,
+  const char *fn
+) {
+  struct scarlett2_delta_header *delta = malloc(sizeof(*delta));
+  if (!delta) {
+    perror("malloc");
+    return NULL;
+  }
+
+  if (fread(delta, sizeof(*delta), 1, file) != 1) {
+    if (feof(file))
+      fprintf(stderr, "Unexpected end of file\n");
+    else
+      perror("Failed to read header");
+    goto error;
+  }
+
+  if (strncmp(delta->magic, DELTA_MAGIC_STRING, 8) != 0 ||
+      strncmp(delta->target.magic, MAGIC_STRING, 8) != 0) {
+    fprintf(stderr, "Invalid magic number\n");
+    goto error;
+  }
+
+  delta->base_version = ntohl(delta->base_version);
+  delta->target.usb_vid = ntohs(delta->target.usb_vid);
+  delta->target.usb_pid = ntohs(delta->target.usb_pid);
+  delta->target.firmware_version = ntohl(delta->target.firmware_version);
+  delta->target.firmware_length = ntohl(delta->target.firmware_length);
+
+  TRACE4(
+    header_parse,
+    fn,
+    delta->target.usb_pid,
+    delta->target.firmware_version,
+    delta->target.firmware_length
+  );
+
+  return delta;
+
+error:
+  fprintf(stderr, "Error reading delta header from %s\n", fn);
+  free(delta);
+  return NULL;
+}
+
+int scarlett2_is_delta(const char *fn) {
+  char magic[8];
+
+  FILE *file = scarlett2_io_fopen(fn);
+  if (!file)
+    return 0;
+
+  int is_delta = fread(magic, sizeof(magic), 1, file) == 1 &&
+                 !strncmp(magic, DELTA_MAGIC_STRING, 8);
+
+  fclose(file);
+  return is_delta;
+}
+
+struct scarlett2_firmware_header *scarlett2_read_delta_header(
+  const char *fn
+) {
+  FILE *file = scarlett2_io_fopen(fn);
+  if (!file) {
+    perror("fopen");
+    fprintf(stderr, "Unable to open %s\n", fn);
+    return NULL;
+  }
+
+  struct scarlett2_delta_header *delta = read_delta_header(file, fn);
+  fclose(file);
+
+  if (!delta)
+    return NULL;
+
+  struct scarlett2_firmware_header *header = malloc(sizeof(*header));
+  if (header)
+    *header = delta->target;
+  else
+    perror("malloc");
+
+  free(delta);
+  return header;
+}
+
+// the full image in dir that a delta was made against
+static struct scarlett2_firmware_file *load_base(
+  const char                          *dir,
+  const struct scarlett2_delta_header *delta
+) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    fprintf(stderr, "Unable to opendir %s: %s\n", dir, strerror(errno));
+    return NULL;
+  }
+
+  struct dirent *entry;
+  struct scarlett2_firmware_file *base = NULL;
+
+  while (!base && (entry = readdir(d))) {
+    if (!has_suffix(entry->d_name, ".bin"))
+      continue;
+
+    char *fn = join_path(dir, entry->d_name, "");
+    if (!fn)
+      break;
+
+    struct scarlett2_firmware_header *header = NULL;
+    if (!scarlett2_is_delta(fn))
+      header = scarlett2_read_firmware_header(fn);
+
+    if (header &&
+        header->usb_vid == delta->target.usb_vid &&
+        header->usb_pid == delta->target.usb_pid &&
+        header->firmware_version == delta->base_version &&
+        !memcmp(header->sha256, delta->base_sha256, SHA256_DIGEST_LENGTH))
+      base = scarlett2_read_firmware_file(fn);
+
+    scarlett2_free_firmware_header(header);
+    free(fn);
+  }
+
+  closedir(d);
+
+  if (!base)
+    fprintf(
+      stderr,
+      "Base firmware version %u for PID %04x not found in %s\n",
+      delta->base_version,
+      delta->target.usb_pid,
+      dir
+    );
+
+  return base;
+}
+
+// apply the operations in file to base, filling in firmware
+static int reconstruct(
+  FILE                                 *file,
+  const struct scarlett2_firmware_file *base,
+  struct scarlett2_firmware_file       *firmware
+) {
+  uint8_t *data = firmware->firmware_data;
+  uint32_t length = firmware->header.firmware_length;
+  uint32_t base_length = base->header.firmware_length;
+  uint32_t pos = 0;
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  int ok = 0;
+
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+    fprintf(stderr, "Unable to initialise SHA-256\n");
+    goto done;
+  }
+
+  TRACE1(sha256_start, length);
+
+  while (pos < length) {
+    uint8_t op[9];
+
+    if (fread(op, 1, 5, file) != 5)
+      goto corrupt;
+
+    uint32_t len;
+
+    if (op[0] == 'C') {
+      if (fread(op + 5, 1, 4, file) != 4)
+        goto corrupt;
+      uint32_t offset = get_be32(op + 1);
+      len = get_be32(op + 5);
+      if (len > length - pos ||
+          offset > base_length ||
+          len > base_length - offset)
+        goto corrupt;
+      memcpy(data + pos, base->firmware_data + offset, len);
+    } else if (op[0] == 'A') {
+      len = get_be32(op + 1);
+      if (len > length - pos ||
+          fread(data + pos, 1, len, file) != len)
+        goto corrupt;
+    } else {
+      goto corrupt;
+    }
+
+    EVP_DigestUpdate(ctx, data + pos, len);
+    pos += len;
+  }
+
+  if (fgetc(file) != EOF)
+    goto corrupt;
+
+  EVP_DigestFinal_ex(ctx, hash, NULL);
+  ok = !memcmp(hash, firmware->header.sha256, SHA256_DIGEST_LENGTH);
+  TRACE2(sha256_end, length, ok);
+
+  if (!ok)
+    fprintf(stderr, "Reconstructed firmware failed checksum\n");
+  goto done;
+
+corrupt:
+  fprintf(stderr, "Corrupt delta at firmware offset %u\n", pos);
+
+done:
+  EVP_MD_CTX_free(ctx);
+  return ok ? 0 : -1;
+}
+
+struct scarlett2_firmware_file *scarlett2_read_delta_file(const char *fn) {
+  struct scarlett2_firmware_file *firmware = NULL;
+  struct scarlett2_firmware_file *base = NULL;
+  struct scarlett2_delta_header *delta = NULL;
+  char *dir = NULL;
+
+  FILE *file = scarlett2_io_fopen(fn);
+  if (!file) {
+    perror("fopen");
+    fprintf(stderr, "Unable to open %s\n", fn);
+    return NULL;
+  }
+
+  delta = read_delta_header(file, fn);
+  if (!delta)
+    goto error;
+
+  dir = strdup(fn);
+  if (!dir) {
+    perror("strdup");
+    goto error;
+  }
+  char *slash = strrchr(dir, '/');
+  if (slash)
+    *slash = 0;
+  else
+    strcpy(dir, ".");
+
+  base = load_base(dir, delta);
+  if (!base)
+    goto error;
+
+  firmware = calloc(1, sizeof(*firmware));
+  if (!firmware) {
+    perror("calloc");
+    goto error;
+  }
+
+  firmware->header = delta->target;
+  firmware->firmware_data = malloc(firmware->header.firmware_length);
+  if (!firmware->firmware_data) {
+    perror("Failed to allocate memory for firmware data");
+    goto error;
+  }
+
+  if (reconstruct(file, base, firmware) < 0) {
+    fprintf(stderr, "Error reconstructing firmware from %s\n", fn);
+    goto error;
+  }
+
+  goto done;
+
+error:
+  scarlett2_free_firmware_file(firmware);
+  firmware = NULL;
+
+done:
+  scarlett2_free_firmware_file(base);
+  free(delta);
+  free(dir);
+  fclose(file);
+  return firmware;
+}
+
+// write via a temporary file so a failure never leaves a partial
+// image or delta behind
+static FILE *create_file(const char *fn, char **tmp_fn) {
+  *tmp_fn = malloc(strlen(fn) + 5);
+  if (!*tmp_fn) {
+    perror("malloc");
+    return NULL;
+  }
+  sprintf(*tmp_fn, "%s.tmp", fn);
+
+  FILE *file = fopen(*tmp_fn, "wb");
+  if (!file) {
+    fprintf(stderr, "Unable to create %s: %s\n", *tmp_fn, strerror(errno));
+    free(*tmp_fn);
+    *tmp_fn = NULL;
+  }
+
+  return file;
+}
+
+static int finish_file(FILE *file, char *tmp_fn, const char *fn, int err) {
+  if (fclose(file) && !err) {
+    fprintf(stderr, "Error writing %s: %s\n", tmp_fn, strerror(errno));
+    err = -1;
+  }
+
+  if (!err && rename(tmp_fn, fn) < 0) {
+    fprintf(stderr, "Unable to rename %s: %s\n", tmp_fn, strerror(errno));
+    err = -1;
+  }
+
+  if (err)
+    unlink(tmp_fn);
+  else
+    scarlett2_io_drop_written(fn);
+
+  free(tmp_fn);
+  return err;
+}
+
+static void header_to_be(
+  struct scarlett2_firmware_header       *out,
+  const struct scarlett2_firmware_header *in
+) {
+  *out = *in;
+  out->usb_vid = htons(in->usb_vid);
+  out->usb_pid = htons(in->usb_pid);
+  out->firmware_version = htonl(in->firmware_version);
+  out->firmware_length = htonl(in->firmware_length);
+}
+
+static int write_image(
+  const char                           *fn,
+  const struct scarlett2_firmware_file *firmware
+) {
+  struct scarlett2_firmware_header header;
+  char *tmp_fn;
+
+  FILE *file = create_file(fn, &tmp_fn);
+  if (!file)
+    return -1;
+
+  header_to_be(&header, &firmware->header);
+
+  int err = fwrite(&header, sizeof(header), 1, file) != 1 ||
+            fwrite(firmware->firmware_data,
+                   firmware->header.firmware_length, 1, file) != 1;
+
+  return finish_file(file, tmp_fn, fn, err ? -1 : 0);
+}
+
+// delta operation writer; adjacent copies are merged
+struct delta_out {
+  FILE    *file;
+  size_t   size;
+  uint32_t copy_offset;
+  uint32_t copy_len;
+  int      err;
+};
+
+static void put_op(struct delta_out *out, const uint8_t *op, size_t len) {
+  if (fwrite(op, len, 1, out->file) != 1)
+    out->err = 1;
+  out->size += len;
+}
+
+static void flush_copy(struct delta_out *out) {
+  uint8_t op[9];
+
+  if (!out->copy_len)
+    return;
+
+  op[0] = 'C';
+  put_be32(op + 1, out->copy_offset);
+  put_be32(op + 5, out->copy_len);
+  put_op(out, op, 9);
+  out->copy_len = 0;
+}
+
+static void emit_copy(struct delta_out *out, uint32_t offset, uint32_t len) {
+  if (out->copy_len && out->copy_offset + out->copy_len == offset) {
+    out->copy_len += len;
+    return;
+  }
+
+  flush_copy(out);
+  out->copy_offset = offset;
+  out->copy_len = len;
+}
+
+static void emit_add(struct delta_out *out, const uint8_t *data, uint32_t len) {
+  uint8_t op[5];
+
+  if (!len)
+    return;
+
+  flush_copy(out);
+  op[0] = 'A';
+  put_be32(op + 1, len);
+  put_op(out, op, 5);
+  put_op(out, data, len);
+}
+
+// rolling checksum of a block: a is the sum of the bytes, b the sum
+// weighted by distance from the end
+static uint32_t block_key(uint32_t a, uint32_t b) {
+  return (a & 0xffff) | b << 16;
+}
+
+static uint32_t key_bucket(uint32_t key) {
+  return (key * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void block_sums(const uint8_t *p, uint32_t *a, uint32_t *b) {
+  *a = *b = 0;
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    *a += p[i];
+    *b += (BLOCK_SIZE - i) * p[i];
+  }
+}
+
+static void diff(
+  struct delta_out *out,
+  const uint8_t    *base,
+  uint32_t          base_len,
+  const uint8_t    *target,
+  uint32_t          target_len
+) {
+  uint32_t block_count = base_len / BLOCK_SIZE;
+  int32_t *head = malloc(sizeof(*head) << HASH_BITS);
+  int32_t *next = malloc(sizeof(*next) * (block_count + 1));
+  uint32_t *keys = malloc(sizeof(*keys) * (block_count + 1));
+
+  if (!head || !next || !keys) {
+    perror("malloc");
+    out->err = 1;
+    goto done;
+  }
+
+  // index the base; chains are in ascending offset order
+  memset(head, 0xff, sizeof(*head) << HASH_BITS);
+  for (int32_t i = block_count - 1; i >= 0; i--) {
+    uint32_t a, b;
+
+    block_sums(base + i * BLOCK_SIZE, &a, &b);
+    keys[i] = block_key(a, b);
+    uint32_t bucket = key_bucket(keys[i]);
+    next[i] = head[bucket];
+    head[bucket] = i;
+  }
+
+  uint32_t pos = 0, literal = 0, a = 0, b = 0;
+  int sums_valid = 0;
+
+  while ((uint64_t)pos + BLOCK_SIZE <= target_len) {
+    if (!sums_valid) {
+      block_sums(target + pos, &a, &b);
+      sums_valid = 1;
+    }
+
+    uint32_t key = block_key(a, b);
+    uint32_t best_len = 0, best_offset = 0;
+    int chain = 0;
+
+    for (int32_t i = head[key_bucket(key)];
+         i >= 0 && chain < MAX_CHAIN;
+         i = next[i], chain++) {
+      uint32_t offset = i * BLOCK_SIZE;
+
+      if (keys[i] != key ||
+          memcmp(base + offset, target + pos, BLOCK_SIZE))
+        continue;
+
+      uint32_t len = BLOCK_SIZE;
+      while (offset + len < base_len &&
+             pos + len < target_len &&
+             base[offset + len] == target[pos + len])
+        len++;
+
+      if (len > best_len) {
+        best_len = len;
+        best_offset = offset;
+      }
+    }
+
+    if (best_len) {
+
+      // the match may start within the pending literal bytes
+      while (pos > literal &&
+             best_offset > 0 &&
+             base[best_offset - 1] == target[pos - 1]) {
+        pos--;
+        best_offset--;
+        best_len++;
+      }
+
+      emit_add(out, target + literal, pos - literal);
+      emit_copy(out, best_offset, best_len);
+      pos += best_len;
+      literal = pos;
+      sums_valid = 0;
+      continue;
+    }
+
+    // roll the checksum on by one byte
+    if ((uint64_t)pos + BLOCK_SIZE < target_len) {
+      a += target[pos + BLOCK_SIZE] - target[pos];
+      b += a - BLOCK_SIZE * target[pos];
+    }
+    pos++;
+  }
+
+  emit_add(out, target + literal, target_len - literal);
+  flush_copy(out);
+
+done:
+  free(head);
+  free(next);
+  free(keys);
+}
+
+// write a delta which reconstructs target from base; returns its
+// size
+static long write_delta(
+  const char                           *fn,
+  const struct scarlett2_firmware_file *base,
+  const struct scarlett2_firmware_file *target
+) {
+  struct scarlett2_delta_header header;
+  struct delta_out out = { 0 };
+  char *tmp_fn;
+
+  out.file = create_file(fn, &tmp_fn);
+  if (!out.file)
+    return -1;
+
+  memcpy(header.magic, DELTA_MAGIC_STRING, 8);
+  header.base_version = htonl(base->header.firmware_version);
+  memcpy(header.base_sha256, base->header.sha256, SHA256_DIGEST_LENGTH);
+  header_to_be(&header.target, &target->header);
+  put_op(&out, (const uint8_t *)&header, sizeof(header));
+
+  diff(
+    &out,
+    base->firmware_data,
+    base->header.firmware_length,
+    target->firmware_data,
+    target->header.firmware_length
+  );
+
+  if (out.err)
+    fprintf(stderr, "Error writing %s\n", tmp_fn);
+
+  if (finish_file(out.file, tmp_fn, fn, out.err ? -1 : 0) < 0)
+    return -1;
+
+  return out.size;
+}
+
+// write a delta and check that it reconstructs the target
+static long write_checked_delta(
+  const char                           *fn,
+  const struct scarlett2_firmware_file *base,
+  const struct scarlett2_firmware_file *target
+) {
+  long size = write_delta(fn, base, target);
+  if (size < 0)
+    return -1;
+
+  struct scarlett2_firmware_file *check = scarlett2_read_delta_file(fn);
+  int ok = check && !memcmp(
+    check->firmware_data,
+    target->firmware_data,
+    target->header.firmware_length
+  );
+  scarlett2_free_firmware_file(check);
+
+  if (!ok) {
+    fprintf(stderr, "Delta %s does not reproduce the image\n", fn);
+    unlink(fn);
+    return -1;
+  }
+
+  return size;
+}
+
+static struct scarlett2_firmware_file *load_entry(struct entry *e) {
+  return e->is_delta
+    ? scarlett2_read_delta_file(e->fn)
+    : scarlett2_read_firmware_file(e->fn);
+}
+
+static int entry_cmp(const void *p1, const void *p2) {
+  const struct entry *e1 = p1;
+  const struct entry *e2 = p2;
+
+  if (e1->header->usb_pid != e2->header->usb_pid)
+    return e1->header->usb_pid < e2->header->usb_pid ? -1 : 1;
+
+  // newest first
+  if (e1->header->firmware_version != e2->header->firmware_version)
+    return e1->header->firmware_version < e2->header->firmware_version
+      ? 1 : -1;
+
+  // full images before deltas of the same version
+  return e1->is_delta - e2->is_delta;
+}
+
+static void free_entries(struct entry *entries, int count) {
+  for (int i = 0; i < count; i++) {
+    free(entries[i].fn);
+    scarlett2_free_firmware_header(entries[i].header);
+  }
+  free(entries);
+}
+
+static int add_entry(
+  struct entry **entries,
+  int           *count,
+  char          *fn,
+  int            is_delta
+) {
+  struct scarlett2_firmware_header *header;
+  uint32_t base_version = 0;
+
+  if (is_delta) {
+    FILE *file = scarlett2_io_fopen(fn);
+    struct scarlett2_delta_header *delta =
+      file ? read_delta_header(file, fn) : NULL;
+
+    if (file)
+      fclose(file);
+    if (!delta)
+      return -1;
+
+    base_version = delta->base_version;
+    header = malloc(sizeof(*header));
+    if (header)
+      *header = delta->target;
+    free(delta);
+  } else {
+    header = scarlett2_read_firmware_header(fn);
+  }
+
+  if (!header)
+    return -1;
+
+  struct entry *new_entries = realloc(
+    *entries, sizeof(**entries) * (*count + 1)
+  );
+  if (!new_entries) {
+    perror("realloc");
+    scarlett2_free_firmware_header(header);
+    return -1;
+  }
+
+  *entries = new_entries;
+  (*entries)[(*count)++] = (struct entry){
+    fn, is_delta, base_version, header
+  };
+  return 0;
+}
+
+// the images and deltas in dir, sorted by PID then newest first;
+// count is -1 if dir can't be read
+static struct entry *scan_dir(const char *dir, int *count) {
+  struct entry *entries = NULL;
+  struct dirent *ent;
+
+  *count = 0;
+
+  DIR *d = opendir(dir);
+  if (!d) {
+    fprintf(stderr, "Unable to opendir %s: %s\n", dir, strerror(errno));
+    *count = -1;
+    return NULL;
+  }
+
+  while ((ent = readdir(d))) {
+    int is_delta = has_suffix(ent->d_name, DELTA_SUFFIX);
+
+    if (!is_delta && !has_suffix(ent->d_name, ".bin"))
+      continue;
+
+    char *fn = join_path(dir, ent->d_name, "");
+    if (!fn)
+      break;
+
+    if (add_entry(&entries, count, fn, is_delta) < 0) {
+      fprintf(stderr, "Skipping %s\n", fn);
+      free(fn);
+    }
+  }
+
+  closedir(d);
+
+  if (*count)
+    qsort(entries, *count, sizeof(*entries), entry_cmp);
+
+  return entries;
+}
+
+// is e the base of any delta in entries?
+static int is_base(struct entry *entries, int count, struct entry *e) {
+  for (int i = 0; i < count; i++)
+    if (entries[i].is_delta &&
+        entries[i].header->usb_pid == e->header->usb_pid &&
+        entries[i].base_version == e->header->firmware_version)
+      return 1;
+
+  return 0;
+}
+
+static int has_version(
+  struct entry                           *entries,
+  int                                     count,
+  const struct scarlett2_firmware_header *header
+) {
+  for (int i = 0; i < count; i++)
+    if (entries[i].header->usb_pid == header->usb_pid &&
+        entries[i].header->firmware_version == header->firmware_version)
+      return 1;
+
+  return 0;
+}
+
+int scarlett2_delta_pack(const char *dir) {
+  int count, err = 0;
+  long before = 0, after = 0;
+  struct entry *entries = scan_dir(dir, &count);
+  struct scarlett2_firmware_file *base = NULL;
+
+  if (count < 0)
+    return -1;
+
+  for (int i = 0; i < count; i++) {
+    struct entry *e = &entries[i];
+
+    // the first full image for each PID is the latest and is kept
+    if (!e->is_delta &&
+        (!base || base->header.usb_pid != e->header->usb_pid)) {
+      scarlett2_free_firmware_file(base);
+      base = scarlett2_read_firmware_file(e->fn);
+      if (!base)
+        err = -1;
+      continue;
+    }
+
+    if (e->is_delta ||
+        !base ||
+        base->header.usb_pid != e->header->usb_pid ||
+        is_base(entries, count, e))
+      continue;
+
+    struct scarlett2_firmware_file *target = load_entry(e);
+    if (!target) {
+      err = -1;
+      continue;
+    }
+
+    char *stem = get_stem(e->fn);
+    char *delta_fn = stem ? join_path(dir, stem, DELTA_SUFFIX) : NULL;
+    long size = delta_fn ? write_checked_delta(delta_fn, base, target) : -1;
+
+    if (size < 0) {
+      err = -1;
+    } else if (unlink(e->fn) < 0) {
+      fprintf(stderr, "Unable to remove %s: %s\n", e->fn, strerror(errno));
+      err = -1;
+    } else {
+      long full = sizeof(struct scarlett2_firmware_header) +
+                  target->header.firmware_length;
+
+      printf(
+        "%04x version %u: %ld -> %ld bytes (delta against %u)\n",
+        target->header.usb_pid,
+        target->header.firmware_version,
+        full,
+        size,
+        base->header.firmware_version
+      );
+      before += full;
+      after += size;
+    }
+
+    free(delta_fn);
+    free(stem);
+    scarlett2_free_firmware_file(target);
+  }
+
+  scarlett2_free_firmware_file(base);
+  free_entries(entries, count);
+
+  if (before)
+    printf("Packed %ld bytes into %ld\n", before, after);
+  else
+    printf("Nothing to pack in %s\n", dir);
+
+  return err;
+}
+
+int scarlett2_delta_unpack(const char *dir) {
+  int count, err = 0, unpacked = 0;
+  struct entry *entries = scan_dir(dir, &count);
+
+  if (count < 0)
+    return -1;
+
+  for (int i = 0; i < count; i++) {
+    struct entry *e = &entries[i];
+
+    if (!e->is_delta)
+      continue;
+
+    struct scarlett2_firmware_file *firmware = scarlett2_read_delta_file(e->fn);
+    if (!firmware) {
+      err = -1;
+      continue;
+    }
+
+    char *stem = get_stem(e->fn);
+    char *fn = stem ? join_path(dir, stem, ".bin") : NULL;
+
+    if (!fn || write_image(fn, firmware) < 0) {
+      err = -1;
+    } else if (unlink(e->fn) < 0) {
+      fprintf(stderr, "Unable to remove %s: %s\n", e->fn, strerror(errno));
+      err = -1;
+    } else {
+      printf(
+        "%04x version %u: restored %s\n",
+        firmware->header.usb_pid,
+        firmware->header.firmware_version,
+        fn
+      );
+      unpacked++;
+    }
+
+    free(fn);
+    free(stem);
+    scarlett2_free_firmware_file(firmware);
+  }
+
+  free_entries(entries, count);
+
+  if (!unpacked && !err)
+    printf("No deltas in %s\n", dir);
+
+  return err;
+}
+
+int scarlett2_delta_sync(const char *src, const char *dst) {
+  int src_count, dst_count, err = 0, copied = 0;
+  long sent = 0, full = 0;
+  struct entry *src_entries = scan_dir(src, &src_count);
+  if (src_count < 0)
+    return -1;
+
+  if (mkdir(dst, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Unable to create %s: %s\n", dst, strerror(errno));
+    free_entries(src_entries, src_count);
+    return -1;
+  }
+
+  struct entry *dst_entries = scan_dir(dst, &dst_count);
+  if (dst_count < 0) {
+    free_entries(src_entries, src_count);
+    return -1;
+  }
+
+  // newest first, so a PID new to dst gets its latest image in full
+  // and older ones as deltas against it
+  for (int i = 0; i < src_count; i++) {
+    struct entry *e = &src_entries[i];
+
+    if (has_version(dst_entries, dst_count, e->header))
+      continue;
+
+    struct scarlett2_firmware_file *target = load_entry(e);
+    if (!target) {
+      err = -1;
+      continue;
+    }
+
+    // the latest full image dst has for this PID
+    struct entry *base_entry = NULL;
+    for (int j = 0; j < dst_count; j++)
+      if (!dst_entries[j].is_delta &&
+          dst_entries[j].header->usb_pid == e->header->usb_pid) {
+        base_entry = &dst_entries[j];
+        break;
+      }
+
+    struct scarlett2_firmware_file *base =
+      base_entry ? scarlett2_read_firmware_file(base_entry->fn) : NULL;
+
+    char *stem = get_stem(e->fn);
+    char *fn = stem
+      ? join_path(dst, stem, base ? DELTA_SUFFIX : ".bin")
+      : NULL;
+    long size = -1;
+
+    if (fn && base) {
+      size = write_checked_delta(fn, base, target);
+    } else if (fn) {
+      size = write_image(fn, target);
+      if (!size)
+        size = sizeof(struct scarlett2_firmware_header) +
+               target->header.firmware_length;
+    }
+
+    if (size < 0 ||
+        add_entry(&dst_entries, &dst_count, fn, !!base) < 0) {
+      err = -1;
+      free(fn);
+    } else {
+      printf(
+        "%04x version %u: %s (%ld bytes)\n",
+        target->header.usb_pid,
+        target->header.firmware_version,
+        base ? "delta" : "full image",
+        size
+      );
+      sent += size;
+      full += sizeof(struct scarlett2_firmware_header) +
+              target->header.firmware_length;
+      copied++;
+
+      // keep dst sorted for the base lookup
+      qsort(dst_entries, dst_count, sizeof(*dst_entries), entry_cmp);
+    }
+
+    free(stem);
+    scarlett2_free_firmware_file(base);
+    scarlett2_free_firmware_file(target);
+  }
+
+  free_entries(src_entries, src_count);
+  free_entries(dst_entries, dst_count);
+
+  if (copied)
+    printf(
+      "Synced %d firmware version%s: %ld bytes written (%ld as full "
+        "images)\n",
+      copied,
+      copied == 1 ? "" : "s",
+      sent,
+      full
+    );
+  else if (!err)
+    printf("%s is up to date\n", dst);
+
+  return err;
+}
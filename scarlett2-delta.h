@@ -0,0 +1,47 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_DELTA_H
+#define SCARLETT2_DELTA_H
+
+#include <stdint.h>
+
+#include "scarlett2-firmware.h"
+
+#define DELTA_MAGIC_STRING "SCARDLTA"
+#define DELTA_SUFFIX ".delta"
+
+// A firmware image stored as a binary diff against another version
+// (the base) for the same PID, which must be in the same directory.
+// The header of the image it reconstructs is stored in full so the
+// file can be listed without reconstructing it.
+struct scarlett2_delta_header {
+  char magic[8];             // "SCARDLTA"
+  uint32_t base_version;     // Big-endian
+  uint8_t base_sha256[32];
+  struct scarlett2_firmware_header target;
+} __attribute__((packed));
+
+// Returns 1 if fn is a delta file
+int scarlett2_is_delta(const char *fn);
+
+// Read the header of the image a delta reconstructs
+struct scarlett2_firmware_header *scarlett2_read_delta_header(
+  const char *fn
+);
+
+// Reconstruct and verify the image from a delta and its base
+struct scarlett2_firmware_file *scarlett2_read_delta_file(const char *fn);
+
+// Replace all but the latest image for each PID in dir with deltas
+// against it
+int scarlett2_delta_pack(const char *dir);
+
+// Replace all deltas in dir with full images
+int scarlett2_delta_unpack(const char *dir);
+
+// Copy the images in src which are missing from dst, as deltas
+// against the latest image dst has for the PID where possible
+int scarlett2_delta_sync(const char *src, const char *dst);
+
+#endif // SCARLETT2_DELTA_H
@@ -0,0 +1,217 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Single-threaded engine for operating on many cards at once
+//
+// Tasks that can make progress now are kept on a ready list and take
+// a step each in turn. Tasks waiting for a deadline (erase progress
+// polls, reboots) go on a hashed timer wheel; when nothing is ready,
+// the engine sleeps until the next occupied slot.
+//
+// The driver's hwdep device never reports poll() readiness, and a
+// firmware write is a synchronous USB transfer inside write(), so
+// each card's writes are made on a thread of its own (see
+// scarlett2-update.c), and its task waits for the fd on which the
+// thread reports each write finishing; the writes to all the cards
+// overlap. Those fds, and optionally one other (the service's request
+// pipe), are polled along with the timers, and checked between steps
+// while tasks are ready.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scarlett2-engine.h"
+#include "scarlett2-stats.h"
+
+static uint64_t now_tick(struct scarlett2_engine *engine) {
+  return (scarlett2_now_us() - engine->start_us) / SCARLETT2_ENGINE_TICK_US;
+}
+
+static void make_ready(
+  struct scarlett2_engine      *engine,
+  struct scarlett2_engine_task *task
+) {
+  task->next = NULL;
+  *engine->ready_tail = task;
+  engine->ready_tail = &task->next;
+}
+
+static void schedule(
+  struct scarlett2_engine      *engine,
+  struct scarlett2_engine_task *task,
+  int                           ms
+) {
+  if (!ms) {
+    make_ready(engine, task);
+    return;
+  }
+
+  uint64_t ticks = (uint64_t)ms * 1000 / SCARLETT2_ENGINE_TICK_US;
+
+  task->expires = now_tick(engine) + (ticks ? ticks : 1);
+
+  struct scarlett2_engine_task **slot =
+    &engine->slots[task->expires % SCARLETT2_ENGINE_SLOTS];
+  task->next = *slot;
+  *slot = task;
+  engine->waiting++;
+}
+
+// move tasks whose time has come from the wheel to the ready list
+static void expire_timers(struct scarlett2_engine *engine) {
+  uint64_t now = now_tick(engine);
+
+  if (now <= engine->tick)
+    return;
+
+  // after a long step, one turn of the wheel covers every slot
+  uint64_t from = engine->tick + 1;
+  if (now - engine->tick > SCARLETT2_ENGINE_SLOTS)
+    from = now - SCARLETT2_ENGINE_SLOTS + 1;
+
+  for (uint64_t t = from; t <= now; t++) {
+    struct scarlett2_engine_task **p =
+      &engine->slots[t % SCARLETT2_ENGINE_SLOTS];
+
+    while (*p) {
+      struct scarlett2_engine_task *task = *p;
+
+      // not due until a later turn of the wheel
+      if (task->expires > now) {
+        p = &task->next;
+        continue;
+      }
+
+      *p = task->next;
+      engine->waiting--;
+      make_ready(engine, task);
+    }
+  }
+
+  engine->tick = now;
+}
+
+// ms until the next occupied slot; tasks there may be due on a later
+// turn, in which case the engine wakes up early and sleeps again
+static int next_timeout_ms(struct scarlett2_engine *engine) {
+  for (int i = 1; i <= SCARLETT2_ENGINE_SLOTS; i++)
+    if (engine->slots[(engine->tick + i) % SCARLETT2_ENGINE_SLOTS])
+      return i * SCARLETT2_ENGINE_TICK_US / 1000;
+
+  return SCARLETT2_ENGINE_SLOTS * SCARLETT2_ENGINE_TICK_US / 1000;
+}
+
+static void add_polling(
+  struct scarlett2_engine      *engine,
+  struct scarlett2_engine_task *task
+) {
+  task->next = engine->polling;
+  engine->polling = task;
+  engine->polling_count++;
+}
+
+// wait up to ms for the tasks' fds and the watched fd; make the
+// tasks whose fds are readable ready, and call the watched fd's
+// handler if it is
+static void poll_fds(struct scarlett2_engine *engine, int ms) {
+  int count = engine->polling_count + 1;
+
+  if (count > engine->pfds_size) {
+    struct pollfd *pfds = realloc(engine->pfds, count * sizeof(*pfds));
+    if (!pfds) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    engine->pfds = pfds;
+    engine->pfds_size = count;
+  }
+
+  // a negative fd is ignored by poll()
+  engine->pfds[0] = (struct pollfd){ .fd = engine->watch_fd, .events = POLLIN };
+
+  int i = 1;
+  for (struct scarlett2_engine_task *task = engine->polling;
+       task;
+       task = task->next)
+    engine->pfds[i++] = (struct pollfd){ .fd = task->fd, .events = POLLIN };
+
+  if (poll(engine->pfds, count, ms) <= 0)
+    return;
+
+  // the same order as they were added above
+  struct scarlett2_engine_task **p = &engine->polling;
+  for (i = 1; i < count; i++) {
+    struct scarlett2_engine_task *task = *p;
+
+    if (!engine->pfds[i].revents) {
+      p = &task->next;
+      continue;
+    }
+
+    *p = task->next;
+    engine->polling_count--;
+    make_ready(engine, task);
+  }
+
+  if (engine->pfds[0].revents)
+    engine->watch_ready(engine->watch_arg);
+}
+
+void scarlett2_engine_init(struct scarlett2_engine *engine) {
+  memset(engine, 0, sizeof(*engine));
+  engine->ready_tail = &engine->ready;
+  engine->start_us = scarlett2_now_us();
+  engine->watch_fd = -1;
+}
+
+void scarlett2_engine_watch(
+  struct scarlett2_engine  *engine,
+  int                       fd,
+  void                    (*ready)(void *arg),
+  void                     *arg
+) {
+  engine->watch_fd = fd;
+  engine->watch_ready = ready;
+  engine->watch_arg = arg;
+}
+
+void scarlett2_engine_add(
+  struct scarlett2_engine      *engine,
+  struct scarlett2_engine_task *task
+) {
+  make_ready(engine, task);
+}
+
+void scarlett2_engine_run(struct scarlett2_engine *engine) {
+  while (engine->ready || engine->waiting || engine->polling ||
+         engine->watch_fd >= 0) {
+    expire_timers(engine);
+
+    if (engine->polling || engine->watch_fd >= 0) {
+      poll_fds(engine, engine->ready ? 0 : next_timeout_ms(engine));
+      expire_timers(engine);
+    }
+
+    struct scarlett2_engine_task *task = engine->ready;
+    if (!task) {
+      if (!engine->polling && engine->watch_fd < 0)
+        poll(NULL, 0, next_timeout_ms(engine));
+      continue;
+    }
+
+    engine->ready = task->next;
+    if (!engine->ready)
+      engine->ready_tail = &engine->ready;
+
+    int ms = task->step(task);
+    if (ms == SCARLETT2_ENGINE_WAIT_FD)
+      add_polling(engine, task);
+    else if (ms >= 0)
+      schedule(engine, task, ms);
+  }
+
+  free(engine->pfds);
+  engine->pfds = NULL;
+  engine->pfds_size = 0;
+}
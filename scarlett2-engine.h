@@ -0,0 +1,83 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_ENGINE_H
+#define SCARLETT2_ENGINE_H
+
+#include <poll.h>
+#include <stdint.h>
+
+// Timer wheel resolution and size: 1ms ticks, one turn per 512ms
+#define SCARLETT2_ENGINE_TICK_US 1000
+#define SCARLETT2_ENGINE_SLOTS   512
+
+// Returned by a task's step() to wait for task->fd to be readable
+#define SCARLETT2_ENGINE_WAIT_FD -2
+
+// A unit of work driven by the engine, e.g. the update of one card;
+// embed it in a larger struct
+struct scarlett2_engine_task {
+
+  // Advance the task without blocking; return the number of ms until
+  // it should be called again (0 for as soon as the other ready
+  // tasks have had a turn), SCARLETT2_ENGINE_WAIT_FD to be called
+  // again once fd is readable, or -1 when it's finished
+  int (*step)(struct scarlett2_engine_task *task);
+
+  // the fd to wait for, set by step() before it returns
+  // SCARLETT2_ENGINE_WAIT_FD
+  int fd;
+
+  // private
+  struct scarlett2_engine_task *next;
+  uint64_t                      expires;
+};
+
+// Runs any number of tasks on the calling thread: ready tasks take
+// turns a step at a time, waiting tasks sit on a timer wheel, and
+// tasks waiting for an fd (e.g. a write finishing on another thread)
+// are polled
+struct scarlett2_engine {
+  struct scarlett2_engine_task  *slots[SCARLETT2_ENGINE_SLOTS];
+  struct scarlett2_engine_task  *ready;
+  struct scarlett2_engine_task **ready_tail;
+  double                         start_us;
+  uint64_t                       tick;
+  int                            waiting;
+
+  // tasks waiting for their fd, and the pollfds for them and the
+  // watched fd
+  struct scarlett2_engine_task  *polling;
+  int                            polling_count;
+  struct pollfd                 *pfds;
+  int                            pfds_size;
+
+  // optional fd to watch (e.g. a pipe from another thread), and what
+  // to call when it's readable
+  int                            watch_fd;
+  void                         (*watch_ready)(void *arg);
+  void                          *watch_arg;
+};
+
+void scarlett2_engine_init(struct scarlett2_engine *engine);
+
+// Add a task; its first step is taken as soon as possible
+void scarlett2_engine_add(
+  struct scarlett2_engine      *engine,
+  struct scarlett2_engine_task *task
+);
+
+// Also wait for fd to be readable, and call ready(arg) when it is;
+// ready() may add tasks. The engine then runs until the fd is set to
+// -1, rather than until every task has finished.
+void scarlett2_engine_watch(
+  struct scarlett2_engine  *engine,
+  int                       fd,
+  void                    (*ready)(void *arg),
+  void                     *arg
+);
+
+// Run until every task has finished
+void scarlett2_engine_run(struct scarlett2_engine *engine);
+
+#endif // SCARLETT2_ENGINE_H
@@ -2,6 +2,9 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include "scarlett2-firmware.h"
+#include "scarlett2-delta.h"
+#include "scarlett2-io.h"
+#include "scarlett2-trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,8 +17,13 @@ static int verify_sha256(
   const unsigned char *expected_hash
 ) {
   unsigned char computed_hash[SHA256_DIGEST_LENGTH];
+
+  TRACE1(sha256_start, length);
   SHA256(data, length, computed_hash);
-  return memcmp(computed_hash, expected_hash, SHA256_DIGEST_LENGTH) == 0;
+  int ok = memcmp(computed_hash, expected_hash, SHA256_DIGEST_LENGTH) == 0;
+  TRACE2(sha256_end, length, ok);
+
+  return ok;
 }
 
 static struct scarlett2_firmware_file *read_header(FILE *file) {
@@ -59,7 +67,10 @@ error:
 struct scarlett2_firmware_header *scarlett2_read_firmware_header(
   const char *fn
 ) {
-  FILE *file = fopen(fn, "rb");
+  if (scarlett2_is_delta(fn))
+    return scarlett2_read_delta_header(fn);
+
+  FILE *file = scarlett2_io_fopen(fn);
   if (!file) {
     perror("fopen");
     fprintf(stderr, "Unable to open %s\n", fn);
@@ -69,16 +80,28 @@ struct scarlett2_firmware_header *scarlett2_read_firmware_header(
   struct scarlett2_firmware_file *firmware = read_header(file);
   if (!firmware) {
     fprintf(stderr, "Error reading firmware header from %s\n", fn);
+    fclose(file);
     return NULL;
   }
 
+  TRACE4(
+    header_parse,
+    fn,
+    firmware->header.usb_pid,
+    firmware->header.firmware_version,
+    firmware->header.firmware_length
+  );
+
   fclose(file);
 
   return realloc(firmware, sizeof(struct scarlett2_firmware_header));
 }
 
 struct scarlett2_firmware_file *scarlett2_read_firmware_file(const char *fn) {
-  FILE *file = fopen(fn, "rb");
+  if (scarlett2_is_delta(fn))
+    return scarlett2_read_delta_file(fn);
+
+  FILE *file = scarlett2_io_fopen(fn);
   if (!file) {
     perror("fopen");
     fprintf(stderr, "Unable to open %s\n", fn);
@@ -88,9 +111,18 @@ struct scarlett2_firmware_file *scarlett2_read_firmware_file(const char *fn) {
   struct scarlett2_firmware_file *firmware = read_header(file);
   if (!firmware) {
     fprintf(stderr, "Error reading firmware header from %s\n", fn);
+    fclose(file);
     return NULL;
   }
 
+  TRACE4(
+    header_parse,
+    fn,
+    firmware->header.usb_pid,
+    firmware->header.firmware_version,
+    firmware->header.firmware_length
+  );
+
   firmware->firmware_data = malloc(firmware->header.firmware_length);
   if (!firmware->firmware_data) {
     perror("Failed to allocate memory for firmware data");
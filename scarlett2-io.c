@@ -0,0 +1,365 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Cache-neutral firmware file reads
+//
+// Hosts running this tool may keep large sample libraries in the page
+// cache; scanning and loading firmware through stdio would push some
+// of that out for data that won't be read again.
+//
+// In cache-neutral mode, scarlett2_io_fopen() returns a stdio stream
+// (via fopencookie()) that reads through an aligned buffer. The file
+// is opened with O_DIRECT if possible, bypassing the page cache.
+// Otherwise (e.g. tmpfs) reads go through the page cache, and the
+// pages which weren't already resident when the file was opened are
+// dropped as each buffer is consumed, so a file that was hot for
+// someone else stays hot.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scarlett2-io.h"
+
+#define IO_ALIGN 4096
+#define IO_BUF_SIZE (64 * 1024)
+
+static int cache_neutral;
+
+// files read in cache-neutral mode, for the footprint report
+struct touched_file {
+  char   *fn;
+  size_t  pages;
+  size_t  resident_before;
+};
+
+static pthread_mutex_t touched_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct touched_file *touched;
+static int touched_count;
+static long cached_kb_before = -1;
+
+struct io_file {
+  int            fd;
+  int            direct;
+  off_t          size;
+  off_t          pos;
+  unsigned char *buf;
+  off_t          buf_offset;
+  size_t         buf_len;
+
+  // which pages were resident at open (NULL if unknown)
+  unsigned char *resident;
+  long           page_size;
+};
+
+static long get_cached_kb(void) {
+  FILE *f = fopen("/proc/meminfo", "r");
+  char line[128];
+  long kb = -1;
+
+  if (!f)
+    return -1;
+
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "Cached: %ld kB", &kb) == 1)
+      break;
+
+  fclose(f);
+  return kb;
+}
+
+// page residency of fd; returns a malloc'd vector of size pages, or
+// NULL
+static unsigned char *get_residency(int fd, off_t size, size_t *pages) {
+  long page_size = sysconf(_SC_PAGESIZE);
+
+  *pages = (size + page_size - 1) / page_size;
+  if (!size)
+    return NULL;
+
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  unsigned char *vec = malloc(*pages);
+  if (vec && mincore(map, size, vec) < 0) {
+    free(vec);
+    vec = NULL;
+  }
+
+  munmap(map, size);
+  return vec;
+}
+
+static size_t count_resident(const unsigned char *vec, size_t pages) {
+  size_t count = 0;
+
+  for (size_t i = 0; vec && i < pages; i++)
+    count += vec[i] & 1;
+
+  return count;
+}
+
+static void add_touched(const char *fn, unsigned char *vec, size_t pages) {
+  pthread_mutex_lock(&touched_lock);
+
+  // only the first open counts as "before"
+  for (int i = 0; i < touched_count; i++)
+    if (!strcmp(touched[i].fn, fn))
+      goto done;
+
+  struct touched_file *new_touched = realloc(
+    touched, sizeof(*touched) * (touched_count + 1)
+  );
+  char *fn_copy = strdup(fn);
+  if (!new_touched || !fn_copy) {
+    if (new_touched)
+      touched = new_touched;
+    free(fn_copy);
+    goto done;
+  }
+
+  touched = new_touched;
+  touched[touched_count++] = (struct touched_file){
+    fn_copy, pages, count_resident(vec, pages)
+  };
+
+done:
+  pthread_mutex_unlock(&touched_lock);
+}
+
+// drop the pages in [offset, offset + len) which weren't resident at
+// open
+static void drop_pages(struct io_file *f, off_t offset, size_t len) {
+  if (!f->resident)
+    return;
+
+  off_t first = offset / f->page_size;
+  off_t last = (offset + len + f->page_size - 1) / f->page_size;
+  off_t run = -1;
+
+  for (off_t page = first; page <= last; page++) {
+    int drop = page < last && !(f->resident[page] & 1);
+
+    if (drop && run < 0)
+      run = page;
+    if (!drop && run >= 0) {
+      posix_fadvise(
+        f->fd,
+        run * f->page_size,
+        (page - run) * f->page_size,
+        POSIX_FADV_DONTNEED
+      );
+      run = -1;
+    }
+  }
+}
+
+static int fill_buf(struct io_file *f) {
+  off_t offset = f->pos & ~(off_t)(IO_ALIGN - 1);
+  ssize_t len = pread(f->fd, f->buf, IO_BUF_SIZE, offset);
+
+  // some filesystems accept O_DIRECT at open but not on read
+  if (len < 0 && errno == EINVAL && f->direct) {
+    int flags = fcntl(f->fd, F_GETFL);
+    if (flags >= 0 && fcntl(f->fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+      f->direct = 0;
+      len = pread(f->fd, f->buf, IO_BUF_SIZE, offset);
+    }
+  }
+
+  if (len < 0)
+    return -1;
+
+  if (!f->direct)
+    drop_pages(f, offset, len);
+
+  f->buf_offset = offset;
+  f->buf_len = len;
+  return 0;
+}
+
+static ssize_t io_read(void *cookie, char *out, size_t size) {
+  struct io_file *f = cookie;
+  size_t done = 0;
+
+  while (done < size && f->pos < f->size) {
+    if (f->pos < f->buf_offset ||
+        f->pos >= f->buf_offset + (off_t)f->buf_len) {
+      if (fill_buf(f) < 0)
+        return done ? (ssize_t)done : -1;
+      if (f->pos >= f->buf_offset + (off_t)f->buf_len)
+        break;
+    }
+
+    size_t avail = f->buf_offset + f->buf_len - f->pos;
+    size_t n = size - done < avail ? size - done : avail;
+
+    memcpy(out + done, f->buf + (f->pos - f->buf_offset), n);
+    f->pos += n;
+    done += n;
+  }
+
+  return done;
+}
+
+static int io_seek(void *cookie, off64_t *offset, int whence) {
+  struct io_file *f = cookie;
+  off_t pos;
+
+  switch (whence) {
+    case SEEK_SET: pos = *offset;           break;
+    case SEEK_CUR: pos = f->pos + *offset;  break;
+    case SEEK_END: pos = f->size + *offset; break;
+    default:       return -1;
+  }
+
+  if (pos < 0)
+    return -1;
+
+  f->pos = pos;
+  *offset = pos;
+  return 0;
+}
+
+static int io_close(void *cookie) {
+  struct io_file *f = cookie;
+
+  close(f->fd);
+  free(f->buf);
+  free(f->resident);
+  free(f);
+  return 0;
+}
+
+void scarlett2_io_set_cache_neutral(int enable) {
+  cache_neutral = enable;
+  if (enable && cached_kb_before < 0)
+    cached_kb_before = get_cached_kb();
+}
+
+FILE *scarlett2_io_fopen(const char *fn) {
+  int saved_errno;
+
+  if (!cache_neutral)
+    return fopen(fn, "rb");
+
+  struct io_file *f = calloc(1, sizeof(*f));
+  if (!f)
+    return NULL;
+
+  f->page_size = sysconf(_SC_PAGESIZE);
+  f->direct = 1;
+  f->fd = open(fn, O_RDONLY | O_DIRECT);
+  if (f->fd < 0 && errno == EINVAL) {
+    f->direct = 0;
+    f->fd = open(fn, O_RDONLY);
+  }
+  if (f->fd < 0)
+    goto error;
+
+  struct stat st;
+  if (fstat(f->fd, &st) < 0)
+    goto error;
+  f->size = st.st_size;
+
+  size_t pages;
+  f->resident = get_residency(f->fd, f->size, &pages);
+  add_touched(fn, f->resident, pages);
+
+  if (posix_memalign((void **)&f->buf, IO_ALIGN, IO_BUF_SIZE)) {
+    f->buf = NULL;
+    errno = ENOMEM;
+    goto error;
+  }
+
+  FILE *file = fopencookie(f, "rb", (cookie_io_functions_t){
+    .read = io_read,
+    .seek = io_seek,
+    .close = io_close
+  });
+  if (file)
+    return file;
+
+error:
+  saved_errno = errno;
+  if (f->fd >= 0)
+    close(f->fd);
+  free(f->buf);
+  free(f->resident);
+  free(f);
+  errno = saved_errno;
+  return NULL;
+}
+
+void scarlett2_io_drop_written(const char *fn) {
+  if (!cache_neutral)
+    return;
+
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0)
+    return;
+
+  // dirty pages can't be dropped until they've been written back
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+void scarlett2_io_print_footprint(void) {
+  size_t before = 0, after = 0, total = 0;
+  long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+
+  pthread_mutex_lock(&touched_lock);
+
+  for (int i = 0; i < touched_count; i++) {
+    struct touched_file *t = &touched[i];
+    size_t pages = 0;
+    unsigned char *vec = NULL;
+
+    int fd = open(t->fn, O_RDONLY);
+    if (fd >= 0) {
+      struct stat st;
+      if (fstat(fd, &st) == 0)
+        vec = get_residency(fd, st.st_size, &pages);
+      close(fd);
+    }
+
+    before += t->resident_before;
+    after += count_resident(vec, pages);
+    total += t->pages;
+    free(vec);
+  }
+
+  pthread_mutex_unlock(&touched_lock);
+
+  fflush(stdout);
+  fprintf(
+    stderr,
+    "Page cache: %d firmware file%s (%zu KiB), %zu KiB resident before, "
+      "%zu KiB after\n",
+    touched_count,
+    touched_count == 1 ? "" : "s",
+    total * page_kb,
+    before * page_kb,
+    after * page_kb
+  );
+
+  long cached_kb_after = get_cached_kb();
+  if (cached_kb_before >= 0 && cached_kb_after >= 0)
+    fprintf(
+      stderr,
+      "System page cache: %ld KiB before, %ld KiB after (%+ld KiB)\n",
+      cached_kb_before,
+      cached_kb_after,
+      cached_kb_after - cached_kb_before
+    );
+}
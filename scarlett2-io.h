@@ -0,0 +1,26 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_IO_H
+#define SCARLETT2_IO_H
+
+#include <stdio.h>
+
+// In cache-neutral mode, firmware files are read without leaving
+// anything in the page cache that wasn't there before: with O_DIRECT
+// where the filesystem supports it, otherwise by dropping the pages
+// read with posix_fadvise(POSIX_FADV_DONTNEED) as they are consumed
+void scarlett2_io_set_cache_neutral(int enable);
+
+// Open a firmware file for reading; close with fclose()
+FILE *scarlett2_io_fopen(const char *fn);
+
+// In cache-neutral mode, flush a file that has just been written and
+// drop it from the page cache
+void scarlett2_io_drop_written(const char *fn);
+
+// Print the page-cache footprint of the files read in cache-neutral
+// mode, before and after, and the change in the system page cache
+void scarlett2_io_print_footprint(void);
+
+#endif // SCARLETT2_IO_H
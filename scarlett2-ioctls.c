@@ -2,68 +2,275 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <stdio.h>
+#include <sys/file.h>
 #include <alsa/asoundlib.h>
 
 #include "scarlett2.h"
 
 #include "scarlett2-ioctls.h"
+#include "scarlett2-session.h"
+#include "scarlett2-watchdog.h"
+
+// when replaying, the recorded result of op on the device handle
+static const struct scarlett2_session_event *replay(void *handle, int op) {
+  char name[32];
+
+  if (!scarlett2_session_replaying())
+    return NULL;
+
+  scarlett2_session_get_name(handle, name, sizeof(name));
+  return scarlett2_session_replay(name, op, 0, 0);
+}
+
+// when recording, save the result of op on the device handle
+static int record(int64_t start, void *handle, int op, int result) {
+  char name[32];
+
+  if (scarlett2_session_recording()) {
+    scarlett2_session_get_name(handle, name, sizeof(name));
+    scarlett2_session_record(start, name, op, result, 0, 0, 0);
+  }
+
+  return result;
+}
+
+// the blocking device calls, made by scarlett2_watchdog_call()
+
+static int pversion_call(void *hwdep, void *data, size_t len) {
+  return snd_hwdep_ioctl(hwdep, SCARLETT2_IOCTL_PVERSION, data);
+}
+
+static int reboot_call(void *hwdep, void *data, size_t len) {
+  return snd_hwdep_ioctl(hwdep, SCARLETT2_IOCTL_REBOOT, 0);
+}
+
+static int select_segment_call(void *hwdep, void *data, size_t len) {
+  return snd_hwdep_ioctl(hwdep, SCARLETT2_IOCTL_SELECT_FLASH_SEGMENT, data);
+}
+
+static int erase_segment_call(void *hwdep, void *data, size_t len) {
+  return snd_hwdep_ioctl(hwdep, SCARLETT2_IOCTL_ERASE_FLASH_SEGMENT, 0);
+}
+
+static int erase_progress_call(void *hwdep, void *data, size_t len) {
+  return snd_hwdep_ioctl(hwdep, SCARLETT2_IOCTL_GET_ERASE_PROGRESS, data);
+}
+
+static int write_call(void *hwdep, void *data, size_t len) {
+  return snd_hwdep_write(hwdep, data, len);
+}
+
+static int ctl_read_call(void *ctl, void *data, size_t len) {
+  return snd_ctl_elem_read(ctl, data);
+}
+
+static int close_hwdep(void *hwdep) {
+  return snd_hwdep_close(hwdep);
+}
+
+static int close_ctl(void *ctl) {
+  return snd_ctl_close(ctl);
+}
 
 int scarlett2_open_card(char *alsa_name, snd_hwdep_t **hwdep) {
-  return snd_hwdep_open(hwdep, alsa_name, SND_HWDEP_OPEN_DUPLEX);
+  const struct scarlett2_session_event *ev = scarlett2_session_replay(
+    alsa_name, SCARLETT2_OP_OPEN, 0, 0
+  );
+  if (ev) {
+    *hwdep = NULL;
+    if (ev->v[0] < 0)
+      return ev->v[0];
+    *hwdep = scarlett2_session_new_handle(alsa_name);
+    return *hwdep ? 0 : -ENOMEM;
+  }
+
+  int64_t start = scarlett2_session_now();
+  int err = snd_hwdep_open(hwdep, alsa_name, SND_HWDEP_OPEN_DUPLEX);
+
+  scarlett2_session_record(start, alsa_name, SCARLETT2_OP_OPEN, err, 0, 0, 0);
+  if (err >= 0)
+    scarlett2_session_set_name(*hwdep, alsa_name);
+
+  return err;
 }
 
 int scarlett2_get_protocol_version(snd_hwdep_t *hwdep) {
+  const struct scarlett2_session_event *ev = replay(
+    hwdep, SCARLETT2_OP_PVERSION
+  );
+  if (ev)
+    return ev->v[0];
+
+  int64_t start = scarlett2_session_now();
   int version = 0;
-  int err = snd_hwdep_ioctl(hwdep, SCARLETT2_IOCTL_PVERSION, &version);
+  int err = scarlett2_watchdog_call(
+    SCARLETT2_OP_PVERSION, snd_hwdep_name(hwdep), hwdep,
+    pversion_call, NULL, &version, sizeof(version)
+  );
 
   if (err < 0)
-    return err;
-  return version;
+    return record(start, hwdep, SCARLETT2_OP_PVERSION, err);
+  return record(start, hwdep, SCARLETT2_OP_PVERSION, version);
+}
+
+int scarlett2_get_fd(snd_hwdep_t *hwdep) {
+  struct pollfd pfd;
+
+  // replayed devices have no fd
+  if (scarlett2_session_replaying())
+    return -EINVAL;
+
+  if (snd_hwdep_poll_descriptors(hwdep, &pfd, 1) != 1)
+    return -EINVAL;
+  return pfd.fd;
+}
+
+// take an exclusive advisory lock on the hwdep device node so that
+// two processes can't operate on the same card at once; released by
+// scarlett2_unlock() or when the card is closed
+int scarlett2_lock(snd_hwdep_t *hwdep) {
+  const struct scarlett2_session_event *ev = replay(hwdep, SCARLETT2_OP_LOCK);
+  if (ev)
+    return ev->v[0];
+
+  int64_t start = scarlett2_session_now();
+  int fd = scarlett2_get_fd(hwdep);
+
+  if (fd < 0)
+    return record(start, hwdep, SCARLETT2_OP_LOCK, fd);
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+    return record(start, hwdep, SCARLETT2_OP_LOCK, -errno);
+  return record(start, hwdep, SCARLETT2_OP_LOCK, 0);
+}
+
+int scarlett2_unlock(snd_hwdep_t *hwdep) {
+  const struct scarlett2_session_event *ev = replay(
+    hwdep, SCARLETT2_OP_UNLOCK
+  );
+  if (ev)
+    return ev->v[0];
+
+  int64_t start = scarlett2_session_now();
+  int fd = scarlett2_get_fd(hwdep);
+
+  if (fd < 0)
+    return record(start, hwdep, SCARLETT2_OP_UNLOCK, fd);
+  if (flock(fd, LOCK_UN) < 0)
+    return record(start, hwdep, SCARLETT2_OP_UNLOCK, -errno);
+  return record(start, hwdep, SCARLETT2_OP_UNLOCK, 0);
 }
 
 int scarlett2_close(snd_hwdep_t *hwdep) {
-  return snd_hwdep_close(hwdep);
+  const struct scarlett2_session_event *ev = replay(hwdep, SCARLETT2_OP_CLOSE);
+  if (ev) {
+    scarlett2_session_free_handle(hwdep);
+    return ev->v[0];
+  }
+
+  int64_t start = scarlett2_session_now();
+  int fd = scarlett2_get_fd(hwdep);
+  int err = 0;
+
+  // if an abandoned call still has the device, release its lock now
+  // so that the card can be used again, and leave closing it to the
+  // call's helper thread
+  if (fd >= 0)
+    flock(fd, LOCK_UN);
+  if (!scarlett2_watchdog_close(hwdep, close_hwdep))
+    err = snd_hwdep_close(hwdep);
+
+  err = record(start, hwdep, SCARLETT2_OP_CLOSE, err);
+
+  scarlett2_session_clear_name(hwdep);
+  return err;
 }
 
 int scarlett2_reboot(snd_hwdep_t *hwdep) {
-  return snd_hwdep_ioctl(hwdep, SCARLETT2_IOCTL_REBOOT, 0);
-}
+  const struct scarlett2_session_event *ev = replay(
+    hwdep, SCARLETT2_OP_REBOOT
+  );
+  if (ev)
+    return ev->v[0];
 
-static int scarlett2_select_flash_segment(snd_hwdep_t *hwdep, int segment) {
-  return snd_hwdep_ioctl(hwdep, SCARLETT2_IOCTL_SELECT_FLASH_SEGMENT, &segment);
+  int64_t start = scarlett2_session_now();
+  return record(
+    start, hwdep, SCARLETT2_OP_REBOOT,
+    scarlett2_watchdog_call(
+      SCARLETT2_OP_REBOOT, snd_hwdep_name(hwdep), hwdep,
+      reboot_call, NULL, NULL, 0
+    )
+  );
 }
 
-static int scarlett2_erase_flash_segment(snd_hwdep_t *hwdep) {
-  return snd_hwdep_ioctl(hwdep, SCARLETT2_IOCTL_ERASE_FLASH_SEGMENT, 0);
+static int scarlett2_erase_segment(snd_hwdep_t *hwdep, int segment, int op) {
+  const struct scarlett2_session_event *ev = replay(hwdep, op);
+  if (ev)
+    return ev->v[0];
+
+  int64_t start = scarlett2_session_now();
+  int err = scarlett2_watchdog_call(
+    op, snd_hwdep_name(hwdep), hwdep,
+    select_segment_call, &segment, NULL, sizeof(segment)
+  );
+
+  if (err >= 0)
+    err = scarlett2_watchdog_call(
+      op, snd_hwdep_name(hwdep), hwdep,
+      erase_segment_call, NULL, NULL, 0
+    );
+  return record(start, hwdep, op, err);
 }
 
 int scarlett2_erase_config(snd_hwdep_t *hwdep) {
-  int err;
-
-  err = scarlett2_select_flash_segment(hwdep, SCARLETT2_SEGMENT_ID_SETTINGS);
-  if (err < 0)
-    return err;
-  return scarlett2_erase_flash_segment(hwdep);
+  return scarlett2_erase_segment(
+    hwdep, SCARLETT2_SEGMENT_ID_SETTINGS, SCARLETT2_OP_ERASE_CONFIG
+  );
 }
 
 int scarlett2_erase_firmware(snd_hwdep_t *hwdep) {
-  int err;
-
-  err = scarlett2_select_flash_segment(hwdep, SCARLETT2_SEGMENT_ID_FIRMWARE);
-  if (err < 0)
-    return err;
-  return scarlett2_erase_flash_segment(hwdep);
+  return scarlett2_erase_segment(
+    hwdep, SCARLETT2_SEGMENT_ID_FIRMWARE, SCARLETT2_OP_ERASE_FIRMWARE
+  );
 }
 
-int scarlett2_get_erase_progress(snd_hwdep_t *hwdep) {
+// num_blocks (if not NULL) is set to the segment size in blocks
+int scarlett2_get_erase_progress(snd_hwdep_t *hwdep, int *num_blocks) {
   struct scarlett2_flash_segment_erase_progress progress;
-
-  int err = snd_hwdep_ioctl(
-    hwdep, SCARLETT2_IOCTL_GET_ERASE_PROGRESS, &progress
+  const struct scarlett2_session_event *ev = replay(
+    hwdep, SCARLETT2_OP_ERASE_PROGRESS
   );
+  int err = 0;
+
+  if (ev) {
+    err = ev->v[0] < 0 ? ev->v[0] : 0;
+    progress.progress = ev->v[0];
+    progress.num_blocks = ev->v[1];
+  } else {
+    int64_t start = scarlett2_session_now();
+    err = scarlett2_watchdog_call(
+      SCARLETT2_OP_ERASE_PROGRESS, snd_hwdep_name(hwdep), hwdep,
+      erase_progress_call, NULL, &progress, sizeof(progress)
+    );
+
+    if (scarlett2_session_recording()) {
+      char name[32];
+
+      scarlett2_session_get_name(hwdep, name, sizeof(name));
+      scarlett2_session_record(
+        start, name, SCARLETT2_OP_ERASE_PROGRESS,
+        err < 0 ? err : progress.progress,
+        err < 0 ? 0 : progress.num_blocks,
+        0, 0
+      );
+    }
+  }
+
   if (err < 0)
     return err;
 
+  if (num_blocks)
+    *num_blocks = progress.num_blocks;
+
   // translate progress from [1..num_blocks, 255] to [[0..100), 255]]
   if (progress.num_blocks == 0 ||
       progress.progress == 0 ||
@@ -72,3 +279,116 @@ int scarlett2_get_erase_progress(snd_hwdep_t *hwdep) {
 
   return (progress.progress - 1) * 100 / progress.num_blocks;
 }
+
+// offset is where the driver is expected to be in the segment; it's
+// only used to check replays against the recording
+int scarlett2_write_firmware(
+  snd_hwdep_t *hwdep,
+  off_t offset,
+  unsigned char *buf,
+  size_t buf_len
+) {
+  char name[32];
+
+  if (scarlett2_session_replaying()) {
+    scarlett2_session_get_name(hwdep, name, sizeof(name));
+    return scarlett2_session_replay(
+      name, SCARLETT2_OP_WRITE, offset, buf_len
+    )->v[0];
+  }
+
+  int64_t start = scarlett2_session_now();
+  int err = scarlett2_watchdog_call(
+    SCARLETT2_OP_WRITE, snd_hwdep_name(hwdep), hwdep,
+    write_call, buf, NULL, buf_len
+  );
+
+  if (scarlett2_session_recording()) {
+    scarlett2_session_get_name(hwdep, name, sizeof(name));
+    scarlett2_session_record(
+      start, name, SCARLETT2_OP_WRITE, err, offset, buf_len, 0
+    );
+  }
+
+  return err;
+}
+
+int scarlett2_ctl_open(const char *alsa_name, snd_ctl_t **ctl) {
+  const struct scarlett2_session_event *ev = scarlett2_session_replay(
+    alsa_name, SCARLETT2_OP_CTL_OPEN, 0, 0
+  );
+  if (ev) {
+    *ctl = NULL;
+    if (ev->v[0] < 0)
+      return ev->v[0];
+    *ctl = scarlett2_session_new_handle(alsa_name);
+    return *ctl ? 0 : -ENOMEM;
+  }
+
+  int64_t start = scarlett2_session_now();
+  int err = snd_ctl_open(ctl, alsa_name, 0);
+
+  scarlett2_session_record(
+    start, alsa_name, SCARLETT2_OP_CTL_OPEN, err, 0, 0, 0
+  );
+  if (err >= 0)
+    scarlett2_session_set_name(*ctl, alsa_name);
+
+  return err;
+}
+
+int scarlett2_ctl_close(snd_ctl_t *ctl) {
+  const struct scarlett2_session_event *ev = replay(
+    ctl, SCARLETT2_OP_CTL_CLOSE
+  );
+  if (ev) {
+    scarlett2_session_free_handle(ctl);
+    return ev->v[0];
+  }
+
+  int64_t start = scarlett2_session_now();
+  int err = 0;
+
+  if (!scarlett2_watchdog_close(ctl, close_ctl))
+    err = snd_ctl_close(ctl);
+
+  err = record(start, ctl, SCARLETT2_OP_CTL_CLOSE, err);
+
+  scarlett2_session_clear_name(ctl);
+  return err;
+}
+
+int scarlett2_ctl_get_firmware_version(snd_ctl_t *ctl) {
+  const struct scarlett2_session_event *ev = replay(
+    ctl, SCARLETT2_OP_CTL_FIRMWARE_VERSION
+  );
+  if (ev)
+    return ev->v[0];
+
+  int64_t start = scarlett2_session_now();
+  int err;
+  snd_ctl_elem_id_t* id;
+  snd_ctl_elem_value_t* control;
+
+  snd_ctl_elem_id_alloca(&id);
+  snd_ctl_elem_value_alloca(&control);
+
+  // Set the control we're interested in
+  snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_CARD);
+  snd_ctl_elem_id_set_name(id, "Firmware Version");
+
+  snd_ctl_elem_value_set_id(control, id);
+
+  // Read the control value
+  err = scarlett2_watchdog_call(
+    SCARLETT2_OP_CTL_FIRMWARE_VERSION, snd_ctl_name(ctl), ctl,
+    ctl_read_call, control, control, snd_ctl_elem_value_sizeof()
+  );
+  if (err < 0)
+    return record(start, ctl, SCARLETT2_OP_CTL_FIRMWARE_VERSION, err);
+
+  return record(
+    start, ctl, SCARLETT2_OP_CTL_FIRMWARE_VERSION,
+    snd_ctl_elem_value_get_integer(control, 0)
+  );
+}
@@ -4,7 +4,10 @@
 #ifndef SCARLETT2_IOCTLS_H
 #define SCARLETT2_IOCTLS_H
 
-#include <alsa/hwdep.h>
+#include <alsa/asoundlib.h>
+
+// All device access goes through these so that it can be recorded
+// and replayed (see scarlett2-session.h)
 
 int scarlett2_open_card(char *alsa_name, snd_hwdep_t **hwdep);
 int scarlett2_get_protocol_version(snd_hwdep_t *hwdep);
@@ -12,10 +15,13 @@ int scarlett2_lock(snd_hwdep_t *hwdep);
 int scarlett2_unlock(snd_hwdep_t *hwdep);
 int scarlett2_close(snd_hwdep_t *hwdep);
 
+// The hwdep file descriptor, for poll(); not recorded
+int scarlett2_get_fd(snd_hwdep_t *hwdep);
+
 int scarlett2_reboot(snd_hwdep_t *hwdep);
 int scarlett2_erase_config(snd_hwdep_t *hwdep);
 int scarlett2_erase_firmware(snd_hwdep_t *hwdep);
-int scarlett2_get_erase_progress(snd_hwdep_t *hwdep);
+int scarlett2_get_erase_progress(snd_hwdep_t *hwdep, int *num_blocks);
 int scarlett2_write_firmware(
   snd_hwdep_t *hwdep,
   off_t offset,
@@ -23,4 +29,8 @@ int scarlett2_write_firmware(
   size_t buf_len
 );
 
+int scarlett2_ctl_open(const char *alsa_name, snd_ctl_t **ctl);
+int scarlett2_ctl_close(snd_ctl_t *ctl);
+int scarlett2_ctl_get_firmware_version(snd_ctl_t *ctl);
+
 #endif // SCARLETT2_IOCTLS_H
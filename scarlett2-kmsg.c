@@ -0,0 +1,182 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Kernel log lines in the timeline
+//
+// While the timeline is enabled, a thread follows /dev/kmsg and adds
+// the lines from the USB audio driver, or about a watched USB device
+// (resets, disconnects, driver warnings), to the timeline, so they
+// appear next to the erase and write phases they interrupted.
+//
+// Each /dev/kmsg record is "pri,seq,timestamp,flags;message\n"
+// followed by " KEY=value" lines. The timestamp is in microseconds
+// of the kernel's local clock, which like CLOCK_MONOTONIC counts from
+// boot and stops during suspend, so it's used as a scarlett2_now_us()
+// time as it is; the two differ by much less than a USB transfer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "scarlett2-kmsg.h"
+#include "scarlett2-stats.h"
+#include "scarlett2-timeline.h"
+
+#define KMSG_FILE "/dev/kmsg"
+
+// how often the thread checks whether it's been stopped
+#define KMSG_POLL_MS 100
+
+#define MAX_WATCHED 32
+
+// lines from the driver are kept whichever device they're about
+static const char *driver_patterns[] = {
+  "snd-usb-audio",
+  "snd_usb_audio",
+  "usb_audio",
+  "scarlett2",
+  "Focusrite",
+  NULL
+};
+
+static pthread_mutex_t kmsg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t kmsg_thread;
+static int kmsg_fd = -1;
+static volatile int kmsg_stopping;
+
+// " <usb path>:", as in "usb 1-2: reset high-speed USB device" and
+// "snd-usb-audio 1-2:1.0: ..."
+static char watched[MAX_WATCHED][40];
+static int watched_count;
+
+static int is_wanted(const char *msg) {
+  for (int i = 0; driver_patterns[i]; i++)
+    if (strstr(msg, driver_patterns[i]))
+      return 1;
+
+  int found = 0;
+
+  pthread_mutex_lock(&kmsg_lock);
+  for (int i = 0; i < watched_count && !found; i++)
+    found = strstr(msg, watched[i]) != NULL;
+  pthread_mutex_unlock(&kmsg_lock);
+
+  return found;
+}
+
+static void add_record(char *record) {
+  unsigned long long ts_us;
+  char *msg = strchr(record, ';');
+
+  if (!msg || sscanf(record, "%*u,%*u,%llu", &ts_us) != 1)
+    return;
+  msg++;
+
+  // drop the " KEY=value" lines
+  msg[strcspn(msg, "\n")] = '\0';
+
+  if (!is_wanted(msg))
+    return;
+
+  char what[128];
+  snprintf(what, sizeof(what), "kernel: %s", msg);
+  scarlett2_timeline_add("kmsg", what, ts_us, ts_us);
+}
+
+// read the records available now; returns -1 on a read error other
+// than running out of records
+static int read_records(void) {
+  char record[2048];
+
+  for (;;) {
+    ssize_t len = read(kmsg_fd, record, sizeof(record) - 1);
+
+    if (len < 0) {
+      if (errno == EAGAIN)
+        return 0;
+
+      // records were overwritten before they were read
+      if (errno == EPIPE)
+        continue;
+
+      return -1;
+    }
+
+    record[len] = '\0';
+    add_record(record);
+  }
+}
+
+static void *kmsg_thread_fn(void *arg) {
+  struct pollfd pfd = { .fd = kmsg_fd, .events = POLLIN };
+
+  while (!kmsg_stopping) {
+    if (poll(&pfd, 1, KMSG_POLL_MS) > 0 && read_records() < 0)
+      break;
+  }
+
+  return NULL;
+}
+
+void scarlett2_kmsg_start(void) {
+  kmsg_fd = open(KMSG_FILE, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (kmsg_fd < 0) {
+    char what[80];
+    double now = scarlett2_now_us();
+
+    snprintf(
+      what, sizeof(what), "kernel log unavailable: %s", strerror(errno)
+    );
+    scarlett2_timeline_add("kmsg", what, now, now);
+    return;
+  }
+
+  // only what's logged from now on
+  lseek(kmsg_fd, 0, SEEK_END);
+
+  int err = pthread_create(&kmsg_thread, NULL, kmsg_thread_fn, NULL);
+  if (err) {
+    fprintf(stderr, "Unable to follow the kernel log: %s\n", strerror(err));
+    close(kmsg_fd);
+    kmsg_fd = -1;
+  }
+}
+
+void scarlett2_kmsg_watch(const char *usb_path) {
+  char pattern[sizeof(*watched)];
+
+  if (!*usb_path)
+    return;
+
+  snprintf(pattern, sizeof(pattern), " %s:", usb_path);
+
+  pthread_mutex_lock(&kmsg_lock);
+
+  int found = 0;
+  for (int i = 0; i < watched_count && !found; i++)
+    found = !strcmp(watched[i], pattern);
+
+  if (!found && watched_count < MAX_WATCHED)
+    strcpy(watched[watched_count++], pattern);
+
+  pthread_mutex_unlock(&kmsg_lock);
+}
+
+void scarlett2_kmsg_stop(void) {
+  if (kmsg_fd < 0)
+    return;
+
+  kmsg_stopping = 1;
+  pthread_join(kmsg_thread, NULL);
+
+  // anything logged since the thread last looked
+  read_records();
+
+  close(kmsg_fd);
+  kmsg_fd = -1;
+}
@@ -0,0 +1,19 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_KMSG_H
+#define SCARLETT2_KMSG_H
+
+// Start following the kernel log from now on; only called when the
+// timeline is enabled. If /dev/kmsg can't be read, the timeline says
+// so.
+void scarlett2_kmsg_start(void);
+
+// Also keep kernel log lines which mention the USB device at path
+// (e.g. "1-2"); lines from the USB audio driver are always kept
+void scarlett2_kmsg_watch(const char *usb_path);
+
+// Stop following, and add the lines kept to the timeline
+void scarlett2_kmsg_stop(void);
+
+#endif // SCARLETT2_KMSG_H
@@ -0,0 +1,340 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Fleet policy file parser
+//
+// One rule per line; blank lines and lines starting with '#' are
+// ignored:
+//
+//   serial <USB serial number> <target>
+//   path   <USB path, e.g. 1-2.3>  <target>
+//   pid    <USB PID in hex>        <target>
+//
+// where <target> is one of:
+//
+//   latest      newest firmware in the catalogue
+//   <version>   exactly this firmware version (may downgrade)
+//   min <N>     at least version N; updates to latest if older
+//
+// When more than one rule matches a device, serial beats path beats
+// pid.
+//
+// Lines of the form:
+//
+//   keep-config <USB PID in hex> <min version> <max version>
+//
+// say that the product's settings layout doesn't change between
+// those firmware versions (inclusive), so update --keep-config may
+// update it without resetting its configuration.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "scarlett2-policy.h"
+
+static const char *match_names[SCARLETT2_POLICY_MATCH_COUNT] = {
+  [SCARLETT2_POLICY_MATCH_SERIAL] = "serial",
+  [SCARLETT2_POLICY_MATCH_PATH]   = "path",
+  [SCARLETT2_POLICY_MATCH_PID]    = "pid"
+};
+
+const char *scarlett2_policy_match_name(enum scarlett2_policy_match match) {
+  return match_names[match];
+}
+
+static int parse_version(const char *s, int *version) {
+  char *endptr;
+
+  errno = 0;
+  long v = strtol(s, &endptr, 10);
+  if (errno != 0 || *endptr != '\0' || v <= 0 || v > 0x7fffffff)
+    return -1;
+
+  *version = v;
+  return 0;
+}
+
+static int parse_rule(char *line, struct scarlett2_policy_rule *rule) {
+  char *saveptr;
+  char *match = strtok_r(line, " \t\r\n", &saveptr);
+  char *value = strtok_r(NULL, " \t\r\n", &saveptr);
+  char *target = strtok_r(NULL, " \t\r\n", &saveptr);
+  char *version = strtok_r(NULL, " \t\r\n", &saveptr);
+
+  if (!match || !value || !target) {
+    fprintf(stderr, "expected <match> <value> <target>\n");
+    return -1;
+  }
+
+  // match type
+  int i;
+  for (i = 0; i < SCARLETT2_POLICY_MATCH_COUNT; i++)
+    if (!strcmp(match, match_names[i]))
+      break;
+  if (i == SCARLETT2_POLICY_MATCH_COUNT) {
+    fprintf(stderr, "unknown match type '%s'\n", match);
+    return -1;
+  }
+  rule->match = i;
+
+  // value
+  if (strlen(value) >= sizeof(rule->value)) {
+    fprintf(stderr, "value '%s' too long\n", value);
+    return -1;
+  }
+  strcpy(rule->value, value);
+
+  if (rule->match == SCARLETT2_POLICY_MATCH_PID) {
+    char *endptr;
+    errno = 0;
+    rule->pid = strtol(value, &endptr, 16);
+    if (errno != 0 || *endptr != '\0' || rule->pid <= 0 ||
+        rule->pid > 0xffff) {
+      fprintf(stderr, "invalid PID '%s'\n", value);
+      return -1;
+    }
+  }
+
+  // target
+  if (!strcmp(target, "latest")) {
+    rule->target = SCARLETT2_POLICY_TARGET_LATEST;
+  } else if (!strcmp(target, "min")) {
+    rule->target = SCARLETT2_POLICY_TARGET_MIN;
+    if (!version || parse_version(version, &rule->version) < 0) {
+      fprintf(stderr, "'min' requires a firmware version number\n");
+      return -1;
+    }
+    version = strtok_r(NULL, " \t\r\n", &saveptr);
+  } else if (parse_version(target, &rule->version) == 0) {
+    rule->target = SCARLETT2_POLICY_TARGET_PIN;
+  } else {
+    fprintf(stderr, "invalid target '%s'\n", target);
+    return -1;
+  }
+
+  if (version) {
+    fprintf(stderr, "unexpected '%s'\n", version);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int parse_keep_config_rule(
+  char                              *line,
+  struct scarlett2_keep_config_rule *rule
+) {
+  char *saveptr;
+  char *pid, *min, *max, *extra, *endptr;
+
+  strtok_r(line, " \t\r\n", &saveptr);
+  pid = strtok_r(NULL, " \t\r\n", &saveptr);
+  min = strtok_r(NULL, " \t\r\n", &saveptr);
+  max = strtok_r(NULL, " \t\r\n", &saveptr);
+  extra = strtok_r(NULL, " \t\r\n", &saveptr);
+
+  if (!pid || !min || !max) {
+    fprintf(
+      stderr, "expected keep-config <pid> <min version> <max version>\n"
+    );
+    return -1;
+  }
+
+  errno = 0;
+  rule->pid = strtol(pid, &endptr, 16);
+  if (errno != 0 || *endptr != '\0' || rule->pid <= 0 ||
+      rule->pid > 0xffff) {
+    fprintf(stderr, "invalid PID '%s'\n", pid);
+    return -1;
+  }
+
+  if (parse_version(min, &rule->min_version) < 0 ||
+      parse_version(max, &rule->max_version) < 0 ||
+      rule->min_version > rule->max_version) {
+    fprintf(stderr, "invalid version range '%s %s'\n", min, max);
+    return -1;
+  }
+
+  if (extra) {
+    fprintf(stderr, "unexpected '%s'\n", extra);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int add_keep_config_rule(
+  struct scarlett2_policy           *policy,
+  struct scarlett2_keep_config_rule *rule
+) {
+  struct scarlett2_keep_config_rule *rules = realloc(
+    policy->keep_config, sizeof(*rules) * (policy->keep_config_count + 1)
+  );
+  if (!rules) {
+    perror("realloc");
+    return -1;
+  }
+  policy->keep_config = rules;
+  policy->keep_config[policy->keep_config_count++] = *rule;
+
+  return 0;
+}
+
+static int is_duplicate(
+  struct scarlett2_policy      *policy,
+  struct scarlett2_policy_rule *rule
+) {
+  for (int i = 0; i < policy->count; i++) {
+    struct scarlett2_policy_rule *r = &policy->rules[i];
+
+    if (r->match != rule->match)
+      continue;
+    if (rule->match == SCARLETT2_POLICY_MATCH_PID ?
+          r->pid == rule->pid :
+          !strcmp(r->value, rule->value))
+      return r->line;
+  }
+
+  return 0;
+}
+
+struct scarlett2_policy *scarlett2_read_policy(const char *fn) {
+  FILE *file = fopen(fn, "r");
+  if (!file) {
+    perror("fopen");
+    fprintf(stderr, "Unable to open policy file %s\n", fn);
+    return NULL;
+  }
+
+  struct scarlett2_policy *policy = calloc(1, sizeof(*policy));
+  if (!policy) {
+    perror("calloc");
+    goto error;
+  }
+
+  char buf[256];
+  int line = 0;
+
+  while (fgets(buf, sizeof(buf), file)) {
+    line++;
+
+    char *p = buf + strspn(buf, " \t\r\n");
+    if (!*p || *p == '#')
+      continue;
+
+    if (!strncmp(p, "keep-config", 11) && strchr(" \t", p[11])) {
+      struct scarlett2_keep_config_rule rule = { .line = line };
+
+      if (parse_keep_config_rule(p, &rule) < 0) {
+        fprintf(stderr, "Error in policy file %s line %d\n", fn, line);
+        goto error;
+      }
+      if (add_keep_config_rule(policy, &rule) < 0)
+        goto error;
+      continue;
+    }
+
+    struct scarlett2_policy_rule rule = { .line = line };
+
+    if (parse_rule(p, &rule) < 0) {
+      fprintf(stderr, "Error in policy file %s line %d\n", fn, line);
+      goto error;
+    }
+
+    int prev_line = is_duplicate(policy, &rule);
+    if (prev_line) {
+      fprintf(
+        stderr,
+        "Error in policy file %s line %d: duplicate of line %d\n",
+        fn, line, prev_line
+      );
+      goto error;
+    }
+
+    struct scarlett2_policy_rule *rules = realloc(
+      policy->rules, sizeof(*rules) * (policy->count + 1)
+    );
+    if (!rules) {
+      perror("realloc");
+      goto error;
+    }
+    policy->rules = rules;
+    policy->rules[policy->count++] = rule;
+  }
+
+  if (ferror(file)) {
+    perror("Failed to read policy file");
+    goto error;
+  }
+
+  fclose(file);
+  return policy;
+
+error:
+  scarlett2_free_policy(policy);
+  fclose(file);
+  return NULL;
+}
+
+void scarlett2_free_policy(struct scarlett2_policy *policy) {
+  if (policy) {
+    free(policy->rules);
+    free(policy->keep_config);
+    free(policy);
+  }
+}
+
+struct scarlett2_policy_rule *scarlett2_policy_lookup(
+  struct scarlett2_policy *policy,
+  const char              *serial,
+  const char              *usb_path,
+  int                      pid
+) {
+  struct scarlett2_policy_rule *best = NULL;
+
+  for (int i = 0; i < policy->count; i++) {
+    struct scarlett2_policy_rule *rule = &policy->rules[i];
+    int matched = 0;
+
+    switch (rule->match) {
+      case SCARLETT2_POLICY_MATCH_SERIAL:
+        matched = *serial && !strcmp(rule->value, serial);
+        break;
+      case SCARLETT2_POLICY_MATCH_PATH:
+        matched = *usb_path && !strcmp(rule->value, usb_path);
+        break;
+      case SCARLETT2_POLICY_MATCH_PID:
+        matched = rule->pid == pid;
+        break;
+      default:
+        break;
+    }
+
+    if (matched && (!best || rule->match < best->match))
+      best = rule;
+  }
+
+  return best;
+}
+
+int scarlett2_policy_keep_config(
+  struct scarlett2_policy *policy,
+  int                      pid,
+  int                      from_version,
+  int                      to_version
+) {
+  for (int i = 0; i < policy->keep_config_count; i++) {
+    struct scarlett2_keep_config_rule *rule = &policy->keep_config[i];
+
+    if (rule->pid == pid &&
+        from_version >= rule->min_version &&
+        from_version <= rule->max_version &&
+        to_version >= rule->min_version &&
+        to_version <= rule->max_version)
+      return 1;
+  }
+
+  return 0;
+}
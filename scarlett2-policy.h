@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_POLICY_H
+#define SCARLETT2_POLICY_H
+
+// How a policy rule selects a device; in order of precedence
+enum scarlett2_policy_match {
+  SCARLETT2_POLICY_MATCH_SERIAL,
+  SCARLETT2_POLICY_MATCH_PATH,
+  SCARLETT2_POLICY_MATCH_PID,
+  SCARLETT2_POLICY_MATCH_COUNT
+};
+
+// What firmware a policy rule wants on the device
+enum scarlett2_policy_target {
+  SCARLETT2_POLICY_TARGET_LATEST,
+  SCARLETT2_POLICY_TARGET_PIN,
+  SCARLETT2_POLICY_TARGET_MIN
+};
+
+#define SCARLETT2_POLICY_VALUE_SIZE 64
+
+struct scarlett2_policy_rule {
+  enum scarlett2_policy_match  match;
+  char                         value[SCARLETT2_POLICY_VALUE_SIZE];
+  int                          pid;
+  enum scarlett2_policy_target target;
+  int                          version;
+  int                          line;
+};
+
+// Firmware versions between which a product's settings layout is
+// unchanged, so it can be updated without resetting its configuration
+struct scarlett2_keep_config_rule {
+  int pid;
+  int min_version;
+  int max_version;
+  int line;
+};
+
+struct scarlett2_policy {
+  struct scarlett2_policy_rule      *rules;
+  int                                count;
+  struct scarlett2_keep_config_rule *keep_config;
+  int                                keep_config_count;
+};
+
+struct scarlett2_policy *scarlett2_read_policy(const char *fn);
+
+void scarlett2_free_policy(struct scarlett2_policy *policy);
+
+struct scarlett2_policy_rule *scarlett2_policy_lookup(
+  struct scarlett2_policy *policy,
+  const char              *serial,
+  const char              *usb_path,
+  int                      pid
+);
+
+// Returns 1 if a keep-config rule covers updating a device with this
+// PID from one firmware version to the other
+int scarlett2_policy_keep_config(
+  struct scarlett2_policy *policy,
+  int                      pid,
+  int                      from_version,
+  int                      to_version
+);
+
+const char *scarlett2_policy_match_name(enum scarlett2_policy_match match);
+
+#endif // SCARLETT2_POLICY_H
@@ -0,0 +1,262 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Device profile file
+//
+// One profile per line, as space-separated key=value pairs; unknown
+// keys are ignored, blank lines and lines starting with '#' are
+// skipped:
+//
+//   pid=8211 firmware=1605 cycles=3 settings-blocks=1 ...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "scarlett2-profile.h"
+
+#define FIELD_INT(name, member) \
+  { name, offsetof(struct scarlett2_profile, member), 0 }
+#define FIELD_DOUBLE(name, member) \
+  { name, offsetof(struct scarlett2_profile, member), 1 }
+
+static const struct profile_field {
+  const char *name;
+  size_t      offset;
+  int         is_double;
+} fields[] = {
+  FIELD_INT("pid", pid),
+  FIELD_INT("firmware", firmware_version),
+  FIELD_INT("cycles", cycles),
+  FIELD_INT("settings-blocks", settings_blocks),
+  FIELD_DOUBLE("settings-erase-block-ms", settings_erase_block_ms),
+  FIELD_INT("firmware-blocks", firmware_blocks),
+  FIELD_DOUBLE("firmware-erase-block-ms", firmware_erase_block_ms),
+  FIELD_DOUBLE("write-bytes-per-sec", write_bytes_per_sec),
+  FIELD_DOUBLE("write-p50-ms", write_p50_ms),
+  FIELD_DOUBLE("write-p99-ms", write_p99_ms),
+  FIELD_DOUBLE("write-max-ms", write_max_ms),
+  FIELD_DOUBLE("reboot-ms", reboot_ms),
+  { NULL }
+};
+
+static int parse_field(struct scarlett2_profile *profile, char *token) {
+  char *eq = strchr(token, '=');
+
+  if (!eq)
+    return -1;
+  *eq = 0;
+
+  for (const struct profile_field *f = fields; f->name; f++) {
+    if (strcmp(f->name, token))
+      continue;
+
+    char *endptr;
+    void *p = (char *)profile + f->offset;
+
+    errno = 0;
+    if (f->is_double)
+      *(double *)p = strtod(eq + 1, &endptr);
+    else
+      *(int *)p = strtol(
+        eq + 1, &endptr, strcmp(f->name, "pid") ? 10 : 16
+      );
+
+    if (errno || *endptr || endptr == eq + 1)
+      return -1;
+    return 0;
+  }
+
+  // unknown key; ignore for forward compatibility
+  return 0;
+}
+
+struct scarlett2_profiles *scarlett2_read_profiles(const char *fn) {
+  struct scarlett2_profiles *profiles = calloc(1, sizeof(*profiles));
+  if (!profiles) {
+    perror("calloc");
+    return NULL;
+  }
+
+  FILE *file = fopen(fn, "r");
+  if (!file) {
+    if (errno == ENOENT)
+      return profiles;
+    perror("fopen");
+    fprintf(stderr, "Unable to open profile file %s\n", fn);
+    free(profiles);
+    return NULL;
+  }
+
+  char buf[1024];
+  int line = 0;
+
+  while (fgets(buf, sizeof(buf), file)) {
+    line++;
+
+    char *p = buf + strspn(buf, " \t\r\n");
+    if (!*p || *p == '#')
+      continue;
+
+    struct scarlett2_profile profile = { 0 };
+    char *saveptr;
+
+    for (char *token = strtok_r(p, " \t\r\n", &saveptr);
+         token;
+         token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+      if (parse_field(&profile, token) < 0) {
+        fprintf(
+          stderr,
+          "Error in profile file %s line %d: invalid '%s'\n",
+          fn, line, token
+        );
+        goto error;
+      }
+    }
+
+    if (!profile.pid || !profile.firmware_version) {
+      fprintf(
+        stderr,
+        "Error in profile file %s line %d: missing pid or firmware\n",
+        fn, line
+      );
+      goto error;
+    }
+
+    if (scarlett2_set_profile(profiles, &profile) < 0)
+      goto error;
+  }
+
+  fclose(file);
+  return profiles;
+
+error:
+  fclose(file);
+  scarlett2_free_profiles(profiles);
+  return NULL;
+}
+
+int scarlett2_write_profiles(
+  const char                *fn,
+  struct scarlett2_profiles *profiles
+) {
+  char tmp_fn[strlen(fn) + 5];
+
+  // write to a temporary file and rename so readers never see a
+  // partial file
+  snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", fn);
+
+  FILE *file = fopen(tmp_fn, "w");
+  if (!file) {
+    perror("fopen");
+    fprintf(stderr, "Unable to create profile file %s\n", tmp_fn);
+    return -1;
+  }
+
+  fprintf(file, "# scarlett2 device profiles; written by characterize\n");
+
+  for (int i = 0; i < profiles->count; i++) {
+    struct scarlett2_profile *profile = &profiles->profiles[i];
+
+    for (const struct profile_field *f = fields; f->name; f++) {
+      void *p = (char *)profile + f->offset;
+
+      fprintf(file, f == fields ? "%s=" : " %s=", f->name);
+      if (f->is_double)
+        fprintf(file, "%.3f", *(double *)p);
+      else if (!strcmp(f->name, "pid"))
+        fprintf(file, "%04x", *(int *)p);
+      else
+        fprintf(file, "%d", *(int *)p);
+    }
+    fprintf(file, "\n");
+  }
+
+  if (fclose(file)) {
+    perror("Failed to write profile file");
+    remove(tmp_fn);
+    return -1;
+  }
+
+  if (rename(tmp_fn, fn) < 0) {
+    perror("rename");
+    fprintf(stderr, "Unable to replace profile file %s\n", fn);
+    remove(tmp_fn);
+    return -1;
+  }
+
+  return 0;
+}
+
+void scarlett2_free_profiles(struct scarlett2_profiles *profiles) {
+  if (profiles) {
+    free(profiles->profiles);
+    free(profiles);
+  }
+}
+
+int scarlett2_set_profile(
+  struct scarlett2_profiles *profiles,
+  struct scarlett2_profile  *profile
+) {
+  for (int i = 0; i < profiles->count; i++) {
+    struct scarlett2_profile *p = &profiles->profiles[i];
+
+    if (p->pid == profile->pid &&
+        p->firmware_version == profile->firmware_version) {
+      *p = *profile;
+      return 0;
+    }
+  }
+
+  struct scarlett2_profile *p = realloc(
+    profiles->profiles, sizeof(*p) * (profiles->count + 1)
+  );
+  if (!p) {
+    perror("realloc");
+    return -1;
+  }
+
+  profiles->profiles = p;
+  profiles->profiles[profiles->count++] = *profile;
+  return 0;
+}
+
+struct scarlett2_profile *scarlett2_get_profile(
+  struct scarlett2_profiles *profiles,
+  int                        pid,
+  int                        firmware_version
+) {
+  struct scarlett2_profile *best = NULL;
+
+  if (!profiles)
+    return NULL;
+
+  for (int i = 0; i < profiles->count; i++) {
+    struct scarlett2_profile *p = &profiles->profiles[i];
+
+    if (p->pid != pid)
+      continue;
+    if (p->firmware_version == firmware_version)
+      return p;
+    if (!best || p->firmware_version > best->firmware_version)
+      best = p;
+  }
+
+  return best;
+}
+
+double scarlett2_profile_estimate_ms(
+  struct scarlett2_profile *profile,
+  size_t                    firmware_length
+) {
+  double ms = profile->settings_blocks * profile->settings_erase_block_ms +
+              profile->firmware_blocks * profile->firmware_erase_block_ms +
+              profile->reboot_ms;
+
+  if (profile->write_bytes_per_sec > 0)
+    ms += firmware_length * 1000.0 / profile->write_bytes_per_sec;
+
+  return ms;
+}
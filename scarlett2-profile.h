@@ -0,0 +1,62 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_PROFILE_H
+#define SCARLETT2_PROFILE_H
+
+#include <stddef.h>
+
+// Measured performance of one model running one firmware version,
+// as produced by the characterize command
+struct scarlett2_profile {
+  int    pid;
+  int    firmware_version;
+  int    cycles;
+  int    settings_blocks;
+  double settings_erase_block_ms;
+  int    firmware_blocks;
+  double firmware_erase_block_ms;
+  double write_bytes_per_sec;
+  double write_p50_ms;
+  double write_p99_ms;
+  double write_max_ms;
+  double reboot_ms;
+};
+
+struct scarlett2_profiles {
+  struct scarlett2_profile *profiles;
+  int                       count;
+};
+
+// Returns an empty set if the file doesn't exist, NULL on error
+struct scarlett2_profiles *scarlett2_read_profiles(const char *fn);
+
+int scarlett2_write_profiles(
+  const char                *fn,
+  struct scarlett2_profiles *profiles
+);
+
+void scarlett2_free_profiles(struct scarlett2_profiles *profiles);
+
+// Add or replace the profile for profile->pid/firmware_version
+int scarlett2_set_profile(
+  struct scarlett2_profiles *profiles,
+  struct scarlett2_profile  *profile
+);
+
+// Find the profile for a PID running a firmware version, falling
+// back to the most recent profile for the PID
+struct scarlett2_profile *scarlett2_get_profile(
+  struct scarlett2_profiles *profiles,
+  int                        pid,
+  int                        firmware_version
+);
+
+// Estimated duration of a full update (settings erase, firmware
+// erase, write, reboot) in milliseconds
+double scarlett2_profile_estimate_ms(
+  struct scarlett2_profile *profile,
+  size_t                    firmware_length
+);
+
+#endif // SCARLETT2_PROFILE_H
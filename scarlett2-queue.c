@@ -0,0 +1,173 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Priority job queue
+//
+// Jobs are kept in one list in the order they were submitted; the
+// queue is tens of jobs at most, so picking the next one is a scan.
+// A job can't start while an earlier job on the same device is
+// unfinished, so the jobs on each device run in order.
+//
+// Jobs aren't stopped part-way through a phase; a running job offers
+// its slot at each safe boundary by calling scarlett2_queue_yield(),
+// so an interactive job waits for at most the rest of the current
+// phase of the jobs ahead of it.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "scarlett2-queue.h"
+
+void scarlett2_queue_init(struct scarlett2_queue *queue, int slots) {
+  memset(queue, 0, sizeof(*queue));
+  queue->slots = slots;
+  queue->next_id = 1;
+}
+
+int scarlett2_queue_add(
+  struct scarlett2_queue     *queue,
+  struct scarlett2_queue_job *job,
+  int                         priority,
+  const char                 *dev
+) {
+  struct scarlett2_queue_job **p = &queue->jobs;
+  int ahead = 0;
+
+  job->id = queue->next_id++;
+  job->priority = priority;
+  snprintf(job->dev, sizeof(job->dev), "%s", dev);
+  job->state = SCARLETT2_QUEUE_WAITING;
+  job->submit_us = scarlett2_now_us();
+  job->start_us = 0;
+  job->next = NULL;
+
+  for (; *p; p = &(*p)->next)
+    if ((*p)->priority >= priority ||
+        (*dev && !strcmp((*p)->dev, dev)))
+      ahead++;
+  *p = job;
+
+  queue->submitted++;
+
+  return ahead;
+}
+
+// is an earlier job on the same device unfinished?
+static int is_blocked(
+  struct scarlett2_queue     *queue,
+  struct scarlett2_queue_job *job
+) {
+  if (!*job->dev)
+    return 0;
+
+  for (struct scarlett2_queue_job *p = queue->jobs; p != job; p = p->next)
+    if (!strcmp(p->dev, job->dev))
+      return 1;
+
+  return 0;
+}
+
+// the waiting or parked job which should have the next free slot
+static struct scarlett2_queue_job *get_next(struct scarlett2_queue *queue) {
+  struct scarlett2_queue_job *best = NULL;
+
+  for (struct scarlett2_queue_job *job = queue->jobs; job; job = job->next) {
+    if (job->state != SCARLETT2_QUEUE_WAITING &&
+        job->state != SCARLETT2_QUEUE_PARKED)
+      continue;
+
+    if (best && job->priority <= best->priority)
+      continue;
+
+    if (!is_blocked(queue, job))
+      best = job;
+  }
+
+  return best;
+}
+
+struct scarlett2_queue_job *scarlett2_queue_start_next(
+  struct scarlett2_queue *queue
+) {
+  if (queue->running >= queue->slots)
+    return NULL;
+
+  struct scarlett2_queue_job *job = get_next(queue);
+  if (!job)
+    return NULL;
+
+  if (job->state == SCARLETT2_QUEUE_WAITING) {
+    job->start_us = scarlett2_now_us();
+    scarlett2_stats_add(
+      &queue->wait_us[job->priority < SCARLETT2_QUEUE_INTERACTIVE],
+      job->start_us - job->submit_us
+    );
+  }
+
+  job->state = SCARLETT2_QUEUE_RUNNING;
+  queue->running++;
+
+  return job;
+}
+
+int scarlett2_queue_yield(
+  struct scarlett2_queue     *queue,
+  struct scarlett2_queue_job *job
+) {
+  if (job->state != SCARLETT2_QUEUE_RUNNING ||
+      queue->running < queue->slots)
+    return 0;
+
+  struct scarlett2_queue_job *next = get_next(queue);
+  if (!next || next->priority <= job->priority)
+    return 0;
+
+  job->state = SCARLETT2_QUEUE_PARKED;
+  queue->running--;
+  queue->preempted++;
+
+  return next->id;
+}
+
+void scarlett2_queue_release(
+  struct scarlett2_queue     *queue,
+  struct scarlett2_queue_job *job
+) {
+  if (job->state != SCARLETT2_QUEUE_RUNNING)
+    return;
+
+  job->state = SCARLETT2_QUEUE_RELEASED;
+  queue->running--;
+}
+
+void scarlett2_queue_finish(
+  struct scarlett2_queue     *queue,
+  struct scarlett2_queue_job *job,
+  int                         result
+) {
+  struct scarlett2_queue_job **p = &queue->jobs;
+
+  while (*p && *p != job)
+    p = &(*p)->next;
+  if (!*p)
+    return;
+  *p = job->next;
+
+  if (job->state == SCARLETT2_QUEUE_RUNNING)
+    queue->running--;
+
+  if (result < 0)
+    queue->failed++;
+  else
+    queue->completed++;
+}
+
+int scarlett2_queue_count(struct scarlett2_queue *queue, int state) {
+  int count = 0;
+
+  for (struct scarlett2_queue_job *job = queue->jobs; job; job = job->next)
+    if (job->state == state)
+      count++;
+
+  return count;
+}
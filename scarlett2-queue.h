@@ -0,0 +1,99 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_QUEUE_H
+#define SCARLETT2_QUEUE_H
+
+#include "scarlett2-stats.h"
+
+// Jobs at or above this priority are interactive; below, bulk
+#define SCARLETT2_QUEUE_INTERACTIVE 10
+
+enum scarlett2_queue_state {
+  SCARLETT2_QUEUE_WAITING,  // not started yet
+  SCARLETT2_QUEUE_RUNNING,  // holding a slot
+  SCARLETT2_QUEUE_PARKED,   // yielded its slot at a phase boundary
+  SCARLETT2_QUEUE_RELEASED  // still running, but not needing a slot
+};
+
+// A job in the queue; embed it in a larger struct
+struct scarlett2_queue_job {
+  int    id;
+  int    priority;
+
+  // jobs on the same device run one at a time in the order they were
+  // submitted; "" for jobs which don't operate on a device
+  char   dev[64];
+
+  int    state;
+  double submit_us;
+  double start_us;
+
+  // private
+  struct scarlett2_queue_job *next;
+};
+
+// Jobs waiting for and running in a fixed number of slots: the
+// waiting job with the highest priority starts next (oldest first for
+// equal priorities), as long as no earlier job on its device is
+// unfinished
+struct scarlett2_queue {
+  struct scarlett2_queue_job *jobs;
+  int                         slots;
+  int                         running;
+  int                         next_id;
+
+  // metrics
+  int                         submitted;
+  int                         completed;
+  int                         failed;
+  int                         preempted;
+
+  // how long jobs waited to start, in microseconds; [0] for
+  // interactive and [1] for bulk jobs
+  struct scarlett2_stats      wait_us[2];
+};
+
+void scarlett2_queue_init(struct scarlett2_queue *queue, int slots);
+
+// Add a job; sets its id, and returns the number of jobs ahead of it
+int scarlett2_queue_add(
+  struct scarlett2_queue     *queue,
+  struct scarlett2_queue_job *job,
+  int                         priority,
+  const char                 *dev
+);
+
+// Take a slot for the next job to run, or return NULL if the slots
+// are full or no job can run. The job may be a parked one, to be
+// resumed.
+struct scarlett2_queue_job *scarlett2_queue_start_next(
+  struct scarlett2_queue *queue
+);
+
+// For running jobs at a safe boundary: if a job with a higher
+// priority is waiting for a slot, park this one and return the
+// waiting one's id; otherwise return 0
+int scarlett2_queue_yield(
+  struct scarlett2_queue     *queue,
+  struct scarlett2_queue_job *job
+);
+
+// Give up the slot of a running job which is only waiting (e.g. for
+// a reboot); it keeps its place ahead of later jobs on its device
+void scarlett2_queue_release(
+  struct scarlett2_queue     *queue,
+  struct scarlett2_queue_job *job
+);
+
+// Remove a finished job; result < 0 for failure
+void scarlett2_queue_finish(
+  struct scarlett2_queue     *queue,
+  struct scarlett2_queue_job *job,
+  int                         result
+);
+
+// Count the jobs in a state
+int scarlett2_queue_count(struct scarlett2_queue *queue, int state);
+
+#endif // SCARLETT2_QUEUE_H
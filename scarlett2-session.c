@@ -0,0 +1,644 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Device session recording and replay
+//
+// A session file records the command line, the cards found, and
+// every device operation with its result and timing:
+//
+//   # scarlett2 session 1
+//   arg update
+//   card num=1 pid=8211 firmware=1605 serial=Y8XXXXXX path=1-2
+//   event t=1203113 d=52210 dev=hw:1 op=write ret=1024 offset=0 size=1024
+//   end t=9823117012
+//
+// Times are in nanoseconds from the start of the session.
+//
+// On replay, each operation returns its recorded result after
+// taking as long as it did when recorded (or a fraction of that, with
+// a replay speed-up), so the host side runs unchanged against the
+// device's recorded behaviour. Each device's
+// operations must be requested in the recorded order, except for
+// erase progress: that is sampled, so the recorded sample returned
+// is the one current at the same time since the erase started,
+// however often it is polled.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "scarlett2-session.h"
+
+#define SESSION_VERSION 1
+
+enum session_mode {
+  SESSION_OFF,
+  SESSION_RECORD,
+  SESSION_REPLAY
+};
+
+// names of v[0..3] for each op; NULL if unused
+static const struct session_op {
+  const char *name;
+  const char *values[SCARLETT2_SESSION_VALUES];
+
+  // how many of v[1..] are request parameters to check on replay
+  int         inputs;
+
+  // sampled rather than replayed in order
+  int         polled;
+} ops[SCARLETT2_OP_COUNT] = {
+  [SCARLETT2_OP_OPEN]           = { "open",           { "ret" } },
+  [SCARLETT2_OP_CLOSE]          = { "close",          { "ret" } },
+  [SCARLETT2_OP_PVERSION]       = { "pversion",       { "ret" } },
+  [SCARLETT2_OP_LOCK]           = { "lock",           { "ret" } },
+  [SCARLETT2_OP_UNLOCK]         = { "unlock",         { "ret" } },
+  [SCARLETT2_OP_REBOOT]         = { "reboot",         { "ret" } },
+  [SCARLETT2_OP_ERASE_CONFIG]   = { "erase-config",   { "ret" } },
+  [SCARLETT2_OP_ERASE_FIRMWARE] = { "erase-firmware", { "ret" } },
+  [SCARLETT2_OP_ERASE_PROGRESS] = {
+    "erase-progress", { "ret", "blocks" }, 0, 1
+  },
+  [SCARLETT2_OP_WRITE] = {
+    "write", { "ret", "offset", "size" }, 2
+  },
+  [SCARLETT2_OP_CTL_OPEN]       = { "ctl-open",       { "ret" } },
+  [SCARLETT2_OP_CTL_CLOSE]      = { "ctl-close",      { "ret" } },
+  [SCARLETT2_OP_CTL_FIRMWARE_VERSION] = {
+    "ctl-firmware-version", { "ret" }
+  },
+  [SCARLETT2_OP_CAPS] = {
+    "caps", { "max-write", "progress", "poll-ms", "stall-ms" }
+  },
+  [SCARLETT2_OP_REBOOT_WAIT] = {
+    "reboot-wait", { "ret", "card", "firmware" }
+  }
+};
+
+// replay position for one device
+struct session_dev {
+  char    name[32];
+  int    *events;
+  int     count;
+  int     cursor;
+
+  // the event at cursor is a sample which has been returned
+  int     sampled;
+
+  // the end of the last in-order event, in recorded and replay time
+  int64_t rec_align;
+  int64_t replay_align;
+};
+
+struct session_handle {
+  void *handle;
+  char  name[32];
+};
+
+static enum session_mode mode;
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int suppressed;
+static int64_t start_ns;
+static int replay_speed = 1;
+
+static FILE *record_file;
+
+static struct scarlett2_session_event *events;
+static int events_count;
+static struct session_dev *devs;
+static int devs_count;
+static int64_t recorded_ns;
+
+static struct scarlett2_session_card *cards;
+static int cards_count;
+
+static struct session_handle *handles;
+static int handles_count;
+
+int64_t scarlett2_session_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+const char *scarlett2_session_op_name(int op) {
+  return ops[op].name;
+}
+
+int scarlett2_session_recording(void) {
+  return mode == SESSION_RECORD;
+}
+
+int scarlett2_session_replaying(void) {
+  return mode == SESSION_REPLAY;
+}
+
+void scarlett2_session_suppress(int suppress) {
+  suppressed = suppress;
+}
+
+int scarlett2_session_record_start(const char *fn, int argc, char **argv) {
+  record_file = fopen(fn, "w");
+  if (!record_file) {
+    perror("fopen");
+    fprintf(stderr, "Unable to create session file %s\n", fn);
+    return -1;
+  }
+
+  fprintf(record_file, "# scarlett2 session %d\n", SESSION_VERSION);
+  for (int i = 0; i < argc; i++)
+    fprintf(record_file, "arg %s\n", argv[i]);
+
+  start_ns = scarlett2_session_now();
+  mode = SESSION_RECORD;
+
+  return 0;
+}
+
+void scarlett2_session_record(
+  int64_t     start,
+  const char *dev,
+  int         op,
+  long        v0,
+  long        v1,
+  long        v2,
+  long        v3
+) {
+  if (mode != SESSION_RECORD || suppressed)
+    return;
+
+  long v[SCARLETT2_SESSION_VALUES] = { v0, v1, v2, v3 };
+  int64_t now = scarlett2_session_now();
+
+  pthread_mutex_lock(&session_lock);
+
+  fprintf(
+    record_file,
+    "event t=%lld d=%lld dev=%s op=%s",
+    (long long)(start - start_ns),
+    (long long)(now - start),
+    dev,
+    ops[op].name
+  );
+  for (int i = 0; i < SCARLETT2_SESSION_VALUES && ops[op].values[i]; i++)
+    fprintf(record_file, " %s=%ld", ops[op].values[i], v[i]);
+  fprintf(record_file, "\n");
+
+  pthread_mutex_unlock(&session_lock);
+}
+
+void scarlett2_session_add_card(struct scarlett2_session_card *card) {
+  if (mode != SESSION_RECORD)
+    return;
+
+  pthread_mutex_lock(&session_lock);
+  fprintf(
+    record_file,
+    "card num=%d pid=%04x firmware=%d serial=%s path=%s\n",
+    card->card_num,
+    card->pid,
+    card->firmware_version,
+    card->serial,
+    card->usb_path
+  );
+  pthread_mutex_unlock(&session_lock);
+}
+
+struct scarlett2_session_card *scarlett2_session_get_cards(int *count) {
+  *count = cards_count;
+  return cards;
+}
+
+static int find_op(const char *name) {
+  for (int i = 0; i < SCARLETT2_OP_COUNT; i++)
+    if (!strcmp(ops[i].name, name))
+      return i;
+  return -1;
+}
+
+// parse "key=value key=value ..." from line; calls fn for each
+static int parse_pairs(
+  char *line,
+  int (*fn)(void *obj, const char *key, const char *value),
+  void *obj
+) {
+  char *saveptr;
+
+  for (char *token = strtok_r(line, " \t\r\n", &saveptr);
+       token;
+       token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+    char *eq = strchr(token, '=');
+    if (!eq)
+      return -1;
+    *eq = 0;
+    if (fn(obj, token, eq + 1) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+static int parse_event_pair(void *obj, const char *key, const char *value) {
+  struct scarlett2_session_event *ev = obj;
+
+  if (!strcmp(key, "t")) {
+    ev->t = strtoll(value, NULL, 10);
+  } else if (!strcmp(key, "d")) {
+    ev->d = strtoll(value, NULL, 10);
+  } else if (!strcmp(key, "dev")) {
+    snprintf(ev->dev, sizeof(ev->dev), "%s", value);
+  } else if (!strcmp(key, "op")) {
+    ev->op = find_op(value);
+    if (ev->op < 0)
+      return -1;
+  } else if (ev->op >= 0) {
+    for (int i = 0; i < SCARLETT2_SESSION_VALUES; i++)
+      if (ops[ev->op].values[i] && !strcmp(ops[ev->op].values[i], key))
+        ev->v[i] = strtol(value, NULL, 10);
+  }
+
+  return 0;
+}
+
+static int parse_card_pair(void *obj, const char *key, const char *value) {
+  struct scarlett2_session_card *card = obj;
+
+  if (!strcmp(key, "num"))
+    card->card_num = atoi(value);
+  else if (!strcmp(key, "pid"))
+    card->pid = strtol(value, NULL, 16);
+  else if (!strcmp(key, "firmware"))
+    card->firmware_version = atoi(value);
+  else if (!strcmp(key, "serial"))
+    snprintf(card->serial, sizeof(card->serial), "%s", value);
+  else if (!strcmp(key, "path"))
+    snprintf(card->usb_path, sizeof(card->usb_path), "%s", value);
+
+  return 0;
+}
+
+static struct session_dev *get_dev(const char *name) {
+  for (int i = 0; i < devs_count; i++)
+    if (!strcmp(devs[i].name, name))
+      return &devs[i];
+  return NULL;
+}
+
+// index the events by device
+static int index_events(void) {
+  for (int i = 0; i < events_count; i++) {
+    struct session_dev *dev = get_dev(events[i].dev);
+
+    if (!dev) {
+      devs = realloc(devs, sizeof(*devs) * (devs_count + 1));
+      if (!devs)
+        return -1;
+      dev = &devs[devs_count++];
+      memset(dev, 0, sizeof(*dev));
+      strcpy(dev->name, events[i].dev);
+    }
+
+    int *p = realloc(dev->events, sizeof(*p) * (dev->count + 1));
+    if (!p)
+      return -1;
+    dev->events = p;
+    dev->events[dev->count++] = i;
+  }
+
+  return 0;
+}
+
+int scarlett2_session_replay_start(const char *fn, int *argc, char ***argv) {
+  FILE *f = fopen(fn, "r");
+  if (!f) {
+    perror("fopen");
+    fprintf(stderr, "Unable to open session file %s\n", fn);
+    return -1;
+  }
+
+  char buf[512];
+  int line = 0;
+  int version = 0;
+
+  *argc = 0;
+  *argv = NULL;
+
+  while (fgets(buf, sizeof(buf), f)) {
+    line++;
+
+    if (line == 1) {
+      if (sscanf(buf, "# scarlett2 session %d", &version) != 1 ||
+          version != SESSION_VERSION) {
+        fprintf(stderr, "%s is not a scarlett2 session file\n", fn);
+        goto error;
+      }
+      continue;
+    }
+
+    if (!strncmp(buf, "arg ", 4)) {
+      buf[strcspn(buf, "\n")] = 0;
+      char **p = realloc(*argv, sizeof(*p) * (*argc + 2));
+      if (!p)
+        goto nomem;
+      *argv = p;
+      if (!(p[(*argc)++] = strdup(buf + 4)))
+        goto nomem;
+      p[*argc] = NULL;
+
+    } else if (!strncmp(buf, "card ", 5)) {
+      struct scarlett2_session_card card = { 0 };
+
+      if (parse_pairs(buf + 5, parse_card_pair, &card) < 0)
+        goto parse_error;
+
+      struct scarlett2_session_card *p = realloc(
+        cards, sizeof(*p) * (cards_count + 1)
+      );
+      if (!p)
+        goto nomem;
+      cards = p;
+      cards[cards_count++] = card;
+
+    } else if (!strncmp(buf, "event ", 6)) {
+      struct scarlett2_session_event ev = { .op = -1 };
+
+      if (parse_pairs(buf + 6, parse_event_pair, &ev) < 0 ||
+          ev.op < 0 || !*ev.dev)
+        goto parse_error;
+
+      struct scarlett2_session_event *p = realloc(
+        events, sizeof(*p) * (events_count + 1)
+      );
+      if (!p)
+        goto nomem;
+      events = p;
+      events[events_count++] = ev;
+
+    } else if (!strncmp(buf, "end t=", 6)) {
+      recorded_ns = strtoll(buf + 6, NULL, 10);
+
+    } else if (*buf != '#' && *buf != '\n') {
+      goto parse_error;
+    }
+  }
+
+  if (ferror(f)) {
+    perror("Failed to read session file");
+    goto error;
+  }
+
+  if (!*argc) {
+    fprintf(stderr, "Session file %s has no command line\n", fn);
+    goto error;
+  }
+
+  if (index_events() < 0)
+    goto nomem;
+
+  fclose(f);
+
+  mode = SESSION_REPLAY;
+  scarlett2_session_replay_rewind();
+
+  return 0;
+
+nomem:
+  perror("realloc");
+  goto error;
+
+parse_error:
+  fprintf(stderr, "Error in session file %s line %d\n", fn, line);
+
+error:
+  fclose(f);
+  return -1;
+}
+
+void scarlett2_session_replay_rewind(void) {
+  pthread_mutex_lock(&session_lock);
+
+  start_ns = scarlett2_session_now();
+  for (int i = 0; i < devs_count; i++) {
+    devs[i].cursor = 0;
+    devs[i].sampled = 0;
+    devs[i].rec_align = 0;
+    devs[i].replay_align = start_ns;
+  }
+
+  pthread_mutex_unlock(&session_lock);
+}
+
+void scarlett2_session_set_replay_speed(int speed) {
+  replay_speed = speed;
+}
+
+static void diverged(const char *dev, int op, const char *expected) {
+  fprintf(
+    stderr,
+    "Replay diverged from the recording on %s: %s requested, "
+      "recording has %s\n",
+    dev,
+    ops[op].name,
+    expected
+  );
+  exit(EXIT_FAILURE);
+}
+
+static void sleep_ns(int64_t ns) {
+  struct timespec ts = {
+    .tv_sec  = ns / 1000000000,
+    .tv_nsec = ns % 1000000000
+  };
+
+  while (ns > 0 && nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+const struct scarlett2_session_event *scarlett2_session_replay(
+  const char *dev_name,
+  int         op,
+  long        in1,
+  long        in2
+) {
+  if (mode != SESSION_REPLAY)
+    return NULL;
+
+  pthread_mutex_lock(&session_lock);
+
+  struct session_dev *dev = get_dev(dev_name);
+  if (!dev) {
+    pthread_mutex_unlock(&session_lock);
+    diverged(dev_name, op, "no operations on this device");
+    return NULL;
+  }
+
+  struct scarlett2_session_event *ev;
+  int i = dev->cursor;
+
+  if (ops[op].polled) {
+
+    // the latest sample at the same time since the last in-order
+    // operation
+    int64_t target = dev->rec_align +
+                     (scarlett2_session_now() - dev->replay_align) *
+                       replay_speed;
+
+    if (i >= dev->count || events[dev->events[i]].op != op)
+      goto diverged;
+
+    while (i + 1 < dev->count &&
+           events[dev->events[i + 1]].op == op &&
+           events[dev->events[i + 1]].t <= target)
+      i++;
+
+    dev->cursor = i;
+    dev->sampled = 1;
+
+  } else {
+
+    // skip samples which weren't needed this time
+    while (i < dev->count && ops[events[dev->events[i]].op].polled)
+      i++;
+
+    if (i >= dev->count || events[dev->events[i]].op != op)
+      goto diverged;
+
+    dev->cursor = i + 1;
+    dev->sampled = 0;
+  }
+
+  ev = &events[dev->events[i]];
+
+  if ((ops[op].inputs >= 1 && ev->v[1] != in1) ||
+      (ops[op].inputs >= 2 && ev->v[2] != in2)) {
+    char expected[128];
+    snprintf(
+      expected, sizeof(expected), "%s=%ld %s=%ld (requested %ld %ld)",
+      ops[op].values[1], ev->v[1],
+      ops[op].values[2], ev->v[2],
+      in1, in2
+    );
+    pthread_mutex_unlock(&session_lock);
+    diverged(dev_name, op, expected);
+  }
+
+  pthread_mutex_unlock(&session_lock);
+
+  sleep_ns(ev->d / replay_speed);
+
+  if (!ops[op].polled) {
+    pthread_mutex_lock(&session_lock);
+    dev->rec_align = ev->t + ev->d;
+    dev->replay_align = scarlett2_session_now();
+    pthread_mutex_unlock(&session_lock);
+  }
+
+  return ev;
+
+diverged:
+  pthread_mutex_unlock(&session_lock);
+  diverged(
+    dev_name,
+    op,
+    i < dev->count ? ops[events[dev->events[i]].op].name : "nothing more"
+  );
+  return NULL;
+}
+
+void scarlett2_session_end(void) {
+  if (mode == SESSION_RECORD) {
+    fprintf(
+      record_file,
+      "end t=%lld\n",
+      (long long)(scarlett2_session_now() - start_ns)
+    );
+    if (fclose(record_file))
+      perror("Failed to write session file");
+    record_file = NULL;
+
+  } else if (mode == SESSION_REPLAY) {
+    int used = 0;
+
+    for (int i = 0; i < devs_count; i++)
+      used += devs[i].cursor + devs[i].sampled;
+
+    fprintf(
+      stderr,
+      "Replayed %d of %d device operations in %.3f s "
+        "(recorded session %.3f s)\n",
+      used,
+      events_count,
+      (scarlett2_session_now() - start_ns) / 1e9,
+      recorded_ns / 1e9
+    );
+  }
+
+  mode = SESSION_OFF;
+}
+
+void scarlett2_session_set_name(void *handle, const char *name) {
+  if (mode == SESSION_OFF)
+    return;
+
+  pthread_mutex_lock(&session_lock);
+
+  struct session_handle *p = realloc(
+    handles, sizeof(*p) * (handles_count + 1)
+  );
+  if (p) {
+    handles = p;
+    handles[handles_count].handle = handle;
+    snprintf(
+      handles[handles_count].name, sizeof(handles[handles_count].name),
+      "%s", name
+    );
+    handles_count++;
+  }
+
+  pthread_mutex_unlock(&session_lock);
+}
+
+void scarlett2_session_get_name(void *handle, char *name, size_t size) {
+  snprintf(name, size, "unknown");
+
+  if (mode == SESSION_OFF)
+    return;
+
+  pthread_mutex_lock(&session_lock);
+  for (int i = 0; i < handles_count; i++)
+    if (handles[i].handle == handle) {
+      snprintf(name, size, "%s", handles[i].name);
+      break;
+    }
+  pthread_mutex_unlock(&session_lock);
+}
+
+void scarlett2_session_clear_name(void *handle) {
+  if (mode == SESSION_OFF)
+    return;
+
+  pthread_mutex_lock(&session_lock);
+  for (int i = 0; i < handles_count; i++)
+    if (handles[i].handle == handle) {
+      handles[i] = handles[--handles_count];
+      break;
+    }
+  pthread_mutex_unlock(&session_lock);
+}
+
+void *scarlett2_session_new_handle(const char *name) {
+  void *handle = malloc(1);
+
+  if (handle)
+    scarlett2_session_set_name(handle, name);
+  return handle;
+}
+
+void scarlett2_session_free_handle(void *handle) {
+  scarlett2_session_clear_name(handle);
+  free(handle);
+}
@@ -0,0 +1,118 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_SESSION_H
+#define SCARLETT2_SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Device operations which are recorded and replayed
+enum scarlett2_session_op {
+  SCARLETT2_OP_OPEN,
+  SCARLETT2_OP_CLOSE,
+  SCARLETT2_OP_PVERSION,
+  SCARLETT2_OP_LOCK,
+  SCARLETT2_OP_UNLOCK,
+  SCARLETT2_OP_REBOOT,
+  SCARLETT2_OP_ERASE_CONFIG,
+  SCARLETT2_OP_ERASE_FIRMWARE,
+  SCARLETT2_OP_ERASE_PROGRESS,
+  SCARLETT2_OP_WRITE,
+  SCARLETT2_OP_CTL_OPEN,
+  SCARLETT2_OP_CTL_CLOSE,
+  SCARLETT2_OP_CTL_FIRMWARE_VERSION,
+  SCARLETT2_OP_CAPS,
+  SCARLETT2_OP_REBOOT_WAIT,
+  SCARLETT2_OP_COUNT
+};
+
+#define SCARLETT2_SESSION_VALUES 4
+
+// One device operation; v[0] is the result, the rest depend on the
+// op (e.g. offset and size for writes)
+struct scarlett2_session_event {
+  int64_t t;  // ns since the start of the session
+  int64_t d;  // ns duration
+  char    dev[32];
+  int     op;
+  long    v[SCARLETT2_SESSION_VALUES];
+};
+
+// A card as found at the start of the session
+struct scarlett2_session_card {
+  int  card_num;
+  int  pid;
+  int  firmware_version;
+  char serial[64];
+  char usb_path[32];
+};
+
+// Start recording to fn; the command line is saved so that the
+// session can be replayed
+int scarlett2_session_record_start(const char *fn, int argc, char **argv);
+
+// Load a recorded session for replay; returns the recorded command
+// line in argc/argv
+int scarlett2_session_replay_start(const char *fn, int *argc, char ***argv);
+
+// Start the loaded replay again from the beginning, as if it had
+// just been loaded
+void scarlett2_session_replay_rewind(void);
+
+// Replay speed-up: each operation takes 1/speed of the time it took
+// when recorded (default 1)
+void scarlett2_session_set_replay_speed(int speed);
+
+int scarlett2_session_recording(void);
+int scarlett2_session_replaying(void);
+
+// Name of an op as written in session files, e.g. "erase-progress"
+const char *scarlett2_session_op_name(int op);
+
+// Stop recording, or report on the replay
+void scarlett2_session_end(void);
+
+// Don't record operations made by this thread (set around composite
+// operations that are recorded as a whole)
+void scarlett2_session_suppress(int suppress);
+
+// Associate a name (e.g. "hw:1") with a device handle
+void scarlett2_session_set_name(void *handle, const char *name);
+void scarlett2_session_get_name(void *handle, char *name, size_t size);
+void scarlett2_session_clear_name(void *handle);
+
+// A placeholder handle for a device opened during replay
+void *scarlett2_session_new_handle(const char *name);
+void scarlett2_session_free_handle(void *handle);
+
+// Timestamp for scarlett2_session_record()
+int64_t scarlett2_session_now(void);
+
+// Record an operation on dev which started at start
+void scarlett2_session_record(
+  int64_t     start,
+  const char *dev,
+  int         op,
+  long        v0,
+  long        v1,
+  long        v2,
+  long        v3
+);
+
+// When replaying, wait for as long as the device took, and return
+// the recorded operation; in1 and in2 are checked against the
+// recorded request (e.g. write offset and size). Returns NULL if not
+// replaying. Exits if the replay has diverged from the recording.
+const struct scarlett2_session_event *scarlett2_session_replay(
+  const char *dev,
+  int         op,
+  long        in1,
+  long        in2
+);
+
+void scarlett2_session_add_card(struct scarlett2_session_card *card);
+
+struct scarlett2_session_card *scarlett2_session_get_cards(int *count);
+
+#endif // SCARLETT2_SESSION_H
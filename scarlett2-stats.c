@@ -0,0 +1,103 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "scarlett2-stats.h"
+
+double scarlett2_now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int scarlett2_stats_add(struct scarlett2_stats *stats, double sample) {
+  if (stats->count == stats->alloc) {
+    int alloc = stats->alloc ? stats->alloc * 2 : 64;
+    double *samples = realloc(stats->samples, sizeof(*samples) * alloc);
+
+    if (!samples)
+      return -1;
+    stats->samples = samples;
+    stats->alloc = alloc;
+  }
+
+  stats->samples[stats->count++] = sample;
+  stats->sorted = 0;
+  return 0;
+}
+
+static int double_cmp(const void *p1, const void *p2) {
+  double d1 = *(const double *)p1;
+  double d2 = *(const double *)p2;
+
+  return (d1 > d2) - (d1 < d2);
+}
+
+static void sort_samples(struct scarlett2_stats *stats) {
+  if (stats->sorted)
+    return;
+
+  qsort(stats->samples, stats->count, sizeof(*stats->samples), double_cmp);
+  stats->sorted = 1;
+}
+
+// nearest-rank percentile
+double scarlett2_stats_percentile(struct scarlett2_stats *stats, double p) {
+  if (!stats->count)
+    return 0;
+
+  sort_samples(stats);
+
+  int rank = ceil(p / 100 * stats->count);
+  if (rank < 1)
+    rank = 1;
+  if (rank > stats->count)
+    rank = stats->count;
+
+  return stats->samples[rank - 1];
+}
+
+double scarlett2_stats_min(struct scarlett2_stats *stats) {
+  return scarlett2_stats_percentile(stats, 0);
+}
+
+double scarlett2_stats_max(struct scarlett2_stats *stats) {
+  return scarlett2_stats_percentile(stats, 100);
+}
+
+double scarlett2_stats_mean(struct scarlett2_stats *stats) {
+  double sum = 0;
+
+  if (!stats->count)
+    return 0;
+
+  for (int i = 0; i < stats->count; i++)
+    sum += stats->samples[i];
+
+  return sum / stats->count;
+}
+
+double scarlett2_stats_stddev(struct scarlett2_stats *stats) {
+  double mean = scarlett2_stats_mean(stats);
+  double sum = 0;
+
+  if (stats->count < 2)
+    return 0;
+
+  for (int i = 0; i < stats->count; i++)
+    sum += (stats->samples[i] - mean) * (stats->samples[i] - mean);
+
+  return sqrt(sum / (stats->count - 1));
+}
+
+void scarlett2_stats_clear(struct scarlett2_stats *stats) {
+  free(stats->samples);
+  stats->samples = NULL;
+  stats->count = 0;
+  stats->alloc = 0;
+  stats->sorted = 0;
+}
@@ -0,0 +1,30 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_STATS_H
+#define SCARLETT2_STATS_H
+
+// A growable set of samples (usually latencies in microseconds)
+struct scarlett2_stats {
+  double *samples;
+  int     count;
+  int     alloc;
+  int     sorted;
+};
+
+// Current CLOCK_MONOTONIC time in microseconds
+double scarlett2_now_us(void);
+
+int scarlett2_stats_add(struct scarlett2_stats *stats, double sample);
+
+// p in [0, 100]; returns 0 if there are no samples
+double scarlett2_stats_percentile(struct scarlett2_stats *stats, double p);
+
+double scarlett2_stats_min(struct scarlett2_stats *stats);
+double scarlett2_stats_max(struct scarlett2_stats *stats);
+double scarlett2_stats_mean(struct scarlett2_stats *stats);
+double scarlett2_stats_stddev(struct scarlett2_stats *stats);
+
+void scarlett2_stats_clear(struct scarlett2_stats *stats);
+
+#endif // SCARLETT2_STATS_H
@@ -0,0 +1,135 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scarlett2-status.h"
+
+static const char *phase_names[SCARLETT2_PHASE_COUNT] = {
+  [SCARLETT2_PHASE_IDLE]           = "idle",
+  [SCARLETT2_PHASE_PREFLIGHT]      = "pre-flight",
+  [SCARLETT2_PHASE_RESET_CONFIG]   = "reset-config",
+  [SCARLETT2_PHASE_ERASE_FIRMWARE] = "erase-firmware",
+  [SCARLETT2_PHASE_WRITE]          = "write",
+  [SCARLETT2_PHASE_REBOOT]         = "reboot",
+  [SCARLETT2_PHASE_DONE]           = "done",
+  [SCARLETT2_PHASE_FAILED]         = "failed",
+  [SCARLETT2_PHASE_DEFERRED]       = "deferred"
+};
+
+const char *scarlett2_status_phase_name(uint32_t phase) {
+  if (phase >= SCARLETT2_PHASE_COUNT)
+    return "unknown";
+  return phase_names[phase];
+}
+
+// returns NULL without complaint if the page can't be created (e.g.
+// not running as root); the status page is optional
+struct scarlett2_status_page *scarlett2_status_create(const char *card_name) {
+  char fn[256];
+
+  if (mkdir(SCARLETT2_STATUS_DIR, 0755) < 0 && errno != EEXIST)
+    return NULL;
+
+  snprintf(fn, sizeof(fn), "%s/%s", SCARLETT2_STATUS_DIR, card_name);
+
+  int fd = open(fn, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return NULL;
+
+  if (ftruncate(fd, sizeof(struct scarlett2_status_page)) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  struct scarlett2_status_page *page = mmap(
+    NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+  );
+  close(fd);
+  if (page == MAP_FAILED)
+    return NULL;
+
+  // keep seq from any previous writer so readers can't mistake the
+  // new contents for a consistent copy of the old
+  size_t start = offsetof(struct scarlett2_status_page, writer_pid);
+
+  scarlett2_status_begin(page);
+  memset((char *)page + start, 0, sizeof(*page) - start);
+  page->magic = SCARLETT2_STATUS_MAGIC;
+  page->version = SCARLETT2_STATUS_VERSION;
+  page->writer_pid = getpid();
+  page->eta = -1;
+  snprintf(page->card_name, sizeof(page->card_name), "%s", card_name);
+  scarlett2_status_end(page);
+
+  return page;
+}
+
+void scarlett2_status_begin(struct scarlett2_status_page *page) {
+  __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void scarlett2_status_end(struct scarlett2_status_page *page) {
+  __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+void scarlett2_status_close(struct scarlett2_status_page *page) {
+  if (page)
+    munmap(page, sizeof(*page));
+}
+
+int scarlett2_status_read(
+  const char                   *fn,
+  struct scarlett2_status_page *status
+) {
+  int fd = open(fn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(*status)) {
+    close(fd);
+    return -1;
+  }
+
+  struct scarlett2_status_page *page = mmap(
+    NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0
+  );
+  close(fd);
+  if (page == MAP_FAILED)
+    return -1;
+
+  // give up if the writer is somehow always mid-update
+  int ret = -1;
+  for (int tries = 0; tries < 1000; tries++) {
+    uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1)
+      continue;
+
+    memcpy(status, page, sizeof(*status));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+      ret = 0;
+      break;
+    }
+  }
+
+  munmap(page, sizeof(*page));
+
+  if (ret == 0 &&
+      (status->magic != SCARLETT2_STATUS_MAGIC ||
+       status->version != SCARLETT2_STATUS_VERSION))
+    ret = -1;
+
+  return ret;
+}
@@ -0,0 +1,76 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Live status pages
+//
+// While operating on a card, its state is published in a small
+// fixed-layout file, /run/scarlett2/<card name>, which is mmapped
+// MAP_SHARED so monitors can map it read-only and watch without any
+// IPC with the writer.
+//
+// Consistency is by seqlock: the writer increments seq to an odd
+// value, updates the fields, then increments seq to an even value.
+// A reader copies the page and retries if seq was odd or changed
+// during the copy; readers never block the writer.
+// scarlett2_status_read() does this for you.
+
+#ifndef SCARLETT2_STATUS_H
+#define SCARLETT2_STATUS_H
+
+#include <stdint.h>
+
+#define SCARLETT2_STATUS_DIR "/run/scarlett2"
+
+#define SCARLETT2_STATUS_MAGIC 0x53325354 // "S2ST"
+#define SCARLETT2_STATUS_VERSION 1
+
+enum scarlett2_status_phase {
+  SCARLETT2_PHASE_IDLE,
+  SCARLETT2_PHASE_PREFLIGHT,
+  SCARLETT2_PHASE_RESET_CONFIG,
+  SCARLETT2_PHASE_ERASE_FIRMWARE,
+  SCARLETT2_PHASE_WRITE,
+  SCARLETT2_PHASE_REBOOT,
+  SCARLETT2_PHASE_DONE,
+  SCARLETT2_PHASE_FAILED,
+  SCARLETT2_PHASE_DEFERRED,
+  SCARLETT2_PHASE_COUNT
+};
+
+struct scarlett2_status_page {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;              // odd while being updated
+  int32_t  writer_pid;
+  uint32_t usb_pid;
+  uint32_t phase;            // enum scarlett2_status_phase
+  uint32_t firmware_version; // being written, or 0
+  uint32_t erase_percent;    // of the segment being erased
+  uint32_t erase_num_blocks;
+  uint32_t reserved;
+  uint64_t bytes_written;
+  uint64_t bytes_total;
+  double   rate;             // bytes/sec while writing
+  double   eta;              // seconds left in this phase, or -1
+  uint64_t phase_start_us;   // CLOCK_MONOTONIC
+  uint64_t updated_us;       // CLOCK_MONOTONIC
+  char     card_name[32];
+  char     serial[64];
+  char     usb_path[32];
+} __attribute__((aligned(8)));
+
+// Writer side
+struct scarlett2_status_page *scarlett2_status_create(const char *card_name);
+void scarlett2_status_begin(struct scarlett2_status_page *page);
+void scarlett2_status_end(struct scarlett2_status_page *page);
+void scarlett2_status_close(struct scarlett2_status_page *page);
+
+// Reader side; returns 0 on success, -1 on error
+int scarlett2_status_read(
+  const char                   *fn,
+  struct scarlett2_status_page *status
+);
+
+const char *scarlett2_status_phase_name(uint32_t phase);
+
+#endif // SCARLETT2_STATUS_H
@@ -0,0 +1,104 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Timeline of what the tool spent its time on, for --timeline
+//
+// Spans can be added from any thread and may overlap; each is shown
+// with its start time relative to when the timeline was enabled and
+// its duration.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "scarlett2-stats.h"
+#include "scarlett2-timeline.h"
+
+struct span {
+  double start_us;
+  double end_us;
+  char   dev[16];
+  char   what[128];
+};
+
+static pthread_mutex_t timeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static double timeline_start_us;
+static struct span *spans;
+static int span_count;
+static int span_alloc;
+
+void scarlett2_timeline_enable(void) {
+  timeline_start_us = scarlett2_now_us();
+}
+
+int scarlett2_timeline_enabled(void) {
+  return timeline_start_us != 0;
+}
+
+void scarlett2_timeline_add(
+  const char *dev,
+  const char *what,
+  double      start_us,
+  double      end_us
+) {
+  if (!scarlett2_timeline_enabled())
+    return;
+
+  pthread_mutex_lock(&timeline_lock);
+
+  if (span_count == span_alloc) {
+    int alloc = span_alloc ? span_alloc * 2 : 32;
+    struct span *new_spans = realloc(spans, sizeof(*spans) * alloc);
+
+    // the timeline is best-effort; drop spans rather than fail
+    if (!new_spans)
+      goto done;
+    spans = new_spans;
+    span_alloc = alloc;
+  }
+
+  struct span *span = &spans[span_count++];
+  span->start_us = start_us;
+  span->end_us = end_us;
+  snprintf(span->dev, sizeof(span->dev), "%s", dev ? dev : "");
+  snprintf(span->what, sizeof(span->what), "%s", what);
+
+done:
+  pthread_mutex_unlock(&timeline_lock);
+}
+
+static int span_cmp(const void *p1, const void *p2) {
+  const struct span *s1 = p1;
+  const struct span *s2 = p2;
+
+  return (s1->start_us > s2->start_us) - (s1->start_us < s2->start_us);
+}
+
+void scarlett2_timeline_print(void) {
+  if (!scarlett2_timeline_enabled())
+    return;
+
+  // keep it after anything already printed
+  fflush(stdout);
+
+  pthread_mutex_lock(&timeline_lock);
+
+  qsort(spans, span_count, sizeof(*spans), span_cmp);
+
+  fprintf(stderr, "\nTimeline (ms):\n");
+  fprintf(stderr, "  %10s %10s  %-8s %s\n", "start", "duration", "device", "step");
+  for (int i = 0; i < span_count; i++) {
+    struct span *span = &spans[i];
+
+    fprintf(
+      stderr,
+      "  %10.3f %10.3f  %-8s %s\n",
+      (span->start_us - timeline_start_us) / 1000,
+      (span->end_us - span->start_us) / 1000,
+      span->dev,
+      span->what
+    );
+  }
+
+  pthread_mutex_unlock(&timeline_lock);
+}
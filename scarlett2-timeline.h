@@ -0,0 +1,24 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_TIMELINE_H
+#define SCARLETT2_TIMELINE_H
+
+// Start collecting spans; times are shown relative to this call
+void scarlett2_timeline_enable(void);
+
+int scarlett2_timeline_enabled(void);
+
+// Add a span with start and end from scarlett2_now_us(); dev may be
+// NULL. Does nothing unless enabled.
+void scarlett2_timeline_add(
+  const char *dev,
+  const char *what,
+  double      start_us,
+  double      end_us
+);
+
+// Print the spans in order of start time to stderr
+void scarlett2_timeline_print(void);
+
+#endif // SCARLETT2_TIMELINE_H
@@ -0,0 +1,49 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Static (USDT) tracepoints for bpftrace/perf/SystemTap
+//
+// When <sys/sdt.h> is available at build time (systemtap-sdt-devel
+// on Fedora, systemtap-sdt-dev on Ubuntu), each TRACEn() compiles to a
+// single nop plus a note in the ELF file, so it costs nothing until a
+// tracer attaches. Without it, TRACEn() compiles to nothing.
+//
+// Probes (provider "scarlett2"):
+//
+//   enum_begin()
+//   enum_end(found_cards_count)
+//   header_parse(fn, pid, firmware_version, firmware_length)
+//   sha256_start(length)
+//   sha256_end(length, ok)
+//   erase_progress(card_num, percent (255 when done), num_blocks)
+//   write_start(card_num, offset, size)
+//   write_done(card_num, offset, size, result)
+//   reboot(card_num)
+//
+// See trace/*.bt for examples.
+
+#ifndef SCARLETT2_TRACE_H
+#define SCARLETT2_TRACE_H
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SCARLETT2_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef SCARLETT2_HAVE_SDT
+#define TRACE0(name) DTRACE_PROBE(scarlett2, name)
+#define TRACE1(name, a) DTRACE_PROBE1(scarlett2, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(scarlett2, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(scarlett2, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(scarlett2, name, a, b, c, d)
+#else
+#define TRACE0(name) do { } while (0)
+#define TRACE1(name, a) do { } while (0)
+#define TRACE2(name, a, b) do { } while (0)
+#define TRACE3(name, a, b, c) do { } while (0)
+#define TRACE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif // SCARLETT2_TRACE_H
@@ -0,0 +1,335 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Update state machine
+//
+// The update sequence (reset configuration, erase firmware, write,
+// reboot) as a state machine that never sleeps, so a GUI main loop or
+// one thread driving many cards can run it. Waiting is left to the
+// caller: between erase progress polls the deadline is
+// caps->erase_poll_ms away; otherwise it's now.
+//
+// The driver's hwdep device doesn't report poll() readiness, and a
+// write is a synchronous USB transfer of at most caps->max_write
+// bytes, so each update has a writer thread for the write phase:
+// step() sends it one write at a time over a pipe and returns, and
+// the thread reports the result over another pipe, which the caller
+// waits on. Writes to several cards driven from one thread then
+// overlap, as they would with a thread per card.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "scarlett2-ioctls.h"
+#include "scarlett2-stats.h"
+#include "scarlett2-trace.h"
+#include "scarlett2-update.h"
+
+void scarlett2_update_init(
+  struct scarlett2_update              *update,
+  snd_hwdep_t                          *hwdep,
+  struct scarlett2_caps                *caps,
+  const struct scarlett2_firmware_file *firmware,
+  int                                   phases,
+  int                                   card_num
+) {
+  *update = (struct scarlett2_update){
+    .hwdep    = hwdep,
+    .caps     = caps,
+    .firmware = firmware,
+    .phases   = firmware ? phases : phases & ~SCARLETT2_UPDATE_WRITE,
+    .card_num = card_num,
+    .state    = SCARLETT2_UPDATE_STATE_START
+  };
+}
+
+// a write for the writer thread, and its result
+struct write_request {
+  size_t offset;
+  size_t size;
+};
+
+struct write_result {
+  int    err;
+  double us;
+};
+
+static void *writer_thread(void *arg) {
+  struct scarlett2_update *update = arg;
+  struct write_request req;
+
+  // until stop_writer() closes the request pipe
+  while (read(update->request_fds[0], &req, sizeof(req)) == sizeof(req)) {
+    double start = scarlett2_now_us();
+
+    TRACE3(write_start, update->card_num, req.offset, req.size);
+    int err = scarlett2_write_firmware(
+      update->hwdep,
+      req.offset,
+      update->firmware->firmware_data + req.offset,
+      req.size
+    );
+    TRACE4(write_done, update->card_num, req.offset, req.size, err);
+
+    struct write_result res = { err, scarlett2_now_us() - start };
+    if (write(update->done_fds[1], &res, sizeof(res)) != sizeof(res))
+      break;
+  }
+
+  return NULL;
+}
+
+static void close_writer_fds(struct scarlett2_update *update) {
+  for (int i = 0; i < 2; i++) {
+    if (update->request_fds[i] >= 0)
+      close(update->request_fds[i]);
+    if (update->done_fds[i] >= 0)
+      close(update->done_fds[i]);
+    update->request_fds[i] = update->done_fds[i] = -1;
+  }
+}
+
+// returns 0, or a negative error code
+static int start_writer(struct scarlett2_update *update) {
+  update->request_fds[0] = update->request_fds[1] = -1;
+  update->done_fds[0] = update->done_fds[1] = -1;
+
+  // step() only reads a result when there is one
+  if (pipe(update->request_fds) < 0 ||
+      pipe(update->done_fds) < 0 ||
+      fcntl(update->done_fds[0], F_SETFL, O_NONBLOCK) < 0) {
+    int err = -errno;
+    close_writer_fds(update);
+    return err;
+  }
+
+  int err = pthread_create(&update->writer, NULL, writer_thread, update);
+  if (err) {
+    close_writer_fds(update);
+    return -err;
+  }
+
+  update->writer_started = 1;
+  return 0;
+}
+
+// only called with no write in progress, so the thread is waiting
+// for a request and exits straight away
+static void stop_writer(struct scarlett2_update *update) {
+  if (!update->writer_started)
+    return;
+
+  close(update->request_fds[1]);
+  update->request_fds[1] = -1;
+  pthread_join(update->writer, NULL);
+  close_writer_fds(update);
+  update->writer_started = 0;
+}
+
+static int fail(struct scarlett2_update *update, const char *what, int err) {
+  stop_writer(update);
+  update->failed = what;
+  update->err = err;
+  update->state = SCARLETT2_UPDATE_STATE_FAILED;
+  return update->state;
+}
+
+// move on to the next selected phase
+static int next_phase(struct scarlett2_update *update, double now) {
+  static const struct {
+    int phase;
+    int state;
+  } order[] = {
+    { SCARLETT2_UPDATE_RESET_CONFIG,   SCARLETT2_UPDATE_STATE_RESET_CONFIG },
+    { SCARLETT2_UPDATE_ERASE_FIRMWARE, SCARLETT2_UPDATE_STATE_ERASE_FIRMWARE },
+    { SCARLETT2_UPDATE_WRITE,          SCARLETT2_UPDATE_STATE_WRITE },
+    { SCARLETT2_UPDATE_REBOOT,         SCARLETT2_UPDATE_STATE_REBOOT },
+  };
+  int state = SCARLETT2_UPDATE_STATE_DONE;
+
+  for (int i = 0; i < sizeof(order) / sizeof(*order); i++)
+    if (order[i].state > update->state &&
+        (update->phases & order[i].phase)) {
+      state = order[i].state;
+      break;
+    }
+
+  update->state = state;
+  update->erase_requested = 0;
+  update->erase_progress = 0;
+  update->erase_num_blocks = 0;
+  update->deadline_us = now;
+  return state;
+}
+
+static int step_erase(struct scarlett2_update *update, double now) {
+  struct scarlett2_caps *caps = update->caps;
+  int config = update->state == SCARLETT2_UPDATE_STATE_RESET_CONFIG;
+
+  if (!update->erase_requested) {
+    int err = config
+      ? scarlett2_erase_config(update->hwdep)
+      : scarlett2_erase_firmware(update->hwdep);
+    if (err < 0)
+      return fail(
+        update,
+        config ? "reset configuration" : "erase upgrade firmware",
+        err
+      );
+
+    update->erase_requested = 1;
+    update->erase_change_us = now;
+    update->deadline_us = now;
+    return update->state;
+  }
+
+  int progress = scarlett2_get_erase_progress(
+    update->hwdep, &update->erase_num_blocks
+  );
+  TRACE3(
+    erase_progress, update->card_num, progress, update->erase_num_blocks
+  );
+  if (progress < 0)
+    return fail(update, "get erase progress", progress);
+
+  if (progress == 255)
+    return next_phase(update, now);
+
+  if (progress > update->erase_progress) {
+    update->erase_progress = progress;
+    update->erase_change_us = now;
+  } else if (progress < update->erase_progress && caps->reliable_progress) {
+    scarlett2_caps_set_unreliable_progress(caps);
+    return fail(update, "get erase progress (went backwards)", -EPROTO);
+  }
+
+  // progress below the last is ignored when it's known to be
+  // unreliable; only completion matters
+  if (now - update->erase_change_us >= caps->erase_stall_ms * 1000) {
+    scarlett2_caps_set_unreliable_progress(caps);
+    return fail(update, "get erase progress", -ETIMEDOUT);
+  }
+
+  update->deadline_us = now + caps->erase_poll_ms * 1000;
+  return update->state;
+}
+
+// pick up the result of the write in progress, if it's done
+static int finish_write(struct scarlett2_update *update) {
+  struct scarlett2_caps *caps = update->caps;
+  struct write_result res;
+
+  ssize_t len = read(update->done_fds[0], &res, sizeof(res));
+  if (len < 0 && errno == EAGAIN)
+    return update->state;
+
+  update->writing = 0;
+  if (len != sizeof(res))
+    return fail(update, "write firmware", len < 0 ? -errno : -EIO);
+
+  size_t size = update->write_size;
+  int err = res.err;
+  update->write_us = res.us;
+
+  // too big for this driver; nothing was written
+  if (err == -EINVAL && !caps->max_write &&
+      size > SCARLETT2_CAPS_SAFE_WRITE) {
+    scarlett2_caps_set_max_write(caps, SCARLETT2_CAPS_SAFE_WRITE);
+    return update->state;
+  }
+
+  if (err > 0 && !caps->max_write && (size_t)err < size)
+    scarlett2_caps_set_max_write(caps, err);
+
+  if (err < 0)
+    return fail(update, "write firmware", err);
+  if (!err)
+    return fail(update, "write firmware (no bytes written)", -EIO);
+
+  update->written += err;
+  return update->state;
+}
+
+static int step_write(struct scarlett2_update *update, double now) {
+  struct scarlett2_caps *caps = update->caps;
+  size_t len = update->firmware->header.firmware_length;
+  size_t offset = update->written;
+
+  if (update->writing)
+    return finish_write(update);
+
+  if (offset >= len) {
+    stop_writer(update);
+    return next_phase(update, now);
+  }
+
+  // if the driver's write size isn't known, offer everything and see
+  // how much it takes
+  size_t size = len - offset;
+  if (caps->max_write && size > caps->max_write)
+    size = caps->max_write;
+
+  if (!update->writer_started) {
+    int err = start_writer(update);
+    if (err < 0)
+      return fail(update, "start the firmware writer", err);
+  }
+
+  struct write_request req = { offset, size };
+  if (write(update->request_fds[1], &req, sizeof(req)) != sizeof(req))
+    return fail(update, "write firmware", -EIO);
+
+  update->writing = 1;
+  update->write_size = size;
+  return update->state;
+}
+
+int scarlett2_update_step(struct scarlett2_update *update) {
+  double now = scarlett2_now_us();
+
+  if (update->state >= SCARLETT2_UPDATE_STATE_DONE ||
+      now < update->deadline_us)
+    return update->state;
+
+  switch (update->state) {
+
+    case SCARLETT2_UPDATE_STATE_START:
+      return next_phase(update, now);
+
+    case SCARLETT2_UPDATE_STATE_RESET_CONFIG:
+    case SCARLETT2_UPDATE_STATE_ERASE_FIRMWARE:
+      return step_erase(update, now);
+
+    case SCARLETT2_UPDATE_STATE_WRITE:
+      return step_write(update, now);
+
+    case SCARLETT2_UPDATE_STATE_REBOOT: {
+      TRACE1(reboot, update->card_num);
+      int err = scarlett2_reboot(update->hwdep);
+      if (err < 0)
+        return fail(update, "reboot", err);
+      return next_phase(update, now);
+    }
+  }
+
+  return update->state;
+}
+
+int scarlett2_update_get_fd(struct scarlett2_update *update, short *events) {
+  if (!update->writing)
+    return -1;
+
+  *events = POLLIN;
+  return update->done_fds[0];
+}
+
+int scarlett2_update_timeout_ms(struct scarlett2_update *update) {
+  if (update->state >= SCARLETT2_UPDATE_STATE_DONE || update->writing)
+    return -1;
+
+  double remaining = update->deadline_us - scarlett2_now_us();
+
+  return remaining > 0 ? (int)(remaining / 1000) + 1 : 0;
+}
@@ -0,0 +1,106 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_UPDATE_H
+#define SCARLETT2_UPDATE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#include "scarlett2-caps.h"
+#include "scarlett2-firmware.h"
+
+// Phases of an update; a machine runs the selected ones in this order
+#define SCARLETT2_UPDATE_RESET_CONFIG   (1 << 0)
+#define SCARLETT2_UPDATE_ERASE_FIRMWARE (1 << 1)
+#define SCARLETT2_UPDATE_WRITE          (1 << 2)
+#define SCARLETT2_UPDATE_REBOOT         (1 << 3)
+#define SCARLETT2_UPDATE_ALL            0xf
+
+enum scarlett2_update_state {
+  SCARLETT2_UPDATE_STATE_START,
+  SCARLETT2_UPDATE_STATE_RESET_CONFIG,
+  SCARLETT2_UPDATE_STATE_ERASE_FIRMWARE,
+  SCARLETT2_UPDATE_STATE_WRITE,
+  SCARLETT2_UPDATE_STATE_REBOOT,
+  SCARLETT2_UPDATE_STATE_DONE,
+  SCARLETT2_UPDATE_STATE_FAILED
+};
+
+// A non-blocking update of one card, for callers with their own event
+// loop: call scarlett2_update_step() whenever the fd is ready or the
+// deadline has passed, until the state is DONE or FAILED. The card
+// must be open and locked; the caller waits for it to come back after
+// the reboot.
+struct scarlett2_update {
+  snd_hwdep_t                          *hwdep;
+  struct scarlett2_caps                *caps;
+  const struct scarlett2_firmware_file *firmware;
+  int                                   phases;
+  int                                   card_num;
+
+  int    state;
+
+  // erase phases: request sent, last progress (1..num_blocks, 255
+  // when done), and when it last moved
+  int    erase_requested;
+  int    erase_progress;
+  int    erase_num_blocks;
+  double erase_change_us;
+
+  // write phase: bytes written, and how long the last write took
+  size_t written;
+  double write_us;
+
+  // write phase: the writes are made by a thread of the update's own,
+  // which takes requests on request_fds and reports each result on
+  // done_fds; writing is set while a write is in progress
+  int       writer_started;
+  pthread_t writer;
+  int       request_fds[2];
+  int       done_fds[2];
+  int       writing;
+  size_t    write_size;
+
+  // scarlett2_now_us() time at which step() next has work to do
+  double deadline_us;
+
+  // on failure: what failed, and a negative error code
+  const char *failed;
+  int         err;
+};
+
+// firmware is only needed for the write phase; card_num is for
+// tracepoints
+void scarlett2_update_init(
+  struct scarlett2_update              *update,
+  snd_hwdep_t                          *hwdep,
+  struct scarlett2_caps                *caps,
+  const struct scarlett2_firmware_file *firmware,
+  int                                   phases,
+  int                                   card_num
+);
+
+// Advance without blocking: each call makes at most one device
+// request (an ioctl, or a write of at most caps->max_write bytes),
+// and returns after each change of state so the caller can act on it
+// before the new phase starts. Returns the state.
+//
+// A firmware write is a synchronous USB transfer, so step() hands it
+// to the update's writer thread and returns; a later step() picks up
+// the result once get_fd()'s fd is readable.
+int scarlett2_update_step(struct scarlett2_update *update);
+
+// While a firmware write is in progress, the fd which becomes readable
+// when it's done, with *events set to POLLIN; otherwise -1, and only
+// the deadline is to be waited for. (The driver's hwdep device itself
+// never reports poll() readiness.)
+int scarlett2_update_get_fd(struct scarlett2_update *update, short *events);
+
+// Milliseconds until the deadline, for poll(); 0 if step() can be
+// called now, -1 if there's no deadline: when finished, or while
+// waiting only for the fd
+int scarlett2_update_timeout_ms(struct scarlett2_update *update);
+
+#endif // SCARLETT2_UPDATE_H
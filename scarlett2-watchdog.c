@@ -0,0 +1,345 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Deadlines for blocking device calls
+//
+// With a deadline set, each call is made on its own helper thread
+// while the caller waits for it, for up to the deadline. A call can
+// get stuck in an uninterruptible wait in the driver, which nothing
+// in userspace can cancel, so a call which isn't back by its deadline
+// is abandoned rather than cancelled: the caller gets ETIMEDOUT and
+// its error path marks the card failed and closes it. The helper is
+// sent WATCHDOG_SIGNAL, whose handler is installed without
+// SA_RESTART, so that an interruptible wait ends straight away.
+//
+// The abandoned helper keeps the device handle, and its copy of the
+// call's data, until the call returns; closing the handle meanwhile
+// only releases its lock (see scarlett2_close()), and the helper
+// closes it once it's back.
+//
+// A thread per call costs tens of microseconds, against the
+// milliseconds of a USB transfer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "scarlett2-session.h"
+#include "scarlett2-stats.h"
+#include "scarlett2-watchdog.h"
+
+#define WATCHDOG_SIGNAL SIGURG
+
+struct call {
+  int            op;
+  char           dev[32];
+  void          *handle;
+  int          (*fn)(void *handle, void *data, size_t len);
+  double         start_us;
+  pthread_t      thread;
+  pthread_cond_t done_cond;
+  int            done;
+  int            result;
+
+  // once abandoned, the call is on the abandoned list, and close_fn
+  // is set if the handle was closed while it was blocked
+  int            abandoned;
+  int          (*close_fn)(void *handle);
+  struct call   *next;
+
+  size_t         len;
+  unsigned char  data[];
+};
+
+struct op_stats {
+  struct scarlett2_stats latency_us;
+  int                    overdue;
+};
+
+static pthread_mutex_t watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t watchdog_once = PTHREAD_ONCE_INIT;
+static int deadline_ms = SCARLETT2_WATCHDOG_DEFAULT_MS;
+static int stats_enabled;
+static struct call *abandoned;
+static struct op_stats op_stats[SCARLETT2_OP_COUNT];
+
+static void watchdog_signal_handler(int sig) {
+}
+
+static void install_signal_handler(void) {
+  struct sigaction sa = { .sa_handler = watchdog_signal_handler };
+
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(WATCHDOG_SIGNAL, &sa, NULL) < 0)
+    perror("sigaction");
+}
+
+// call with watchdog_lock held
+static void add_latency(int op, double latency_us) {
+  if (stats_enabled)
+    scarlett2_stats_add(&op_stats[op].latency_us, latency_us);
+}
+
+// call with watchdog_lock held
+static struct call *find_abandoned(void *handle) {
+  for (struct call *call = abandoned; call; call = call->next)
+    if (call->handle == handle)
+      return call;
+
+  return NULL;
+}
+
+static void *call_thread(void *arg) {
+  struct call *call = arg;
+  int result = call->fn(call->handle, call->data, call->len);
+  double elapsed_ms = (scarlett2_now_us() - call->start_us) / 1000;
+
+  pthread_mutex_lock(&watchdog_lock);
+
+  call->result = result;
+  call->done = 1;
+
+  // the caller is still waiting, and frees the call
+  if (!call->abandoned) {
+    pthread_cond_signal(&call->done_cond);
+    pthread_mutex_unlock(&watchdog_lock);
+    return NULL;
+  }
+
+  struct call **p = &abandoned;
+  while (*p != call)
+    p = &(*p)->next;
+  *p = call->next;
+
+  add_latency(call->op, elapsed_ms * 1000);
+
+  pthread_mutex_unlock(&watchdog_lock);
+
+  fprintf(
+    stderr,
+    "Card %s: abandoned %s returned after %.0f ms\n",
+    call->dev,
+    scarlett2_session_op_name(call->op),
+    elapsed_ms
+  );
+
+  if (call->close_fn)
+    call->close_fn(call->handle);
+
+  pthread_cond_destroy(&call->done_cond);
+  free(call);
+
+  return NULL;
+}
+
+// make the call on this thread
+static int call_direct(
+  int          op,
+  void        *handle,
+  int        (*fn)(void *handle, void *data, size_t len),
+  const void  *in,
+  void        *out,
+  size_t       len
+) {
+  unsigned char *data = len ? calloc(1, len) : NULL;
+
+  if (len && !data)
+    return -ENOMEM;
+  if (in)
+    memcpy(data, in, len);
+
+  double start_us = scarlett2_now_us();
+  int result = fn(handle, data, len);
+
+  pthread_mutex_lock(&watchdog_lock);
+  add_latency(op, scarlett2_now_us() - start_us);
+  pthread_mutex_unlock(&watchdog_lock);
+
+  if (out)
+    memcpy(out, data, len);
+  free(data);
+
+  return result;
+}
+
+static struct call *new_call(
+  int          op,
+  const char  *dev,
+  void        *handle,
+  int        (*fn)(void *handle, void *data, size_t len),
+  const void  *in,
+  size_t       len
+) {
+  struct call *call = calloc(1, sizeof(*call) + len);
+  pthread_condattr_t attr;
+
+  if (!call)
+    return NULL;
+
+  call->op = op;
+  snprintf(call->dev, sizeof(call->dev), "%s", dev);
+  call->handle = handle;
+  call->fn = fn;
+  call->len = len;
+  if (in)
+    memcpy(call->data, in, len);
+
+  // the deadline is on the monotonic clock, like scarlett2_now_us()
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&call->done_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  return call;
+}
+
+void scarlett2_watchdog_set_deadline(int ms) {
+  deadline_ms = ms;
+}
+
+void scarlett2_watchdog_enable_stats(void) {
+  stats_enabled = 1;
+}
+
+int scarlett2_watchdog_call(
+  int          op,
+  const char  *dev,
+  void        *handle,
+  int        (*fn)(void *handle, void *data, size_t len),
+  const void  *in,
+  void        *out,
+  size_t       len
+) {
+  if (!deadline_ms)
+    return call_direct(op, handle, fn, in, out, len);
+
+  pthread_once(&watchdog_once, install_signal_handler);
+
+  pthread_mutex_lock(&watchdog_lock);
+  int stuck = find_abandoned(handle) != NULL;
+  pthread_mutex_unlock(&watchdog_lock);
+
+  // the device hasn't answered the last call yet
+  if (stuck)
+    return -ETIMEDOUT;
+
+  struct call *call = new_call(op, dev, handle, fn, in, len);
+  if (!call)
+    return call_direct(op, handle, fn, in, out, len);
+
+  pthread_attr_t attr;
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += deadline_ms / 1000;
+  deadline.tv_nsec += (long)(deadline_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  pthread_mutex_lock(&watchdog_lock);
+
+  call->start_us = scarlett2_now_us();
+  int err = pthread_create(&call->thread, &attr, call_thread, call);
+  pthread_attr_destroy(&attr);
+
+  if (err) {
+    pthread_mutex_unlock(&watchdog_lock);
+    pthread_cond_destroy(&call->done_cond);
+    free(call);
+    return call_direct(op, handle, fn, in, out, len);
+  }
+
+  while (!call->done && !err)
+    err = pthread_cond_timedwait(&call->done_cond, &watchdog_lock, &deadline);
+
+  if (call->done) {
+    int result = call->result;
+
+    add_latency(op, scarlett2_now_us() - call->start_us);
+    pthread_mutex_unlock(&watchdog_lock);
+
+    if (out)
+      memcpy(out, call->data, len);
+    pthread_cond_destroy(&call->done_cond);
+    free(call);
+
+    return result;
+  }
+
+  // leave it to the helper
+  call->abandoned = 1;
+  call->next = abandoned;
+  abandoned = call;
+  op_stats[op].overdue++;
+  pthread_kill(call->thread, WATCHDOG_SIGNAL);
+
+  pthread_mutex_unlock(&watchdog_lock);
+
+  fprintf(
+    stderr,
+    "Card %s: %s blocked for %d ms; abandoning it\n",
+    dev,
+    scarlett2_session_op_name(op),
+    deadline_ms
+  );
+
+  return -ETIMEDOUT;
+}
+
+int scarlett2_watchdog_close(void *handle, int (*close_fn)(void *handle)) {
+  pthread_mutex_lock(&watchdog_lock);
+
+  struct call *call = find_abandoned(handle);
+  if (call)
+    call->close_fn = close_fn;
+
+  pthread_mutex_unlock(&watchdog_lock);
+
+  return call != NULL;
+}
+
+void scarlett2_watchdog_print_stats(void) {
+  int header = 0;
+
+  fflush(stdout);
+
+  pthread_mutex_lock(&watchdog_lock);
+
+  for (int op = 0; op < SCARLETT2_OP_COUNT; op++) {
+    struct op_stats *stats = &op_stats[op];
+
+    if (!stats->latency_us.count)
+      continue;
+
+    if (!header) {
+      fprintf(
+        stderr,
+        "\n%-22s %7s %9s %9s %9s %7s\n",
+        "operation", "count", "p50 ms", "p99 ms", "max ms", "overdue"
+      );
+      header = 1;
+    }
+
+    fprintf(
+      stderr,
+      "%-22s %7d %9.3f %9.3f %9.3f %7d\n",
+      scarlett2_session_op_name(op),
+      stats->latency_us.count,
+      scarlett2_stats_percentile(&stats->latency_us, 50) / 1000,
+      scarlett2_stats_percentile(&stats->latency_us, 99) / 1000,
+      scarlett2_stats_max(&stats->latency_us) / 1000,
+      stats->overdue
+    );
+  }
+
+  pthread_mutex_unlock(&watchdog_lock);
+}
@@ -0,0 +1,49 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SCARLETT2_WATCHDOG_H
+#define SCARLETT2_WATCHDOG_H
+
+#include <stddef.h>
+
+// Default deadline for a blocking device call; every call the driver
+// makes to the device completes in well under a second
+#define SCARLETT2_WATCHDOG_DEFAULT_MS 10000
+
+// Set the deadline for each blocking device call; 0 disables the
+// watchdog
+void scarlett2_watchdog_set_deadline(int ms);
+
+// Collect the latency of each call by op, for
+// scarlett2_watchdog_print_stats()
+void scarlett2_watchdog_enable_stats(void);
+
+// Make a blocking device call, fn(handle, data, len), and return its
+// result (op is a SCARLETT2_OP_*; dev is the ALSA device name, for
+// messages). data is len bytes of the call's arguments and results,
+// copied from in and then back to out (either may be NULL).
+//
+// With a deadline set, the call is made on a helper thread with its
+// own copy of data. If it's not back by the deadline, it's abandoned
+// and this returns -ETIMEDOUT; the helper keeps the handle until the
+// call returns, and later calls on the handle fail with -ETIMEDOUT
+// straight away.
+int scarlett2_watchdog_call(
+  int          op,
+  const char  *dev,
+  void        *handle,
+  int        (*fn)(void *handle, void *data, size_t len),
+  const void  *in,
+  void        *out,
+  size_t       len
+);
+
+// If an abandoned call on handle hasn't returned yet, leave closing
+// the handle with close_fn(handle) to its helper and return 1;
+// otherwise return 0, for the caller to close it
+int scarlett2_watchdog_close(void *handle, int (*close_fn)(void *handle));
+
+// Print the count, p50/p99/max latency, and overdue calls by op
+void scarlett2_watchdog_print_stats(void);
+
+#endif // SCARLETT2_WATCHDOG_H
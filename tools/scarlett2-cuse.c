@@ -0,0 +1,736 @@
+// SPDX-FileCopyrightText: 2024 Geoffrey D. Bennett <g@b4.vu>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Virtual Scarlett2 devices for testing the unmodified binary
+// (experimental: not yet run against /dev/cuse)
+//
+// Creates, with CUSE, a hwdep and a control device node for each
+// virtual card, which implement the SCARLETT2_IOCTL_* ioctls and
+// firmware writes as the driver does (with configurable erase, write,
+// and reboot timing), and the Firmware Version control. It speaks the
+// kernel's CUSE protocol from <linux/fuse.h> directly, so it doesn't
+// need libfuse.
+//
+// The nodes are created as /dev/NAME/hwC<n>D0 and /dev/NAME/controlC<n>
+// rather than in /dev/snd, so they don't clash with real cards, and a
+// matching /proc/asound and /sys tree is written to DIR. To use them,
+// bind-mount them over the real ones in a private mount namespace:
+//
+//   scarlett2-cuse --cards 16 &
+//   unshare -m sh -c '
+//     mount --bind /dev/scarlett2-cuse /dev/snd
+//     mount --bind /run/scarlett2-cuse/asound /proc/asound
+//     mount --bind /run/scarlett2-cuse/sys /sys
+//     scarlett2 update --yes ...'
+//
+// alsa-lib only enumerates cards 0 to 31, so that's the most that can
+// be used at once.
+//
+// Each node is served by its own thread; like the driver, requests
+// to a card are handled one at a time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fuse.h>
+#include <sound/asound.h>
+
+#include "../scarlett2.h"
+
+#define CUSE_DEVICE "/dev/cuse"
+
+#define MAX_CARDS 32
+
+// the request buffer must hold the largest write, plus headers
+#define MAX_WRITE 65536
+#define REQUEST_SIZE (MAX_WRITE + 4096)
+
+// the driver's 1024-byte request less its offset and pad
+#define FLASH_WRITE_MAX 1016
+
+#define FLASH_BLOCK_SIZE 65536
+
+enum flash_state {
+  FLASH_IDLE,
+  FLASH_ERASING,
+  FLASH_WRITE
+};
+
+struct card {
+  int             num;
+  char            serial[16];
+  char            usb_path[16];
+
+  pthread_mutex_t lock;
+  int             firmware_version;
+  int             segment;
+  int             flash_state;
+  int             erase_blocks;
+  double          erase_start_ms;
+  size_t          written;
+
+  // the card is "disconnected" until then
+  double          reboot_until_ms;
+};
+
+struct node {
+  struct card *card;
+  int          is_ctl;
+  char         devname[64];
+  int          fd;
+  pthread_t    thread;
+};
+
+static int card_count = 1;
+static int first_card = 1;
+static int pid = 0x8211;
+static int firmware_version = 1605;
+static int update_to;
+static int settings_blocks = 1;
+static int firmware_blocks = 16;
+static int erase_block_ms = 50;
+static int write_us = 1000;
+static int reboot_ms = 3000;
+static const char *dev_name = "scarlett2-cuse";
+static const char *tree_dir = "/run/scarlett2-cuse";
+
+static struct card cards[MAX_CARDS];
+static struct node nodes[MAX_CARDS * 2];
+
+static double now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// send a reply: err, or the iovs after the header
+static void reply(
+  int           fd,
+  uint64_t      unique,
+  int           err,
+  struct iovec *iov,
+  int           iov_count
+) {
+  struct fuse_out_header out = { .error = err, .unique = unique };
+  struct iovec iovs[4] = { { &out, sizeof(out) } };
+
+  out.len = sizeof(out);
+  for (int i = 0; !err && i < iov_count; i++) {
+    iovs[i + 1] = iov[i];
+    out.len += iov[i].iov_len;
+  }
+
+  // fails if the request was interrupted, which is fine
+  if (writev(fd, iovs, err ? 1 : iov_count + 1) < 0 && errno != ENOENT)
+    perror("writev");
+}
+
+static void reply_data(int fd, uint64_t unique, void *data, size_t len) {
+  struct iovec iov = { data, len };
+
+  reply(fd, unique, 0, &iov, len ? 1 : 0);
+}
+
+// call with card->lock held
+static int is_rebooting(struct card *card) {
+  return now_ms() < card->reboot_until_ms;
+}
+
+// erase progress as the driver reports it: 1 to num_blocks while
+// erasing, then 255
+static void get_erase_progress(
+  struct card                                   *card,
+  struct scarlett2_flash_segment_erase_progress *progress
+) {
+  int blocks = (now_ms() - card->erase_start_ms) / erase_block_ms;
+
+  progress->num_blocks = card->erase_blocks;
+  if (blocks < card->erase_blocks) {
+    progress->progress = blocks + 1;
+    return;
+  }
+
+  progress->progress = 255;
+  card->flash_state = FLASH_WRITE;
+}
+
+// the driver's ioctls; returns the result, and fills in out
+static int hwdep_ioctl(
+  struct card *card,
+  unsigned int cmd,
+  const void  *in,
+  void        *out
+) {
+  switch (cmd) {
+    case SNDRV_HWDEP_IOCTL_PVERSION:
+      *(int *)out = SNDRV_HWDEP_VERSION;
+      return 0;
+
+    case SNDRV_HWDEP_IOCTL_INFO: {
+      struct snd_hwdep_info *info = out;
+
+      memset(info, 0, sizeof(*info));
+      info->card = card->num;
+      snprintf((char *)info->id, sizeof(info->id), "scarlett2");
+      snprintf((char *)info->name, sizeof(info->name), "Focusrite SC2");
+      return 0;
+    }
+
+    case SCARLETT2_IOCTL_PVERSION:
+      *(int *)out = SCARLETT2_HWDEP_VERSION;
+      return 0;
+
+    case SCARLETT2_IOCTL_REBOOT:
+      if (card->flash_state == FLASH_WRITE && card->written && update_to)
+        card->firmware_version = update_to;
+      card->segment = -1;
+      card->flash_state = FLASH_IDLE;
+      card->written = 0;
+      card->reboot_until_ms = now_ms() + reboot_ms;
+      return 0;
+
+    case SCARLETT2_IOCTL_SELECT_FLASH_SEGMENT: {
+      int segment = *(const int *)in;
+
+      if (segment < 0 || segment >= SCARLETT2_SEGMENT_ID_COUNT)
+        return -EINVAL;
+      if (card->flash_state == FLASH_ERASING)
+        return -EBUSY;
+      card->segment = segment;
+      card->flash_state = FLASH_IDLE;
+      return 0;
+    }
+
+    case SCARLETT2_IOCTL_ERASE_FLASH_SEGMENT:
+      if (card->segment < 0)
+        return -EINVAL;
+      if (card->flash_state == FLASH_ERASING)
+        return -EBUSY;
+      card->flash_state = FLASH_ERASING;
+      card->erase_blocks =
+        card->segment == SCARLETT2_SEGMENT_ID_SETTINGS ?
+          settings_blocks : firmware_blocks;
+      card->erase_start_ms = now_ms();
+      card->written = 0;
+      return 0;
+
+    case SCARLETT2_IOCTL_GET_ERASE_PROGRESS:
+      if (card->flash_state != FLASH_ERASING)
+        return -EINVAL;
+      get_erase_progress(card, out);
+      return 0;
+  }
+
+  return -ENOTTY;
+}
+
+// the control ioctls alsa-lib and the binary use
+static int ctl_ioctl(
+  struct card *card,
+  unsigned int cmd,
+  const void  *in,
+  void        *out
+) {
+  switch (cmd) {
+    case SNDRV_CTL_IOCTL_PVERSION:
+      *(int *)out = SNDRV_CTL_VERSION;
+      return 0;
+
+    case SNDRV_CTL_IOCTL_CARD_INFO: {
+      struct snd_ctl_card_info *info = out;
+
+      memset(info, 0, sizeof(*info));
+      info->card = card->num;
+      snprintf((char *)info->id, sizeof(info->id), "USB");
+      snprintf((char *)info->driver, sizeof(info->driver), "USB-Audio");
+      snprintf((char *)info->name, sizeof(info->name), "Scarlett2 (virtual)");
+      return 0;
+    }
+
+    case SNDRV_CTL_IOCTL_SUBSCRIBE_EVENTS:
+      *(int *)out = 0;
+      return 0;
+
+    case SNDRV_CTL_IOCTL_ELEM_INFO: {
+      struct snd_ctl_elem_info *info = out;
+
+      memcpy(info, in, sizeof(*info));
+      if (info->id.iface != SNDRV_CTL_ELEM_IFACE_CARD ||
+          strcmp((char *)info->id.name, "Firmware Version"))
+        return -ENOENT;
+      info->id.numid = 1;
+      info->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+      info->access =
+        SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE;
+      info->count = 1;
+      info->value.integer.min = 0;
+      info->value.integer.max = INT_MAX;
+      return 0;
+    }
+
+    case SNDRV_CTL_IOCTL_ELEM_READ: {
+      struct snd_ctl_elem_value *value = out;
+
+      memcpy(value, in, sizeof(*value));
+      if ((value->id.numid != 1 &&
+           (value->id.iface != SNDRV_CTL_ELEM_IFACE_CARD ||
+            strcmp((char *)value->id.name, "Firmware Version"))))
+        return -ENOENT;
+      value->id.numid = 1;
+      value->value.integer.value[0] = card->firmware_version;
+      return 0;
+    }
+  }
+
+  return -ENOTTY;
+}
+
+static void handle_ioctl(
+  struct node            *node,
+  struct fuse_in_header  *header,
+  struct fuse_ioctl_in   *arg
+) {
+  struct card *card = node->card;
+  struct fuse_ioctl_out out = { 0 };
+  unsigned char out_data[4096] = { 0 };
+
+  if (arg->out_size > sizeof(out_data)) {
+    reply(node->fd, header->unique, -EINVAL, NULL, 0);
+    return;
+  }
+
+  pthread_mutex_lock(&card->lock);
+  if (is_rebooting(card))
+    out.result = -ENODEV;
+  else if (node->is_ctl)
+    out.result = ctl_ioctl(card, arg->cmd, arg + 1, out_data);
+  else
+    out.result = hwdep_ioctl(card, arg->cmd, arg + 1, out_data);
+  pthread_mutex_unlock(&card->lock);
+
+  // a failing ioctl returns -1 with errno set to -result
+  struct iovec iov[2] = {
+    { &out, sizeof(out) },
+    { out_data, out.result < 0 ? 0 : arg->out_size }
+  };
+  reply(node->fd, header->unique, 0, iov, 2);
+}
+
+// a firmware write, as the driver does it: only to the erased
+// firmware segment, in order, and at most FLASH_WRITE_MAX at a time
+static int hwdep_write(struct card *card, size_t size) {
+  if (card->segment != SCARLETT2_SEGMENT_ID_FIRMWARE)
+    return -EINVAL;
+
+  // the driver waits for the erase to finish
+  if (card->flash_state == FLASH_ERASING) {
+    struct scarlett2_flash_segment_erase_progress progress;
+
+    get_erase_progress(card, &progress);
+    if (progress.progress != 255)
+      return -EBUSY;
+  }
+  if (card->flash_state != FLASH_WRITE)
+    return -EINVAL;
+
+  if (card->written + size > (size_t)firmware_blocks * FLASH_BLOCK_SIZE)
+    return -ENOSPC;
+
+  if (size > FLASH_WRITE_MAX)
+    size = FLASH_WRITE_MAX;
+
+  usleep(write_us);
+  card->written += size;
+
+  return size;
+}
+
+static void handle_write(
+  struct node           *node,
+  struct fuse_in_header *header,
+  struct fuse_write_in  *arg
+) {
+  struct card *card = node->card;
+  int result = -EINVAL;
+
+  pthread_mutex_lock(&card->lock);
+  if (is_rebooting(card))
+    result = -ENODEV;
+  else if (!node->is_ctl)
+    result = hwdep_write(card, arg->size);
+  pthread_mutex_unlock(&card->lock);
+
+  if (result < 0) {
+    reply(node->fd, header->unique, result, NULL, 0);
+    return;
+  }
+
+  struct fuse_write_out out = { .size = result };
+  reply_data(node->fd, header->unique, &out, sizeof(out));
+}
+
+static void handle_open(struct node *node, struct fuse_in_header *header) {
+  struct card *card = node->card;
+
+  pthread_mutex_lock(&card->lock);
+  int rebooting = is_rebooting(card);
+  pthread_mutex_unlock(&card->lock);
+
+  if (rebooting) {
+    reply(node->fd, header->unique, -ENODEV, NULL, 0);
+    return;
+  }
+
+  struct fuse_open_out out = { 0 };
+  reply_data(node->fd, header->unique, &out, sizeof(out));
+}
+
+static void handle_init(struct node *node, struct fuse_in_header *header) {
+  struct cuse_init_out out = {
+    .major     = FUSE_KERNEL_VERSION,
+    .minor     = FUSE_KERNEL_MINOR_VERSION,
+    .max_read  = MAX_WRITE,
+    .max_write = MAX_WRITE
+  };
+  char info[80];
+  int len = snprintf(info, sizeof(info), "DEVNAME=%s", node->devname) + 1;
+  struct iovec iov[2] = { { &out, sizeof(out) }, { info, len } };
+
+  reply(node->fd, header->unique, 0, iov, 2);
+}
+
+static void *node_thread(void *arg) {
+  struct node *node = arg;
+  char *buf = malloc(REQUEST_SIZE);
+
+  if (!buf) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    ssize_t len = read(node->fd, buf, REQUEST_SIZE);
+
+    if (len < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == ENOENT)
+        continue;
+      perror(node->devname);
+      exit(EXIT_FAILURE);
+    }
+
+    struct fuse_in_header *header = (struct fuse_in_header *)buf;
+    void *arg = header + 1;
+
+    if ((size_t)len < sizeof(*header))
+      continue;
+
+    switch (header->opcode) {
+      case CUSE_INIT:
+        handle_init(node, header);
+        break;
+
+      case FUSE_OPEN:
+        handle_open(node, header);
+        break;
+
+      case FUSE_RELEASE:
+      case FUSE_FLUSH:
+        reply(node->fd, header->unique, 0, NULL, 0);
+        break;
+
+      case FUSE_WRITE:
+        handle_write(node, header, arg);
+        break;
+
+      case FUSE_IOCTL:
+        handle_ioctl(node, header, arg);
+        break;
+
+      // requests are answered too quickly to be worth interrupting
+      case FUSE_INTERRUPT:
+        break;
+
+      default:
+        reply(node->fd, header->unique, -ENOSYS, NULL, 0);
+    }
+  }
+
+  return NULL;
+}
+
+static void write_file(const char *path, const char *contents) {
+  FILE *f = fopen(path, "w");
+
+  if (!f || fputs(contents, f) < 0 || fclose(f)) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void make_dir(const char *path) {
+  if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// the /proc/asound and /sys entries that the binary reads for a card
+static void write_card_tree(struct card *card) {
+  char path[PATH_MAX];
+  char target[PATH_MAX];
+  char contents[64];
+
+  snprintf(path, sizeof(path), "%s/asound/card%d", tree_dir, card->num);
+  make_dir(path);
+  snprintf(
+    path, sizeof(path), "%s/asound/card%d/usbid", tree_dir, card->num
+  );
+  snprintf(contents, sizeof(contents), "1235:%04x\n", pid);
+  write_file(path, contents);
+
+  snprintf(
+    path, sizeof(path), "%s/sys/devices/virtual-usb/%s",
+    tree_dir, card->usb_path
+  );
+  make_dir(path);
+  snprintf(
+    path, sizeof(path), "%s/sys/devices/virtual-usb/%s/%s:1.0",
+    tree_dir, card->usb_path, card->usb_path
+  );
+  make_dir(path);
+  snprintf(
+    path, sizeof(path), "%s/sys/devices/virtual-usb/%s/serial",
+    tree_dir, card->usb_path
+  );
+  snprintf(contents, sizeof(contents), "%s\n", card->serial);
+  write_file(path, contents);
+
+  snprintf(
+    path, sizeof(path), "%s/sys/class/sound/card%d", tree_dir, card->num
+  );
+  make_dir(path);
+  snprintf(
+    path, sizeof(path), "%s/sys/class/sound/card%d/device",
+    tree_dir, card->num
+  );
+  snprintf(
+    target, sizeof(target), "../../../devices/virtual-usb/%s/%s:1.0",
+    card->usb_path, card->usb_path
+  );
+  unlink(path);
+  if (symlink(target, path) < 0) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void write_tree(void) {
+  const char *dirs[] = {
+    "", "/asound", "/sys", "/sys/devices", "/sys/devices/virtual-usb",
+    "/sys/class", "/sys/class/sound", NULL
+  };
+  char path[PATH_MAX];
+
+  for (int i = 0; dirs[i]; i++) {
+    snprintf(path, sizeof(path), "%s%s", tree_dir, dirs[i]);
+    make_dir(path);
+  }
+
+  // as /proc/asound/cards lists them
+  snprintf(path, sizeof(path), "%s/asound/cards", tree_dir);
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < card_count; i++) {
+    write_card_tree(&cards[i]);
+    fprintf(
+      f, "%2d [USB            ]: USB-Audio - Scarlett2 (virtual)\n"
+         "                      Focusrite Scarlett2 (virtual) %s\n",
+      cards[i].num, cards[i].serial
+    );
+  }
+  if (fclose(f)) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void start_node(struct node *node) {
+  node->fd = open(CUSE_DEVICE, O_RDWR | O_CLOEXEC);
+  if (node->fd < 0) {
+    perror(CUSE_DEVICE);
+    exit(EXIT_FAILURE);
+  }
+
+  int err = pthread_create(&node->thread, NULL, node_thread, node);
+  if (err) {
+    fprintf(stderr, "Unable to start thread: %s\n", strerror(err));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void usage(const char *program_name) {
+  printf(
+    "Usage: %s [options]\n"
+    "\n"
+    "Options:\n"
+    "  --cards NUM           Number of virtual cards (default 1)\n"
+    "  --first-card NUM      Number of the first card (default 1)\n"
+    "  --pid HEX             USB product ID (default 8211)\n"
+    "  --firmware VERSION    Firmware version reported (default 1605)\n"
+    "  --update-to VERSION   Firmware version reported after a\n"
+    "                        firmware write and reboot (default: the\n"
+    "                        same as before)\n"
+    "  --settings-blocks NUM Blocks in the settings segment (default 1)\n"
+    "  --firmware-blocks NUM Blocks in the firmware segment (default 16)\n"
+    "  --erase-block-ms MS   Time to erase each block (default 50)\n"
+    "  --write-us US         Time for each firmware write (default 1000)\n"
+    "  --reboot-ms MS        Time the card is gone while rebooting\n"
+    "                        (default 3000)\n"
+    "  --name NAME           Create the nodes in /dev/NAME\n"
+    "                        (default scarlett2-cuse)\n"
+    "  --dir DIR             Write the /proc/asound and /sys trees to\n"
+    "                        DIR (default /run/scarlett2-cuse)\n",
+    program_name
+  );
+}
+
+static int parse_int(const char *name, const char *value, int base, int min) {
+  char *end;
+
+  errno = 0;
+  long n = strtol(value, &end, base);
+  if (errno || *end || n < min || n > INT_MAX) {
+    fprintf(stderr, "Invalid argument '%s' for %s\n", value, name);
+    exit(EXIT_FAILURE);
+  }
+
+  return n;
+}
+
+static void parse_args(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (!strcmp(arg, "--help")) {
+      usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    }
+
+    if (!value) {
+      fprintf(stderr, "Invalid argument '%s'\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    i++;
+
+    if (!strcmp(arg, "--cards"))
+      card_count = parse_int(arg, value, 10, 1);
+    else if (!strcmp(arg, "--first-card"))
+      first_card = parse_int(arg, value, 10, 0);
+    else if (!strcmp(arg, "--pid"))
+      pid = parse_int(arg, value, 16, 0);
+    else if (!strcmp(arg, "--firmware"))
+      firmware_version = parse_int(arg, value, 10, 0);
+    else if (!strcmp(arg, "--update-to"))
+      update_to = parse_int(arg, value, 10, 0);
+    else if (!strcmp(arg, "--settings-blocks"))
+      settings_blocks = parse_int(arg, value, 10, 1);
+    else if (!strcmp(arg, "--firmware-blocks"))
+      firmware_blocks = parse_int(arg, value, 10, 1);
+    else if (!strcmp(arg, "--erase-block-ms"))
+      erase_block_ms = parse_int(arg, value, 10, 1);
+    else if (!strcmp(arg, "--write-us"))
+      write_us = parse_int(arg, value, 10, 0);
+    else if (!strcmp(arg, "--reboot-ms"))
+      reboot_ms = parse_int(arg, value, 10, 0);
+    else if (!strcmp(arg, "--name"))
+      dev_name = value;
+    else if (!strcmp(arg, "--dir"))
+      tree_dir = value;
+    else {
+      fprintf(stderr, "Invalid argument '%s'\n", arg);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (first_card + card_count > MAX_CARDS) {
+    fprintf(
+      stderr,
+      "Cards must be numbered below %d (alsa-lib doesn't enumerate "
+        "higher ones)\n",
+      MAX_CARDS
+    );
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  sigset_t signals;
+  int sig;
+
+  parse_args(argc, argv);
+
+  // the nodes go when the process exits
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  for (int i = 0; i < card_count; i++) {
+    struct card *card = &cards[i];
+    struct node *hwdep = &nodes[i * 2];
+    struct node *ctl = &nodes[i * 2 + 1];
+
+    card->num = first_card + i;
+    snprintf(card->serial, sizeof(card->serial), "VIRT%04d", card->num);
+    snprintf(card->usb_path, sizeof(card->usb_path), "9-%d", card->num);
+    pthread_mutex_init(&card->lock, NULL);
+    card->firmware_version = firmware_version;
+    card->segment = -1;
+
+    hwdep->card = card;
+    snprintf(
+      hwdep->devname, sizeof(hwdep->devname), "%s/hwC%dD0",
+      dev_name, card->num
+    );
+    ctl->card = card;
+    ctl->is_ctl = 1;
+    snprintf(
+      ctl->devname, sizeof(ctl->devname), "%s/controlC%d",
+      dev_name, card->num
+    );
+  }
+
+  write_tree();
+
+  for (int i = 0; i < card_count * 2; i++)
+    start_node(&nodes[i]);
+
+  printf(
+    "%d virtual card%s in /dev/%s; /proc/asound and /sys trees in %s\n",
+    card_count,
+    card_count > 1 ? "s" : "",
+    dev_name,
+    tree_dir
+  );
+  fflush(stdout);
+
+  sigwait(&signals, &sig);
+
+  return 0;
+}